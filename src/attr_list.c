@@ -153,12 +153,12 @@ static void set_strikethrough(GtkLabel *label, gboolean mode)
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-GList *find_h_item(GList *list,GtkWidget *w, GList *e)
+GList *find_h_item(GList *list,GtkWidget *w, guint64 id)
 {
 	GList *i;
 	for ( i=list; NULL != i; i=i->next){
 		struct s_item_info *it=(struct s_item_info *)i->data;
-		if( (NULL == w || it->item ==w) && it->element==e){/**found it  */
+		if( (NULL == w || it->item ==w) && it->id==id){/**found it  */
 			  /*printf("Found %p\n",i);	fflush(NULL); */
 			return i;
 		}
@@ -171,7 +171,7 @@ GList *find_h_item(GList *list,GtkWidget *w, GList *e)
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-static void add_h_item(struct history_info *h, GtkWidget *w, GList* element, gint which)
+static void add_h_item(struct history_info *h, GtkWidget *w, guint64 id, gint which)
 {
 	GList *ele;
 	GList *op=NULL;
@@ -187,10 +187,10 @@ static void add_h_item(struct history_info *h, GtkWidget *w, GList* element, gin
 			return;
 	}
 	struct s_item_info *i;
-	if(NULL == (ele=find_h_item(op,w,element) ) ){
+	if(NULL == (ele=find_h_item(op,w,id) ) ){
 		if(NULL != (i=g_malloc(sizeof(struct s_item_info)) ) ){
 			i->item=w;
-			i->element=element;
+			i->id=id;
 			switch(which){
 				case OPERATE_DELETE:
 					h->delete_list=g_list_prepend(op,(gpointer)i);
@@ -208,13 +208,13 @@ static void add_h_item(struct history_info *h, GtkWidget *w, GList* element, gin
 /***************************************************************************/
 /** Delete an item from the history delete list.
 h->delete_list is a GList. The data points to a struct s_item_info, which
-contains a widget and an element - these latter two are part of the history 
-menu, so we just need to de-allocate the delete_list structure, and delete it 
-from the list.
+contains a widget of the history menu and the id of the history item, so we
+just need to de-allocate the delete_list structure, and delete it from the
+list.
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-static void rm_h_item(struct history_info *h, GtkWidget *w, GList* element, gint which)
+static void rm_h_item(struct history_info *h, GtkWidget *w, guint64 id, gint which)
 {
 	GList *i;
 	GList *op;
@@ -226,7 +226,7 @@ static void rm_h_item(struct history_info *h, GtkWidget *w, GList* element, gint
 			op=h->persist_list;
 			break;
 	}
-	if(NULL != (i=find_h_item(op,w,element) ) ){
+	if(NULL != (i=find_h_item(op,w,id) ) ){
 		/*printf("Freeing %p\n",i->data); */
 		g_free(i->data);
 		i->data=NULL;
@@ -254,22 +254,15 @@ void remove_deleted_items(struct history_info *h)
 {
 	if(NULL != h && NULL != h->delete_list){/**have a list of items to delete.  */
 		GList *i;
-		g_mutex_lock(hist_lock);
 		/*g_print("Deleting items\n"); */
 		for (i=h->delete_list; NULL != i; i=i->next){
 			struct s_item_info *it=(struct s_item_info *)i->data;
-			/*printf("Free %p.. '%s' ",it->element->data,(char *)(it->((struct history_item *(element->data))->text))); */
-			g_free(it->element->data);
-			it->element->data=NULL;
-			history_list = g_list_delete_link(history_list, it->element);
+			history_delete_item(it->id);
 			/** printf("Free %p\n",it);
 			fflush(NULL);*/
 			g_free(it);
 		}
 		h->delete_list=NULL;
-		g_mutex_unlock(hist_lock);
-		if (get_pref_int32("save_history"))
-		  save_history();
 	}	
 }
 /***************************************************************************/
@@ -278,36 +271,30 @@ the delete list, which gets called when the history window closes.
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-void handle_marking(struct history_info *h, GtkWidget *w, gint index, gint which)
+void handle_marking(struct history_info *h, GtkWidget *w, guint64 id, gint which)
 {
   GtkLabel *l=(GtkLabel *)(gtk_bin_get_child((GtkBin*)w)) ;
-	GList* element = g_list_nth(history_list, index);
 	if(OPERATE_DELETE == which){
 		if(is_strikethrough(l)){ /**un-highlight  */
 			set_strikethrough(l,FALSE);
-			rm_h_item(h,w,element,OPERATE_DELETE);
+			rm_h_item(h,w,id,OPERATE_DELETE);
 		}
 		else {
 			/*g_printf("marking %p ",element); */
 			set_strikethrough(l,TRUE);
-			add_h_item(h,w,element,OPERATE_DELETE);
+			add_h_item(h,w,id,OPERATE_DELETE);
 		}
 	}else if(OPERATE_PERSIST == which){
-		struct history_item *c=(struct history_item *)(element->data);
-		if(NULL !=c){
-			if(c->flags & CLIP_TYPE_PERSISTENT)
-				c->flags&=~(CLIP_TYPE_PERSISTENT);
-			else
-				c->flags|=CLIP_TYPE_PERSISTENT;
-			h->change_flag|=CLIP_TYPE_PERSISTENT;
-			}
+		struct history_item *c=history_lookup(id);
+		if(NULL !=c)
+			history_set_item_flags(c, c->flags ^ CLIP_TYPE_PERSISTENT);
 		if(is_underline(l)){ /**un-highlight  */
 			set_underline(l,FALSE);
-			rm_h_item(h,w,element,OPERATE_PERSIST);
+			rm_h_item(h,w,id,OPERATE_PERSIST);
 		}
 		else {
 			set_underline(l,TRUE);
-			add_h_item(h,w,element,OPERATE_PERSIST);
+			add_h_item(h,w,id,OPERATE_PERSIST);
 		}
 	}
 	
@@ -24,8 +24,8 @@
 #define OPERATE_DELETE 1 /**delete_list  */
 #define OPERATE_PERSIST 2	/**persist_list  */
 
-GList *find_h_item(GList *list,GtkWidget *w, GList *e);
+GList *find_h_item(GList *list,GtkWidget *w, guint64 id);
 void remove_deleted_items(struct history_info *h);
-void handle_marking(struct history_info *h, GtkWidget *w, gint index, gint which);
+void handle_marking(struct history_info *h, GtkWidget *w, guint64 id, gint which);
 #endif
 
@@ -0,0 +1,376 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        clipboard_fetch.c
+\n\b Description: Asynchronous retrieval of the selection contents.
+
+The gtk_clipboard_wait_*() functions spin a nested main loop until the
+selection owner replies, so a slow or hung owner froze everything else. A
+fetch here is a small state machine on the gtk_clipboard_request_*()
+functions instead:
+
+  IDLE -> (size limit set) LENGTH -> TEXT -> (no text, emptiness asked for) TARGETS -> IDLE
+
+The TEXT stage receives UTF8_STRING with a selection_receiver, which takes
+the transfer chunk by chunk. Only an owner that refuses UTF8_STRING goes
+through gtk_clipboard_request_text(), for the older text targets. Either
+way, the text is handed over as a shared text validated as UTF-8. The
+receiver writes contents above the blob threshold to the blob store, and
+hands over their preview.
+
+With the capture_limit preference set, the owner is first asked for the
+LENGTH of the selection. Contents larger than the limit are then not
+transferred at all, unless their beginning is kept (capture_truncate).
+Many owners don't support LENGTH; the receiver stops a transfer once it
+grows past the limit.
+
+Each fetch has a timeout, which a transfer still making progress extends; a
+fetch that times out ends with no text, like one that failed. A newer fetch
+of the same selection (the owner changed again) supersedes the one in
+flight. GTK can't cancel a request, so each one carries the serial of its
+fetch, and the replies to the abandoned ones are dropped.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+enum fetch_state {
+	FETCH_IDLE,
+	FETCH_LENGTH,
+	FETCH_TEXT,
+	FETCH_TARGETS,
+};
+
+struct clipboard_fetch {
+	GtkClipboard *clipboard;
+	struct selection_receiver *receiver;
+	clipboard_fetch_func func;
+	gpointer data;
+	enum fetch_state state;
+	guint serial;          /**of the current fetch  */
+	gboolean check_empty;
+	gsize limit;           /**bytes, 0 if none  */
+	gboolean truncate;     /**keep the beginning of larger contents  */
+	gsize spill;           /**bytes, larger contents are received into the blob store  */
+	guint timeout_id;
+	gint64 started;        /**monotonic time  */
+};
+
+/**the user data of a GTK request  */
+struct fetch_request {
+	struct clipboard_fetch *fetch;
+	guint serial;
+};
+
+struct fetch_stats {
+	guint started;
+	guint completed;
+	guint timeouts;
+	guint superseded;   /**by a newer fetch of the same selection  */
+	guint cancelled;    /**by our own change of the selection  */
+	guint lengths;      /**owners that told the size  */
+	guint too_large;    /**contents skipped for the size  */
+	guint truncated;
+	guint stale;        /**replies that came after their fetch was abandoned  */
+	gint64 latency_last;
+	gint64 latency_max;
+	gint64 latency_total;
+};
+
+static struct fetch_stats stats;
+
+static void on_text_streamed(struct shared_text *text, enum selection_receive_result result, gpointer data);
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct clipboard_fetch *clipboard_fetch_new(GtkClipboard *clipboard, GdkAtom selection,
+	clipboard_fetch_func func, gpointer data)
+{
+	struct clipboard_fetch * fetch = g_new0(struct clipboard_fetch, 1);
+	fetch->clipboard = clipboard;
+	fetch->receiver = selection_receiver_new(selection, on_text_streamed, fetch);
+	fetch->func = func;
+	fetch->data = data;
+	return fetch;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+gboolean clipboard_fetch_busy(const struct clipboard_fetch *fetch)
+{
+	return fetch && FETCH_IDLE != fetch->state;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static struct fetch_request *fetch_request_new(struct clipboard_fetch *fetch)
+{
+	struct fetch_request * request = g_slice_new(struct fetch_request);
+	request->fetch = fetch;
+	request->serial = fetch->serial;
+	return request;
+}
+
+/***************************************************************************/
+/** Frees the request.
+\n\b Arguments:
+\n\b Returns:	its fetch, or NULL if the reply is to an abandoned fetch.
+****************************************************************************/
+static struct clipboard_fetch *fetch_request_finish(struct fetch_request *request)
+{
+	struct clipboard_fetch * fetch = request->fetch;
+	gboolean current = (request->serial == fetch->serial && FETCH_IDLE != fetch->state);
+
+	g_slice_free(struct fetch_request, request);
+	if (!current) {
+		stats.stale++;
+		return NULL;
+	}
+	return fetch;
+}
+
+/***************************************************************************/
+/** Ends the fetch in flight. Its replies are dropped from now on.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void fetch_stop(struct clipboard_fetch *fetch)
+{
+	if (fetch->timeout_id) {
+		g_source_remove(fetch->timeout_id);
+		fetch->timeout_id = 0;
+	}
+	selection_receiver_cancel(fetch->receiver);
+	fetch->state = FETCH_IDLE;
+	fetch->serial++;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void fetch_complete(struct clipboard_fetch *fetch, struct shared_text *text, gboolean empty)
+{
+	gint64 latency = g_get_monotonic_time() - fetch->started;
+
+	fetch_stop(fetch);
+	stats.completed++;
+	stats.latency_last = latency;
+	stats.latency_max = MAX(stats.latency_max, latency);
+	stats.latency_total += latency;
+
+	fetch->func(fetch->clipboard, text, empty, fetch->data);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_targets_received(GtkClipboard *clipboard, GdkAtom *atoms, gint n_atoms, gpointer data)
+{
+	struct clipboard_fetch * fetch = fetch_request_finish((struct fetch_request *) data);
+	if (fetch)
+		fetch_complete(fetch, NULL, n_atoms <= 0);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_text_received(GtkClipboard *clipboard, const gchar *text, gpointer data)
+{
+	struct clipboard_fetch * fetch = fetch_request_finish((struct fetch_request *) data);
+	gchar * copy;
+	gsize len;
+
+	if (!fetch)
+		return;
+	if (!text && fetch->check_empty) {
+		fetch->state = FETCH_TARGETS;
+		gtk_clipboard_request_targets(clipboard, on_targets_received, fetch_request_new(fetch));
+		return;
+	}
+	if (!text) {
+		fetch_complete(fetch, NULL, FALSE);
+		return;
+	}
+	len = strlen(text);
+	if (fetch->limit && len > fetch->limit) {
+		if (!fetch->truncate) {
+			stats.too_large++;
+			fetch_complete(fetch, NULL, FALSE);
+			return;
+		}
+		/**cut at a character boundary  */
+		len = fetch->limit;
+		while (len > 0 && (text[len] & 0xC0) == 0x80)
+			len--;
+		stats.truncated++;
+	}
+	/**GTK frees its copy after the callback  */
+	copy = g_strndup(text, len);
+	fetch_complete(fetch, shared_text_take(copy, validate_utf8_text(copy, len)), FALSE);
+}
+
+/***************************************************************************/
+/** The end of the TEXT stage with the receiver.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_text_streamed(struct shared_text *text, enum selection_receive_result result, gpointer data)
+{
+	struct clipboard_fetch * fetch = (struct clipboard_fetch *) data;
+
+	switch (result) {
+		case SELECTION_REFUSED:
+			/**no owner, or one that only knows the older targets  */
+			gtk_clipboard_request_text(fetch->clipboard, on_text_received, fetch_request_new(fetch));
+			return;
+		case SELECTION_TOO_LARGE:
+			stats.too_large++;
+			break;
+		case SELECTION_TRUNCATED:
+			stats.truncated++;
+			break;
+		default:
+			break;
+	}
+	fetch_complete(fetch, text, FALSE);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_length_received(GtkClipboard *clipboard, GtkSelectionData *data, gpointer user_data)
+{
+	struct clipboard_fetch * fetch = fetch_request_finish((struct fetch_request *) user_data);
+
+	if (!fetch)
+		return;
+	/**an INTEGER, which GTK passes as a C long  */
+	if (gtk_selection_data_get_format(data) == 32 &&
+		gtk_selection_data_get_length(data) >= (gint) sizeof(long)) {
+		gulong size = *(const gulong *) gtk_selection_data_get_data(data);
+		stats.lengths++;
+		if (size > fetch->limit && !fetch->truncate) {
+			stats.too_large++;
+			fetch_complete(fetch, NULL, FALSE);
+			return;
+		}
+	}
+	fetch->state = FETCH_TEXT;
+	selection_receiver_start(fetch->receiver, fetch->limit, fetch->truncate, fetch->spill);
+}
+
+/***************************************************************************/
+/** Gives up on an owner that doesn't reply, or a transfer that stalled. The
+callback is called with no text, as when the fetch fails.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean on_fetch_timeout(gpointer data)
+{
+	struct clipboard_fetch * fetch = (struct clipboard_fetch *) data;
+
+	/**a large transfer takes its time, as long as it goes on  */
+	if (FETCH_TEXT == fetch->state &&
+		g_get_monotonic_time() - selection_receiver_activity(fetch->receiver) < CLIPBOARD_FETCH_TIMEOUT * 1000)
+		return TRUE;
+	fetch->timeout_id = 0;
+	fetch_stop(fetch);
+	stats.timeouts++;
+	fetch->func(fetch->clipboard, NULL, FALSE, fetch->data);
+	return FALSE;
+}
+
+/***************************************************************************/
+/** Gives up on the fetch in flight, if any. The callback isn't called.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void clipboard_fetch_cancel(struct clipboard_fetch *fetch)
+{
+	if (FETCH_IDLE != fetch->state) {
+		stats.cancelled++;
+		fetch_stop(fetch);
+	}
+}
+
+/***************************************************************************/
+/** Starts fetching the text of the selection, giving up on the fetch in
+flight, if any.
+\n\b Arguments:	check_empty - if there is no text, find out whether the
+selection is empty.
+\n\b Returns:
+****************************************************************************/
+void clipboard_fetch_start(struct clipboard_fetch *fetch, gboolean check_empty)
+{
+	if (FETCH_IDLE != fetch->state)
+		stats.superseded++;
+	fetch_stop(fetch);
+
+	fetch->check_empty = check_empty;
+	fetch->limit = (gsize) get_pref_int32("capture_limit") * 1024;
+	fetch->truncate = get_pref_int32("capture_truncate");
+	fetch->spill = (gsize) get_pref_int32("blob_threshold") * 1024;
+	fetch->started = g_get_monotonic_time();
+	fetch->timeout_id = g_timeout_add(CLIPBOARD_FETCH_TIMEOUT, on_fetch_timeout, fetch);
+	stats.started++;
+
+	if (fetch->limit && !fetch->truncate) {
+		fetch->state = FETCH_LENGTH;
+		gtk_clipboard_request_contents(fetch->clipboard, gdk_atom_intern_static_string("LENGTH"),
+			on_length_received, fetch_request_new(fetch));
+		return;
+	}
+	fetch->state = FETCH_TEXT;
+	selection_receiver_start(fetch->receiver, fetch->limit, fetch->truncate, fetch->spill);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void clipboard_fetch_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Clipboard fetches: %u, completed: %u, timed out: %u, superseded: %u, cancelled: %u, late replies: %u\n"
+		  "Fetch latency: last %.1f ms, max %.1f ms, average %.1f ms\n"
+		  "Sizes told: %u, contents too large: %u, truncated: %u\n"),
+		stats.started, stats.completed, stats.timeouts, stats.superseded, stats.cancelled, stats.stale,
+		stats.latency_last / 1000.0, stats.latency_max / 1000.0,
+		stats.completed ? stats.latency_total / 1000.0 / stats.completed : 0.0,
+		stats.lengths, stats.too_large, stats.truncated);
+}
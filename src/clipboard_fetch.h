@@ -0,0 +1,48 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CLIPBOARD_FETCH_H
+#define CLIPBOARD_FETCH_H
+
+G_BEGIN_DECLS
+
+/**a selection owner that hasn't replied by then is given up on  */
+#define CLIPBOARD_FETCH_TIMEOUT 1500 /**ms  */
+
+struct clipboard_fetch;
+
+/**called with the text, valid UTF-8 (the function takes the reference), or
+ with NULL and, if it was asked for, whether the selection has no targets at all  */
+typedef void (*clipboard_fetch_func)(GtkClipboard *clipboard, struct shared_text *text, gboolean empty, gpointer data);
+
+struct clipboard_fetch *clipboard_fetch_new(GtkClipboard *clipboard, GdkAtom selection,
+	clipboard_fetch_func func, gpointer data);
+
+void clipboard_fetch_start(struct clipboard_fetch *fetch, gboolean check_empty);
+
+void clipboard_fetch_cancel(struct clipboard_fetch *fetch);
+
+gboolean clipboard_fetch_busy(const struct clipboard_fetch *fetch);
+
+void clipboard_fetch_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
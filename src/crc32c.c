@@ -0,0 +1,120 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        crc32c.c
+\n\b Description: CRC-32C, with the SSE 4.2 instruction where the CPU has it.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 /**reversed  */
+
+typedef guint32 (*crc32c_func)(guint32 crc, const guchar *p, gsize len);
+
+static guint32 table[256];
+static crc32c_func impl = NULL;
+
+/***************************************************************************/
+/** A byte at a time, with the table.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static guint32 crc32c_soft(guint32 crc, const guchar *p, gsize len)
+{
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32C_SSE42
+/***************************************************************************/
+/** Eight bytes at a time, with the crc32 instruction.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+__attribute__((target("sse4.2")))
+static guint32 crc32c_sse42(guint32 crc, const guchar *p, gsize len)
+{
+#ifdef __x86_64__
+	guint64 c = crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		guint64 v;
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = (guint32) c;
+#else
+	for (; len >= 4; p += 4, len -= 4) {
+		guint32 v;
+		memcpy(&v, p, sizeof(v));
+		crc = _mm_crc32_u32(crc, v);
+	}
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+/***************************************************************************/
+/** Picks the implementation for the CPU. Thread-safe, the writer thread
+checksums too.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static crc32c_func crc32c_init(void)
+{
+	static gsize once = 0;
+
+	if (g_once_init_enter(&once)) {
+		guint32 i, j;
+		for (i = 0; i < 256; i++) {
+			guint32 crc = i;
+			for (j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+			table[i] = crc;
+		}
+		impl = crc32c_soft;
+#ifdef CRC32C_SSE42
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2"))
+			impl = crc32c_sse42;
+#endif
+		g_once_init_leave(&once, 1);
+	}
+	return impl;
+}
+
+/***************************************************************************/
+/** Continues the CRC over more data. The CRC isn't inverted, crc32c() does
+that for the whole data.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+guint32 crc32c_update(guint32 crc, const void *data, gsize len)
+{
+	return crc32c_init()(crc, (const guchar *) data, len);
+}
@@ -0,0 +1,36 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+G_BEGIN_DECLS
+
+guint32 crc32c_update(guint32 crc, const void *data, gsize len);
+
+/**CRC-32C (Castagnoli) of the data  */
+static inline guint32 crc32c(const void *data, gsize len)
+{
+	return ~crc32c_update(~0U, data, len);
+}
+
+G_END_DECLS
+
+#endif
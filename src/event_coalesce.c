@@ -0,0 +1,154 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        event_coalesce.c
+\n\b Description: Coalescing and rate limiting of selection owner changes.
+
+Some owners (terminals, IDEs, remote desktop clients) take the selection
+again dozens of times a second. Each event is handled as follows:
+
+ - with no window open, it is handled right away, and a window opens;
+ - within the window, it is merged: the event is handled once the window
+   closes, together with the others merged into it.
+
+A window that merged EVENT_COALESCE_STORM events or more was a storm. The
+next window is twice as long, up to EVENT_COALESCE_MAX_WINDOW, so a
+misbehaving owner is backed off further the longer it keeps on. The window
+shrinks back once the owner calms down. A change to another owner is
+handled right away, and its window starts at the configured length again.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+struct event_coalesce {
+	event_coalesce_func func;
+	gpointer data;
+	GdkNativeWindow owner;  /**of the last event  */
+	guint window;           /**ms, the current length, with the backoff  */
+	guint merged;           /**events merged in the open window  */
+	guint timeout_id;       /**the open window  */
+};
+
+struct coalesce_stats {
+	guint events;
+	guint handled;
+	guint merged;       /**events handled together with others  */
+	guint backoffs;     /**windows lengthened for a storm  */
+	guint window_max;
+};
+
+static struct coalesce_stats stats;
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct event_coalesce *event_coalesce_new(event_coalesce_func func, gpointer data)
+{
+	struct event_coalesce *c = g_new0(struct event_coalesce, 1);
+	c->func = func;
+	c->data = data;
+	return c;
+}
+
+static gboolean on_window_closed(gpointer data);
+
+/***************************************************************************/
+/** Handles the event(s), and opens a window for the ones to come.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void coalesce_handle(struct event_coalesce *c)
+{
+	c->merged = 0;
+	stats.handled++;
+	stats.window_max = MAX(stats.window_max, c->window);
+	if (c->window)
+		c->timeout_id = g_timeout_add(c->window, on_window_closed, c);
+	c->func(c->data);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean on_window_closed(gpointer data)
+{
+	struct event_coalesce *c = (struct event_coalesce *) data;
+	guint base = get_pref_int32("coalesce_window");
+
+	c->timeout_id = 0;
+	if (!c->merged) {
+		/**calm, back to the configured window  */
+		c->window = base;
+		return FALSE;
+	}
+
+	if (c->merged >= EVENT_COALESCE_STORM) {
+		c->window = MIN(MAX(c->window * 2, base), EVENT_COALESCE_MAX_WINDOW);
+		stats.backoffs++;
+	} else {
+		c->window = MAX(c->window / 2, base);
+	}
+	coalesce_handle(c);
+	return FALSE;
+}
+
+/***************************************************************************/
+/** An owner change: handles it now, or merges it into the open window.
+\n\b Arguments:	window - the configured length of the window, ms; 0 disables
+the coalescing.
+\n\b Returns:
+****************************************************************************/
+void event_coalesce_push(struct event_coalesce *c, GdkNativeWindow owner, guint window)
+{
+	stats.events++;
+	if (owner != c->owner || !c->window) {
+		/**another owner isn't held back by the storm of the previous one  */
+		if (c->timeout_id) {
+			g_source_remove(c->timeout_id);
+			c->timeout_id = 0;
+		}
+		c->owner = owner;
+		c->window = window;
+	}
+
+	if (c->timeout_id) {
+		c->merged++;
+		stats.merged++;
+		return;
+	}
+	coalesce_handle(c);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void event_coalesce_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Owner change events: %u, handled: %u, merged: %u, storm backoffs: %u, longest window: %u ms\n"),
+		stats.events, stats.handled, stats.merged, stats.backoffs, stats.window_max);
+}
@@ -0,0 +1,43 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_COALESCE_H
+#define EVENT_COALESCE_H
+
+G_BEGIN_DECLS
+
+/**the longest a noisy owner is backed off to  */
+#define EVENT_COALESCE_MAX_WINDOW 2000 /**ms  */
+
+/**a window with this many merged events is a storm, and doubles the next one  */
+#define EVENT_COALESCE_STORM 3
+
+struct event_coalesce;
+
+typedef void (*event_coalesce_func)(gpointer data);
+
+struct event_coalesce *event_coalesce_new(event_coalesce_func func, gpointer data);
+
+void event_coalesce_push(struct event_coalesce *c, GdkNativeWindow owner, guint window);
+
+void event_coalesce_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
@@ -36,9 +36,76 @@
 
 typedef struct {
 	guint   mouse_button;
-	guint32 activate_time;
+	guint32 activate_time; /**X time of the key press or the click  */
+	gint64  requested;     /**monotonic time of the key press or the click  */
+	guint   retries;
 } history_menu_query_t;
 
+/**from the key press (or click) to the popup mapped on the screen. The X
+ time of the event is converted to the monotonic clock with an offset taken
+ once, so the time the event spent in the X queue and in the keybinder is
+ counted, and reading the X server's time isn't needed at each popup  */
+#define POPUP_FRAME_MS 16
+
+static struct {
+	gint64 pending;    /**requested time of the popup being shown, 0 if none  */
+	guint count;
+	guint sub_frame;   /**shown within POPUP_FRAME_MS  */
+	guint32 last;
+	guint32 max;
+	guint64 total;
+	gboolean calibrated;
+	guint32 server_base;   /**X server time...  */
+	gint64 monotonic_base; /**...and the monotonic time of the same moment  */
+} popup_latency;
+
+/**the callbacks of a menu item get a pointer to the id of its history item,
+ which is owned by the menu item  */
+#define MENU_ITEM_ID(user_data) (*(const guint64 *) (user_data))
+
+/**
+ The menu is kept from one popup to the next. The history tells it of each
+ change (history_set_change_func()), which is queued and applied on the next
+ popup: a new item gets a menu item, a deleted one loses it, a moved one is
+ moved. So a popup costs as much as the changes since the last one, not as
+ the whole history. The menu is rebuilt only after the whole history was
+ replaced, after more changes than it has items, or when the preferences
+ that shape the labels change.
+
+ The menu holds, from the top: the "Empty" placeholder, the recent items,
+ a separator, the pinned items. The separator is shown only between two
+ sections that both have items.
+*/
+struct menu_change {
+	enum history_change change;
+	guint64 id;
+};
+
+struct menu_style {
+	gint32 item_length;
+	gint32 ellipsize;
+	gint32 display_nonprinting_characters;
+};
+
+static struct {
+	GtkWidget * menu;
+	GtkWidget * empty;       /**shown while the history is empty  */
+	GtkWidget * separator;
+	GHashTable * items;      /**history item id -> menu item  */
+	guint n_recent;          /**menu items above the separator  */
+	GArray * changes;        /**struct menu_change, since the last popup  */
+	gboolean rebuild;
+	struct menu_style style;
+	guint64 bold_id;         /**the item of the clipboard  */
+	guint64 italic_id;       /**the item of the primary selection  */
+	gboolean searched;       /**some items may be hidden  */
+	guint prewarm_id;        /**idle source that applies the changes ahead of the popup  */
+} menu_model = { .rebuild = TRUE };
+
+static struct history_info history_menu_info;
+
+static gboolean menu_model_prewarm(gpointer data);
+
 /******************************************************************************/
 
 static gchar * history_text_casefold_key_ = NULL;
@@ -67,7 +134,7 @@ static gboolean  handle_history_item_right_click (int i, gpointer data)
 			break;
 		case HIST_MOVE_TO_OK:
 /*			g_printf("Move to"); */
-			handle_marking(h,h->wi.item,h->wi.index,OPERATE_PERSIST);
+			handle_marking(h,h->wi.item,h->wi.id,OPERATE_PERSIST);
 			break;
 	}
 	/*gtk_widget_grab_focus(h->menu); */
@@ -86,32 +153,30 @@ static gboolean history_item_right_click_on_cancel (GtkWidget *menuitem, gpointe
 
 /******************************************************************************/
 
-static void destroy_right_click_history_cb(GtkWidget *attach_widget, GtkMenu *menu)
+static void destroy_right_click_history_cb(GtkMenuShell *menu, gpointer user_data)
 {
-	/*g_printf("%s:\n",__func__); */
-	gtk_widget_destroy	((GtkWidget *) attach_widget);
+	/**the history menu stays, its right-click menus don't  */
+	gtk_widget_destroy	((GtkWidget *) menu);
 }
 
 /******************************************************************************/
 
-static void history_item_right_click (struct history_info *h, GdkEventKey *e, gint index)
+static void history_item_right_click (struct history_info *h, GdkEventKey *e, guint64 id)
 {
   GtkWidget *menu, *menuitem;
   
 	struct history_item *c=NULL;
 	if(NULL !=h ){
-		GList* element = g_list_nth(history_list, h->wi.index);
-		if(NULL !=element){
-			c=(struct history_item *)(element->data);
-			/*g_printf("%s ",c->text); */
-		}
+		c=history_lookup(id);
+		/*g_printf("%s ",c->text); */
 	} else{
 		g_fprintf(stderr,"h-i-r-c: h is NULL");
 		return;
 	}
 	
 	menu = gtk_menu_new();
-	gtk_menu_attach_to_widget((GtkMenu *)h->menu,menu,destroy_right_click_history_cb); /**fix  */
+	gtk_menu_attach_to_widget((GtkMenu *)menu,h->menu,NULL);
+	g_signal_connect(menu, "selection-done", (GCallback) destroy_right_click_history_cb, NULL);
 
     if(NULL != c) {
 		if(c->flags & CLIP_TYPE_PERSISTENT)
@@ -144,17 +209,14 @@ static gboolean selection_done(GtkMenuShell *menushell, gpointer user_data)
 	struct history_info * h = (struct history_info *) user_data;
 	if (h && h->delete_list) {
 		remove_deleted_items(h);
-		goto done;
 	}
+	/**the changes that came while the menu was up  */
+	if ((menu_model.changes->len || menu_model.rebuild) && !menu_model.prewarm_id)
+		menu_model.prewarm_id = g_idle_add_full(G_PRIORITY_LOW, menu_model_prewarm, NULL, NULL);
 
 	/*g_print("selection_active=%d\n",selection_active); */
 	/*g_print("Got selection_done\n"); */
-	if (h && h->change_flag && get_pref_int32("save_history")) {
-		save_history();
-		h->change_flag = 0;
-	}
 
-done:
 	/*gtk_widget_destroy((GtkWidget *)menushell); - fixes annoying GTK_IS_WIDGET/GTK_IS_WINDOW
 	  warnings from GTK when history dialog is destroyed. */
 	return FALSE;
@@ -200,7 +262,18 @@ static void apply_search_string_cb(GtkWidget * widget, gpointer user_data)
 	const gchar * history_text_casefold = (const gchar *) g_object_get_data(
 		(GObject *) menu_item, get_history_text_casefold_key());
 	if (!history_text_casefold)
-		return;
+	{
+		/**folded on the first search, the menu item doesn't keep a copy of the text  */
+		const guint64 * id = (const guint64 *) g_object_get_data((GObject *) menu_item, "history-item-id");
+		struct history_item * c = id ? history_lookup(*id) : NULL;
+		if (!c)
+			return;
+		gchar * copy;
+		gchar * casefold = g_utf8_casefold(history_item_peek_text(c, &copy), -1);
+		g_free(copy);
+		g_object_set_data_full((GObject *) menu_item, get_history_text_casefold_key(), casefold, g_free);
+		history_text_casefold = casefold;
+	}
 
 	gboolean match = h->search_string_casefold[0] == 0 ||
 		g_strstr_len(history_text_casefold, -1, h->search_string_casefold) != NULL;
@@ -222,6 +295,7 @@ static void apply_search_string(struct history_info * h)
 	g_free(h->search_string_casefold);
 	h->search_string_casefold = g_utf8_casefold(h->search_string->str, -1);
 	h->first_matched = NULL;
+	menu_model.searched = TRUE;
 	gtk_container_foreach((GtkContainer *) h->menu, apply_search_string_cb, h);
 }
 
@@ -285,18 +359,18 @@ static gboolean key_release_cb (GtkWidget *w,GdkEventKey *e, gpointer user)
 
 /******************************************************************************/
 
-static void set_clipboard_text_from_item(struct history_info *h, GList *element)
+static void set_clipboard_text_from_item(struct history_info *h, guint64 id)
 {
-	gchar *txt=NULL;
-	if(NULL == find_h_item(h->delete_list,NULL,element)){	/**not in our delete list  */
-		/**make a copy of txt, because it gets freed and re-allocated.  */
-		txt=g_strdup(((struct history_item *)(element->data))->text);
+	struct shared_text *txt=NULL;
+	struct history_item *c=history_lookup(id);
+	if(NULL != c && NULL == find_h_item(h->delete_list,NULL,id)){	/**still there, not in our delete list  */
+		/**a reference, the item may be freed while the clipboards are updated  */
+		txt=history_item_get_text(c);
 		update_clipboards(CLIPBOARD_ACTION_SET, txt);
 	}
 	g_signal_emit_by_name ((gpointer)h->menu,"selection-done");
-	
-	if(NULL != txt)
-		g_free(txt);
+
+	shared_text_unref(txt);
 }
 
 
@@ -322,7 +396,7 @@ static gboolean my_item_event (GtkWidget *w,GdkEventKey *e, gpointer user)
 		/*printf("state 0x%x\n",enter->state); */
 		/**use shift and right-click  */
 		if(GDK_SHIFT_MASK&enter->state && GDK_BUTTON3_MASK&enter->state)
-			handle_marking(h,w,GPOINTER_TO_INT(user),OPERATE_DELETE);
+			handle_marking(h,w,MENU_ITEM_ID(user),OPERATE_DELETE);
 	}
 	if(GDK_KEY_PRESS == e->type){
 		/*GdkEventKey *k=	(GdkEventKey *)e; */
@@ -331,26 +405,25 @@ static gboolean my_item_event (GtkWidget *w,GdkEventKey *e, gpointer user)
 	}
 	if(GDK_BUTTON_RELEASE==e->type){
 		GdkEventButton *b=(GdkEventButton *)e;
-		GList* element = g_list_nth(history_list, GPOINTER_TO_INT(user));
-		/*printf("type %x State 0x%x val %x %p '%s'\n",e->type, b->state,b->button,w,(gchar *)((struct history_item *(element->data))->text));  */
+		guint64 id=MENU_ITEM_ID(user);
 		if(3 == b->button){ /**right-click  */
 			if(GDK_CONTROL_MASK&b->state){
-				handle_marking(h,w,GPOINTER_TO_INT(user),OPERATE_DELETE);
+				handle_marking(h,w,id,OPERATE_DELETE);
 			}else{ /**shift-right click release  */
 				 if((GDK_CONTROL_MASK|GDK_SHIFT_MASK)&b->state)
 					return FALSE;
 				/*g_print("Calling popup\n");  */
 	      h->wi.event=e;
 	      h->wi.item=w;
-				h->wi.index=GPOINTER_TO_INT(user);
+				h->wi.id=id;
 				/*g_fprintf(stderr,"Calling hist_itemRclk\n"); */
-		    history_item_right_click(h,e,GPOINTER_TO_INT(user));
+		    history_item_right_click(h,e,id);
 				
 			}
 			return TRUE;
 		}else if( 1 == b->button){
 		  /* Get the text from the right element and set as clipboard */
-			set_clipboard_text_from_item(h,element);
+			set_clipboard_text_from_item(h,id);
 		}	
 		fflush(NULL);
 	}
@@ -370,265 +443,638 @@ static void item_selected(GtkMenuItem *menu_item, gpointer user_data)
 		
 		
 	GdkEventKey *k=(GdkEventKey *)gtk_get_current_event();
-	GList* element = g_list_nth(history_list, GPOINTER_TO_INT(user_data));
-	/*g_print ("item_selected '%s' type %x val %x\n",(gchar *)((struct history_item *(element->data))->text),k->type, k->keyval);  */
 	if(0xFF0d == k->keyval && GDK_KEY_PRESS == k->type){
-		set_clipboard_text_from_item(h,element);
+		set_clipboard_text_from_item(h,MENU_ITEM_ID(user_data));
 	}
 }	
 
+
 /******************************************************************************/
 
-static void write_history_menu_items(GList *list, GtkWidget *menu)
+/**the glyphs shown for the tab, the new line and the space, all 3 bytes long  */
+#define LABEL_GLYPH_SIZE 3
+static const gchar glyph_tab[] = "\xe2\x86\x92";       /**rightwards arrow  */
+static const gchar glyph_newline[] = "\xe2\x81\x8b";   /**reversed pilcrow  */
+static const gchar glyph_space[] = "\xe2\x90\xa3";     /**open box  */
+
+#define LABEL_ONES G_GUINT64_CONSTANT(0x0101010101010101)
+#define LABEL_LOWS G_GUINT64_CONSTANT(0x7f7f7f7f7f7f7f7f)
+
+/**the high bit of each byte of w that equals the byte c  */
+static inline guint64 label_word_has(guint64 w, guchar c)
 {
-	GList *element;
-	if(NULL == list)
-		return;
-	for (element = list; element != NULL; element = element->next) 
-			gtk_menu_shell_append((GtkMenuShell*)menu,element->data);	
+	guint64 x = w ^ (LABEL_ONES * c);
+	return ~(((x & LABEL_LOWS) + LABEL_LOWS) | x | LABEL_LOWS);
 }
 
-/******************************************************************************/
+static inline gchar * label_put_char(gchar * o, gchar ch, gboolean nonprinting, gboolean keep_newlines)
+{
+	const gchar * glyph = NULL;
+
+	switch (ch) {
+		case '\t':
+			glyph = nonprinting ? glyph_tab : NULL;
+			break;
+		case '\n':
+			if (nonprinting)
+				glyph = glyph_newline;
+			else if (!keep_newlines)
+				return o;
+			break;
+		case ' ':
+			glyph = nonprinting ? glyph_space : NULL;
+			break;
+	}
+	if (glyph) {
+		memcpy(o, glyph, LABEL_GLYPH_SIZE);
+		return o + LABEL_GLYPH_SIZE;
+	}
+	*o = ch;
+	return o + 1;
+}
 
-static GString* convert_nonprinting_characters(GString* s)
+/**writes the text into out, with the non-printing characters shown as glyphs
+ or else the new lines dropped (unless kept), in one pass. A word of 8 bytes
+ without any of these characters is copied at once. out must hold
+ LABEL_GLYPH_SIZE * len + 1 bytes.
+ Returns the length written, out is 0-terminated.  */
+static gsize label_sanitize(const gchar * text, gsize len, gboolean nonprinting, gboolean keep_newlines, gchar * out)
 {
-	gchar arrow[4]={0xe2,0x86,0x92,0x00};
-	gchar paragraph[4]={0xe2,0x81,0x8b,0x00};
-	gchar square_u[4]={0xe2,0x90,0xA3,0};
-	gchar *p, *r;
-	
-	for (p=s->str; p!= NULL; p=g_utf8_find_next_char(p,s->str+s->len)){
-		switch(*p){
-			case 0x09:r=arrow; break;
-			case 0x0a:r=paragraph; break;
-			case 0x20:r=square_u; break;
-		  default:r=NULL; break; 
-		}
-		if(NULL !=r ) {/**replace. */
-			gint32 pos=(p-s->str)+1;
-			*p=r[0];
-			s=g_string_insert(s,pos,&r[1]);
-			p=s->str+pos+2;
+	gchar * o = out;
+	gsize i = 0, k;
+
+	for (; i + sizeof(guint64) <= len; i += sizeof(guint64)) {
+		guint64 w;
+		memcpy(&w, text + i, sizeof(w));
+		if (!(label_word_has(w, '\n') |
+			(nonprinting ? label_word_has(w, '\t') | label_word_has(w, ' ') : 0)))
+		{
+			memcpy(o, text + i, sizeof(w));
+			o += sizeof(w);
+			continue;
 		}
+		for (k = 0; k < sizeof(w); k++)
+			o = label_put_char(o, text[i + k], nonprinting, keep_newlines);
+	}
+	for (; i < len; i++)
+		o = label_put_char(o, text[i], nonprinting, keep_newlines);
+	*o = 0;
+	return o - out;
+}
+
+/**a label is built from at most this many bytes at each end of the text,
+ whatever the size of the item  */
+#define LABEL_WINDOW_MAX (64 * 1024)
+
+/**the end of the first chars characters of the text, not counting the new
+ lines if the label drops them  */
+static const gchar * label_window_head(const gchar * p, const gchar * end, glong chars, gboolean skip_newlines)
+{
+	const gchar * limit = p + MIN(end - p, LABEL_WINDOW_MAX);
+
+	while (chars > 0 && p < limit) {
+		if (!(skip_newlines && '\n' == *p))
+			chars--;
+		p = g_utf8_next_char(p);
 	}
-	return s;
+	return MIN(p, end);
+}
+
+/**the start of the last chars characters of the text, not before start  */
+static const gchar * label_window_tail(const gchar * start, const gchar * end, glong chars, gboolean skip_newlines)
+{
+	const gchar * p = end;
+	const gchar * limit = end - MIN(end - start, LABEL_WINDOW_MAX);
+
+	while (chars > 0 && p > limit) {
+		p = g_utf8_prev_char(p);
+		if (!(skip_newlines && '\n' == *p))
+			chars--;
+	}
+	return p;
+}
+
+/**whether the label has more characters after p  */
+static gboolean label_window_more(const gchar * p, const gchar * end, gboolean skip_newlines)
+{
+	const gchar * limit = p + MIN(end - p, LABEL_WINDOW_MAX);
+
+	if (!skip_newlines)
+		return p < end;
+	for (; p < limit; p++)
+		if ('\n' != *p)
+			return TRUE;
+	/**new lines only, as far as the window goes  */
+	return limit < end;
 }
 
 /******************************************************************************/
 
-static void destroy_history_menu(GtkMenuShell *menu, gpointer u)
+/******************************************************************************/
+
+static void on_history_changed(enum history_change change, const struct history_item * c)
 {
-	/*g_printf("%s:\n",__func__); */
-	selection_done(menu,u);	/**allow deleted items to be deleted.  */
-	gtk_widget_destroy((GtkWidget *)menu);
+	struct menu_change mc;
+
+	/**the menu is brought up to date while idle, rather than at the popup  */
+	if (menu_model.menu && !menu_model.prewarm_id)
+		menu_model.prewarm_id = g_idle_add_full(G_PRIORITY_LOW, menu_model_prewarm, NULL, NULL);
+	if (menu_model.rebuild)
+		return;
+	/**past the size of the history, a rebuild is cheaper  */
+	if (HISTORY_CHANGE_ALL == change || menu_model.changes->len >= (guint) get_pref_int32("history_limit")) {
+		g_array_set_size(menu_model.changes, 0);
+		menu_model.rebuild = TRUE;
+		return;
+	}
+	mc.change = change;
+	mc.id = history_item_get_id(c);
+	g_array_append_val(menu_model.changes, mc);
 }
 
 /******************************************************************************/
 
-static gboolean do_show_history_menu(gpointer data)
+static void get_menu_style(struct menu_style * style)
 {
-	history_menu_query_t * query = (history_menu_query_t *) data;
-	if (!query)
-		goto end;
+	memset(style, 0, sizeof(*style));
+	style->item_length = get_pref_int32("item_length");
+	style->ellipsize = get_pref_int32("ellipsize");
+	style->display_nonprinting_characters = get_pref_int32("display_nonprinting_characters");
+}
 
-	GtkWidget * menu, * menu_item, * item_label;
+/**the label of the item as the preferences shape it, and a tooltip if the
+ label is shortened. A deflated text is inflated for it, and stays deflated  */
+static gchar * history_item_label(struct history_item * c, const struct menu_style * style, gchar ** tooltip_return)
+{
+	gchar * copy;
+	const gchar * text = history_item_peek_text(c, &copy);
+	const gchar * end = text + history_item_text_len(c);
+	gint32 item_length = style->item_length;
+	gboolean nonprinting = style->display_nonprinting_characters;
+	gboolean skip_newlines = !nonprinting;
+	const gchar * head = label_window_head(text, end, item_length, skip_newlines);
+	const gchar * tail;
+	gchar * label, * o;
+	gchar * tooltip = NULL;
+
+	if (!label_window_more(head, end, skip_newlines)) {
+		/**short enough to be shown whole  */
+		label = g_malloc(LABEL_GLYPH_SIZE * (end - text) + 1);
+		label_sanitize(text, end - text, nonprinting, FALSE, label);
+		if (tooltip_return)
+			*tooltip_return = NULL;
+		goto done;
+	}
 
-	static struct history_info h;
-	h.change_flag = 0;
-	h.wi.index = -1;
+	/* Prepare tooltip, the beginning of the text with its new lines */
+	if (tooltip_return) {
+		const gchar * tooltip_end = label_window_head(text, end, item_length * 20, FALSE);
+		tooltip = g_malloc(LABEL_GLYPH_SIZE * (tooltip_end - text) + 4);
+		o = tooltip + label_sanitize(text, tooltip_end - text, nonprinting, TRUE, tooltip);
+		if (tooltip_end < end)
+			strcpy(o, "...");
+		*tooltip_return = tooltip;
+	}
 
-	if (!h.search_string)
-		h.search_string = g_string_new("");
-	else
-		g_string_truncate(h.search_string, 0);
+	/* Ellipsize text, from the windows at its ends */
+	switch (style->ellipsize) {
+		case PANGO_ELLIPSIZE_START:
+			tail = label_window_tail(text, end, item_length, skip_newlines);
+			label = g_malloc(LABEL_GLYPH_SIZE * (end - tail) + 4);
+			strcpy(label, "...");
+			label_sanitize(tail, end - tail, nonprinting, FALSE, label + 3);
+			break;
+		case PANGO_ELLIPSIZE_MIDDLE:
+			head = label_window_head(text, end, item_length / 2, skip_newlines);
+			tail = label_window_tail(head, end, item_length / 2, skip_newlines);
+			label = g_malloc(LABEL_GLYPH_SIZE * ((head - text) + (end - tail)) + 4);
+			o = label + label_sanitize(text, head - text, nonprinting, FALSE, label);
+			strcpy(o, "...");
+			label_sanitize(tail, end - tail, nonprinting, FALSE, o + 3);
+			break;
+		case PANGO_ELLIPSIZE_END:
+		default:
+			label = g_malloc(LABEL_GLYPH_SIZE * (head - text) + 4);
+			o = label + label_sanitize(text, head - text, nonprinting, FALSE, label);
+			strcpy(o, "...");
+			break;
+	}
+done:
+	g_free(copy);
+	return label;
+}
 
-	if (!h.im_context) {
-		h.im_context = gtk_im_multicontext_new();
-		gtk_im_context_set_use_preedit(h.im_context, FALSE);
-		g_signal_connect((GObject *) h.im_context, "commit",
-			(GCallback) on_history_menu_im_context_commit, (gpointer)&h);
+/******************************************************************************/
+
+static GtkWidget * history_menu_item_new(struct history_item * c, const struct menu_style * style)
+{
+	GtkWidget * menu_item, * item_label;
+	guint64 id=history_item_get_id(c);
+	gchar * tooltip = NULL;
+	gchar * label = history_item_label(c, style, &tooltip);
+
+	/* Make new item with ellipsized text */
+	menu_item = gtk_menu_item_new_with_label(label);
+	g_free(label);
+	{
+		guint64 * item_id = g_memdup(&id, sizeof(id));
+		g_object_set_data_full((GObject *) menu_item, "history-item-id", item_id, g_free);
+		g_signal_connect((GObject*)menu_item, "event",
+			(GCallback)my_item_event, item_id);
+		g_signal_connect((GObject*)menu_item, "activate",
+			(GCallback)item_selected, item_id);
 	}
-	gtk_im_context_reset(h.im_context);
 
+	if (tooltip) {
+		gtk_widget_set_tooltip_text(menu_item, tooltip);
+		g_free(tooltip);
+	}
 
-	GList * element, * persistent = NULL;
-	GList * lhist = NULL;
+	/* Modify menu item label properties */
+	item_label = gtk_bin_get_child((GtkBin*)menu_item);
+	gtk_label_set_single_line_mode((GtkLabel*)item_label, TRUE);
 
-	/* Create the menu */
-	menu = gtk_menu_new();
+	gtk_widget_show(menu_item);
+	return menu_item;
+}
 
-	h.menu = menu;
-	h.delete_list = NULL;
-	h.persist_list = NULL;
+/******************************************************************************/
 
-	my_item_event(NULL,NULL,(gpointer)&h); /**init our function  */
-	item_selected(NULL,(gpointer)&h);	/**ditto  */
-	gtk_menu_shell_set_take_focus((GtkMenuShell *)menu,TRUE); /**grab keyboard focus  */
-	/*g_signal_connect((GObject*)menu, "selection-done", (GCallback)selection_done, gtk_menu_get_attach_widget (menu));  */
-	g_signal_connect((GObject*)menu, "cancel", (GCallback)selection_done, &h); 
-	g_signal_connect((GObject*)menu, "selection-done", (GCallback)selection_done, &h); 
-	/*g_signal_connect((GObject*)menu, "selection-done", (GCallback)gtk_widget_destroy, NULL); */
-	/**Trap key events  */
-	g_signal_connect((GObject*)menu, "event", (GCallback)key_release_cb, (gpointer)&h);
-
-	/* -------------------- */
-	/*gtk_menu_shell_append((GtkMenuShell*)menu, gtk_separator_menu_item_new()); */
-	/* Items */
-	if ((history_list != NULL) && (history_list->data != NULL)) {
-		/* Declare some variables */
-		gint32 item_length = get_pref_int32("item_length");
-		gint32 ellipsize = get_pref_int32("ellipsize");
-		gint32 display_nonprinting_characters = get_pref_int32("display_nonprinting_characters");
-		gint element_number = 0;
-		gchar * primary_temp = gtk_clipboard_wait_for_text(selection_primary);
-		gchar * clipboard_temp = gtk_clipboard_wait_for_text(selection_clipboard);
-
-		/* Go through each element and adding each */
-		for (element = history_list; element != NULL; element = element->next) {
-			struct history_item *c=(struct history_item *)(element->data);
-			gchar* hist_text=c->text;
-			GString* string = g_string_new(hist_text);
-			if (display_nonprinting_characters)
-				string = convert_nonprinting_characters(string);
-			glong len=g_utf8_strlen(string->str, string->len);
-			gchar * tooltip = NULL;
-			/* Ellipsize text */
-			if (len > item_length) {
-				/* Prepare tooltip */
-				int max_tooltip_length = item_length * 20;
-				if (len > max_tooltip_length) {
-					char * tmp_tooltip = g_strndup(string->str,
-						g_utf8_offset_to_pointer(string->str, max_tooltip_length) - string->str);
-					tooltip = g_strconcat(tmp_tooltip, "...", NULL);
-					g_free(tmp_tooltip);
-				} else {
-					tooltip = g_strdup(string->str);
-				}
-				/* Prepare menu item text */
-				switch (ellipsize) {
-					case PANGO_ELLIPSIZE_START:
-						string = g_string_erase(string, 0, g_utf8_offset_to_pointer(string->str, len - item_length) - string->str);
-						string = g_string_prepend(string, "...");
-						break;
-					case PANGO_ELLIPSIZE_MIDDLE:
-					{
-						gchar* p1 = g_utf8_offset_to_pointer(string->str, item_length / 2);
-						gchar* p2 = g_utf8_offset_to_pointer(string->str, len - item_length / 2);
-						g_string_erase(string, p1 - string->str, p2 - p1);
-						g_string_insert(string, p1 - string->str, "...");
-						break;
-					}
-					case PANGO_ELLIPSIZE_END:
-						g_string_truncate(string, g_utf8_offset_to_pointer(string->str, item_length) - string->str);
-						g_string_append(string, "...");
-						break;
-				}
-			}
-			/* Remove control characters */
-			gsize i = 0;
-			while (i < string->len)
-			{	 /**fix 100% CPU utilization for odd data. - bug 2976890   */
-				gsize nline=0;
-				while(string->str[i+nline] == '\n' && nline+i<string->len)
-					nline++;
-				if(nline){
-					g_string_erase(string, i, nline);
-					/* RMME printf("e %ld",nline);fflush(NULL); */
-				}
-				else
-					i++;
-			}
+/**position is within the section of the item, -1 for its end  */
+static void menu_model_insert(GtkWidget * menu, struct history_item * c, gint position)
+{
+	GtkWidget * menu_item = history_menu_item_new(c, &menu_model.style);
+	gboolean pinned = (c->flags & CLIP_TYPE_PERSISTENT) != 0;
+	gint base = pinned ? menu_model.n_recent + 2 : 1;
+	gint section = pinned ? g_hash_table_size(menu_model.items) - menu_model.n_recent : menu_model.n_recent;
+
+	if (position < 0 || position > section)
+		position = section;
+	g_object_set_data((GObject *) menu_item, "history-item-pinned", GINT_TO_POINTER(pinned));
+	gtk_menu_shell_insert((GtkMenuShell *) menu, menu_item, base + position);
+	if (!pinned)
+		menu_model.n_recent++;
+	g_hash_table_insert(menu_model.items, g_object_get_data((GObject *) menu_item, "history-item-id"), menu_item);
+}
 
-			/* Make new item with ellipsized text */
-			menu_item = gtk_menu_item_new_with_label(string->str);
-			g_signal_connect((GObject*)menu_item, "event",
-				(GCallback)my_item_event, GINT_TO_POINTER(element_number));
-			g_signal_connect((GObject*)menu_item, "activate",
-				(GCallback)item_selected, GINT_TO_POINTER(element_number));
+/******************************************************************************/
 
-			g_object_set_data_full((GObject *) menu_item, get_history_text_casefold_key(),
-				g_utf8_casefold(hist_text, -1), g_free);
+static void menu_model_remove(guint64 id)
+{
+	GtkWidget * menu_item = (GtkWidget *) g_hash_table_lookup(menu_model.items, &id);
 
-			if (tooltip) {
-				gtk_widget_set_tooltip_text(menu_item, tooltip);
-				g_free(tooltip);
-			}
+	if (!menu_item)
+		return;
+	if (!g_object_get_data((GObject *) menu_item, "history-item-pinned"))
+		menu_model.n_recent--;
+	if (menu_model.bold_id == id)
+		menu_model.bold_id = 0;
+	if (menu_model.italic_id == id)
+		menu_model.italic_id = 0;
+	g_hash_table_remove(menu_model.items, &id);
+	gtk_widget_destroy(menu_item);
+}
 
-			/* Modify menu item label properties */
-			item_label = gtk_bin_get_child((GtkBin*)menu_item);
-			gtk_label_set_single_line_mode((GtkLabel*)item_label, TRUE);
-
-			/* Check if item is also clipboard text and make bold */
-			if ((clipboard_temp) && (g_strcmp0(hist_text, clipboard_temp) == 0))
-			{
-				gchar* bold_text = g_markup_printf_escaped("<b>%s</b>", string->str);
-				if( NULL == bold_text) g_fprintf(stderr,"NulBMKUp:'%s'\n",string->str);
-				gtk_label_set_markup((GtkLabel*)item_label, bold_text);
-				g_free(bold_text);
-				h.wi.index=element_number;
-			}
-			else if ((primary_temp) && (g_strcmp0(hist_text, primary_temp) == 0))
-			{
-				gchar* italic_text = g_markup_printf_escaped("<i>%s</i>", string->str);
-				if( NULL == italic_text) g_fprintf(stderr,"NulIMKUp:'%s'\n",string->str);
-				gtk_label_set_markup((GtkLabel*)item_label, italic_text);
-				g_free(italic_text);
-				h.wi.index=element_number;
-			}
-			if(c->flags &CLIP_TYPE_PERSISTENT){
-				persistent = g_list_prepend(persistent, menu_item);
-				/*g_printf("persistent %s\n",c->text); */
-			}	else{
-				/* Append item */
-				lhist = g_list_prepend(lhist, menu_item);
+/******************************************************************************/
+
+/**
+ puts back the items pinned or unpinned by the changes, once the others are
+ applied: the menu matches the history then, but for them. Taken in the order
+ of the history, the items of the section that come before one are those of
+ the menu.
+*/
+static void menu_model_place(GtkWidget * menu, GHashTable * moved)
+{
+	gint count[2] = { 0, 0 };
+	guint n;
+
+	for (n = 0; n < history_length(); n++) {
+		struct history_item * x = history_nth(n);
+		guint64 id = history_item_get_id(x);
+		gboolean pinned = (x->flags & CLIP_TYPE_PERSISTENT) != 0;
+
+		if (!g_hash_table_lookup(menu_model.items, &id)) {
+			if (!g_hash_table_lookup(moved, &id))
+				continue;
+			menu_model_insert(menu, x, count[pinned]);
+		}
+		count[pinned]++;
+	}
+}
+
+/******************************************************************************/
+
+/**a pinned or unpinned item is taken out, and added to moved  */
+static void menu_model_apply(GtkWidget * menu, const struct menu_change * mc, GHashTable * moved)
+{
+	struct history_item * c = history_lookup(mc->id);
+	GtkWidget * menu_item = (GtkWidget *) g_hash_table_lookup(menu_model.items, &mc->id);
+
+	if (!c) {
+		menu_model_remove(mc->id);
+		return;
+	}
+	switch (mc->change) {
+		case HISTORY_CHANGE_ADD:
+		case HISTORY_CHANGE_MOVE_TO_FRONT:
+			if (!menu_item) {
+				menu_model_insert(menu, c, 0);
+				break;
 			}
+			/**the newest one of its section  */
+			gtk_menu_reorder_child((GtkMenu *) menu, menu_item,
+				g_object_get_data((GObject *) menu_item, "history-item-pinned") ? menu_model.n_recent + 2 : 1);
+			break;
+		case HISTORY_CHANGE_FLAGS:
+			/**moves to the other section, and loses the marks of the last popup;
+			   where it goes depends on the changes still to be applied  */
+			menu_model_remove(mc->id);
+			g_hash_table_insert(moved, (gpointer) &mc->id, (gpointer) mc);
+			break;
+		default:
+			break;
+	}
+}
+
+/******************************************************************************/
+
+static void menu_model_rebuild(GtkWidget * menu)
+{
+	/**the keys belong to the menu items  */
+	GList * old = g_hash_table_get_values(menu_model.items);
+	guint n;
+
+	g_hash_table_remove_all(menu_model.items);
+	g_list_foreach(old, (GFunc) gtk_widget_destroy, NULL);
+	g_list_free(old);
+	menu_model.n_recent = 0;
+	menu_model.bold_id = menu_model.italic_id = 0;
+	menu_model.searched = FALSE;
+
+	for (n = 0; n < history_length(); n++)
+		menu_model_insert(menu, history_nth(n), -1);
+}
+
+/******************************************************************************/
+
+/**marks the item of the text, and unmarks the one marked before  */
+static void menu_model_mark(guint64 * marked_id, struct shared_text * text, guint64 skip_id, const gchar * format)
+{
+	struct history_item * c = history_lookup_text(text);
+	guint64 id = c ? history_item_get_id(c) : 0;
+	GtkWidget * menu_item;
 
-			/* Prepare for next item */
-			g_string_free(string, TRUE);
-			element_number++;
-		}	/**end of for loop for each history item  */
-		/* Cleanup */
-		g_free(primary_temp);
-		g_free(clipboard_temp);
+	if (id == skip_id)
+		id = 0;
+	if (id == *marked_id)
+		return;
+
+	if ((menu_item = (GtkWidget *) g_hash_table_lookup(menu_model.items, marked_id))) {
+		GtkLabel * label = (GtkLabel *) gtk_bin_get_child((GtkBin *) menu_item);
+		gchar * plain = g_strdup(gtk_label_get_text(label));
+		gtk_label_set_text(label, plain);
+		g_free(plain);
 	}
-	else
-	{
-		/* Nothing in history so adding empty */
-		menu_item = gtk_menu_item_new_with_label(_("Empty"));
-		gtk_widget_set_sensitive(menu_item, FALSE);
-		gtk_menu_shell_append((GtkMenuShell*)menu, menu_item);
+	*marked_id = id;
+	if ((menu_item = (GtkWidget *) g_hash_table_lookup(menu_model.items, &id))) {
+		GtkLabel * label = (GtkLabel *) gtk_bin_get_child((GtkBin *) menu_item);
+		gchar * markup = g_markup_printf_escaped(format, gtk_label_get_text(label));
+		gtk_label_set_markup(label, markup);
+		g_free(markup);
 	}
+}
 
-	{
-		lhist = g_list_reverse(lhist);
-		persistent = g_list_reverse(persistent);
-	}	
+/******************************************************************************/
 
-	/**now actually add them from the list  */
-    {
-		write_history_menu_items(lhist,menu);
-		gtk_menu_shell_append((GtkMenuShell*)menu, gtk_separator_menu_item_new()); 
-		write_history_menu_items(persistent,menu);
+static void show_menu_item(gpointer key, gpointer value, gpointer user_data)
+{
+	gtk_widget_show((GtkWidget *) value);
+}
+
+/**brings the menu up to date with the history  */
+static void menu_model_update(GtkWidget * menu)
+{
+	struct menu_style style;
+	guint n;
+
+	get_menu_style(&style);
+	if (memcmp(&style, &menu_model.style, sizeof(style)) != 0) {
+		menu_model.style = style;
+		menu_model.rebuild = TRUE;
+	}
+
+	if (menu_model.rebuild) {
+		menu_model_rebuild(menu);
+		menu_model.rebuild = FALSE;
+	} else {
+		GHashTable * moved = g_hash_table_new(g_int64_hash, g_int64_equal);
+		for (n = 0; n < menu_model.changes->len; n++)
+			menu_model_apply(menu, &g_array_index(menu_model.changes, struct menu_change, n), moved);
+		if (g_hash_table_size(moved))
+			menu_model_place(menu, moved);
+		g_hash_table_destroy(moved);
+		if (menu_model.searched) {
+			g_hash_table_foreach(menu_model.items, show_menu_item, NULL);
+			menu_model.searched = FALSE;
+		}
 	}
+	g_array_set_size(menu_model.changes, 0);
+
+	/**the contents as last captured: asking the selection owners would hold up the popup  */
+	menu_model_mark(&menu_model.bold_id, text_clipboard, 0, "<b>%s</b>");
+	menu_model_mark(&menu_model.italic_id, text_primary, menu_model.bold_id, "<i>%s</i>");
+
+	gtk_widget_set_visible(menu_model.empty, g_hash_table_size(menu_model.items) == 0);
+	gtk_widget_set_visible(menu_model.separator,
+		menu_model.n_recent && g_hash_table_size(menu_model.items) > menu_model.n_recent);
+}
+
+/******************************************************************************/
+
+/**takes the offset of the X server's time to the monotonic clock: one round
+ trip, at startup  */
+static void popup_latency_calibrate(void)
+{
+	GdkWindowAttr attributes = {0};
+	GdkWindow * window;
+	gint64 before;
+
+	attributes.window_type = GDK_WINDOW_TEMP;
+	attributes.wclass = GDK_INPUT_ONLY;
+	attributes.x = attributes.y = -100;
+	attributes.width = attributes.height = 10;
+	attributes.override_redirect = TRUE;
+	attributes.event_mask = GDK_PROPERTY_CHANGE_MASK;
+	window = gdk_window_new(NULL, &attributes, GDK_WA_X | GDK_WA_Y | GDK_WA_NOREDIR);
+
+	before = g_get_monotonic_time();
+	popup_latency.server_base = gdk_x11_get_server_time(window);
+	/**the server's time was taken halfway, give or take  */
+	popup_latency.monotonic_base = (before + g_get_monotonic_time()) / 2;
+	popup_latency.calibrated = TRUE;
+	gdk_window_destroy(window);
+}
+
+/**the monotonic time of the event that asks for a popup, of its X time;
+ the time it is handled if the event has none  */
+static gint64 popup_latency_start(guint32 activate_time)
+{
+	if (GDK_CURRENT_TIME == activate_time)
+		return g_get_monotonic_time();
+	if (!popup_latency.calibrated)
+		popup_latency_calibrate();
+	/**the event may be older than the offset, the X time wraps around  */
+	return popup_latency.monotonic_base + (gint64) (gint32) (activate_time - popup_latency.server_base) * 1000;
+}
+
+/**measures the latency of the popup, once it is on the screen  */
+static gboolean on_popup_mapped(GtkWidget * widget, GdkEvent * event, gpointer user_data)
+{
+	guint32 latency;
+
+	if (!popup_latency.pending)
+		return FALSE;
+	latency = MAX(g_get_monotonic_time() - popup_latency.pending, 0) / 1000;
+	popup_latency.pending = 0;
+
+	popup_latency.count++;
+	if (latency < POPUP_FRAME_MS)
+		popup_latency.sub_frame++;
+	popup_latency.last = latency;
+	if (latency > popup_latency.max)
+		popup_latency.max = latency;
+	popup_latency.total += latency;
+	return FALSE;
+}
+
+static void popup_latency_print_stats(GString * s)
+{
+	g_string_append_printf(s,
+		_("History popups: %u, within a frame: %u\n"
+		  "Popup latency: last %u ms, max %u ms, average %.1f ms\n"),
+		popup_latency.count, popup_latency.sub_frame,
+		popup_latency.last, popup_latency.max,
+		popup_latency.count ? (gdouble) popup_latency.total / popup_latency.count : 0.0);
+}
+
+/******************************************************************************/
+
+/**the menu, created on the first call  */
+static GtkWidget * history_menu_get(void)
+{
+	struct history_info * h = &history_menu_info;
+	GtkWidget * menu;
+
+	if (h->menu)
+		return h->menu;
+
+	h->search_string = g_string_new("");
+	h->im_context = gtk_im_multicontext_new();
+	gtk_im_context_set_use_preedit(h->im_context, FALSE);
+	g_signal_connect((GObject *) h->im_context, "commit",
+		(GCallback) on_history_menu_im_context_commit, (gpointer)h);
+
+	/* Create the menu */
+	menu = gtk_menu_new();
+	h->menu = menu;
+	gtk_menu_shell_set_take_focus((GtkMenuShell *)menu,TRUE); /**grab keyboard focus  */
+	g_signal_connect((GObject*)menu, "cancel", (GCallback)selection_done, h);
+	g_signal_connect((GObject*)menu, "selection-done", (GCallback)selection_done, h);
+	/**Trap key events  */
+	g_signal_connect((GObject*)menu, "event", (GCallback)key_release_cb, (gpointer)h);
+	/**the window the menu is mapped in  */
+	g_signal_connect((GObject*)gtk_widget_get_toplevel(menu), "map-event", (GCallback)on_popup_mapped, NULL);
+
+	/* Nothing in history so adding empty */
+	menu_model.empty = gtk_menu_item_new_with_label(_("Empty"));
+	gtk_widget_set_sensitive(menu_model.empty, FALSE);
+	gtk_menu_shell_append((GtkMenuShell*)menu, menu_model.empty);
+	menu_model.separator = gtk_separator_menu_item_new();
+	gtk_widget_show(menu_model.separator);
+	gtk_menu_shell_append((GtkMenuShell*)menu, menu_model.separator);
+
+	menu_model.items = g_hash_table_new(g_int64_hash, g_int64_equal);
+	menu_model.changes = g_array_new(FALSE, FALSE, sizeof(struct menu_change));
+	menu_model.rebuild = TRUE;
+	menu_model.menu = menu;
+	return menu;
+}
+
+/******************************************************************************/
+
+/**applies the changes, realizes and measures the menu while idle, so that a
+ popup only has to map it  */
+static gboolean menu_model_prewarm(gpointer data)
+{
+	GtkWidget * menu = history_menu_get();
+	GtkRequisition requisition;
+
+	menu_model.prewarm_id = 0;
+	if (gtk_widget_get_visible(menu))
+		return FALSE;
+	menu_model_update(menu);
+	gtk_widget_realize(menu);
+	gtk_widget_size_request(menu, &requisition);
+	return FALSE;
+}
+
+static void history_menu_prewarm(void)
+{
+	history_menu_get();
+	if (!menu_model.prewarm_id)
+		menu_model.prewarm_id = g_idle_add_full(G_PRIORITY_LOW, menu_model_prewarm, NULL, NULL);
+}
+
+/******************************************************************************/
+
+static gboolean do_show_history_menu(gpointer data)
+{
+	history_menu_query_t * query = (history_menu_query_t *) data;
+	if (!query)
+		return FALSE;
+
+	struct history_info * h = &history_menu_info;
+	GtkWidget * menu = history_menu_get();
+
+	h->wi.id = 0;
+	g_string_truncate(h->search_string, 0);
+	gtk_im_context_reset(h->im_context);
+
+	h->delete_list = NULL;
+	h->persist_list = NULL;
+
+	my_item_event(NULL,NULL,(gpointer)h); /**init our function  */
+	item_selected(NULL,(gpointer)h);	/**ditto  */
+
+	/**usually a no-op, the idle prewarm has done it  */
+	menu_model_update(menu);
+	h->wi.id = menu_model.bold_id ? menu_model.bold_id : menu_model.italic_id;
 
-	g_list_free(lhist);
-	g_list_free(persistent);
-	/*g_signal_connect(menu,"deactivate",(GCallback)destroy_history_menu,(gpointer)&h); */
-	g_signal_connect(menu,"selection-done",(GCallback)destroy_history_menu,(gpointer)&h);
 	/* Popup the menu... */
-	gtk_widget_show_all(menu);
+	popup_latency.pending = query->requested;
 	gtk_menu_popup((GtkMenu*)menu, NULL, NULL,
 		query->mouse_button ? NULL : on_history_menu_position,
 		NULL,
 		query->mouse_button,
 		query->activate_time);
+	if (!gtk_widget_get_visible(menu)) {
+		/**GTK gives up on the popup if it can't grab, as while the hotkey
+		 is still held in another client's grab  */
+		popup_latency.pending = 0;
+		if (query->retries++ < POPUP_RETRIES) {
+			g_timeout_add(POPUP_RETRY_DELAY, do_show_history_menu, query);
+			return FALSE;
+		}
+		g_fprintf(stderr, "history menu: can't grab the keyboard and the pointer\n");
+		g_free(query);
+		return FALSE;
+	}
 	/**set last entry at first -fixes bug 2974614 */
 	gtk_menu_shell_select_first((GtkMenuShell*)menu, TRUE);
 
-end:
 	g_free(query);
 
-	/* Return FALSE so the g_timeout_add() function is called only once */
+	/* Return FALSE so the source is called only once */
 	return FALSE;
 }
 
@@ -639,12 +1085,14 @@ static void show_history_menu(guint mouse_button, guint32 activate_time)
 	if (activate_time == GDK_CURRENT_TIME)
 		activate_time = gtk_get_current_event_time();
 
-	history_menu_query_t * query = g_try_new(history_menu_query_t, 1);
+	history_menu_query_t * query = g_try_new0(history_menu_query_t, 1);
 	if (!query)
 		return;
 
 	query->mouse_button = mouse_button;
 	query->activate_time = activate_time;
+	query->requested = popup_latency_start(activate_time);
 
-	g_timeout_add(POPUP_DELAY, do_show_history_menu, query);
+	/**no fixed delay: right after the event that asked for it is handled  */
+	g_idle_add_full(G_PRIORITY_HIGH, do_show_history_menu, query, NULL);
 }
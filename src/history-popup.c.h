@@ -0,0 +1,877 @@
+/*
+ * Rainbow CM
+ * 
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ * Copyright (C) 2007-2008 by Xyhthyx <xyhthyx@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "rainbow-cm.h"
+
+#include <X11/X.h>
+#include <X11/Xlib.h>
+#include <gdk/gdkx.h>
+#include <gdk/gdkkeysyms.h>
+#include <ctype.h>
+
+/**
+ The history popup is a window that lists the history like the menu does,
+ but it has no widget per item. Its model is an array of the ids of the items
+ it shows, and only the rows in view are laid out and drawn, so a popup with
+ a hundred thousand items costs as much as one with a screenful.
+
+ The rows hold, from the top: the recent items, then the pinned ones. The
+ keys work as in the menu: the arrows, Page Up/Down, Home/End, Enter, Escape,
+ and typing searches if the "type_search" preference is set. A right-click
+ pins or unpins an item, a ctrl-right-click marks it to be deleted when the
+ popup closes.
+
+ A search compares the casefolded texts, which are kept (up to
+ POPUP_CASEFOLD_MAX bytes of them) until their item is deleted, so a key
+ typed costs a substring search of each item and no text is folded twice. A
+ deflated text is inflated only for the time it is folded. While the popup is
+ shown, the changes of the history are applied to the rows: only the changed
+ items are matched again.
+*/
+#define POPUP_PADDING 4
+/**bytes of casefolded texts kept for the search  */
+#define POPUP_CASEFOLD_MAX (16 * 1024 * 1024)
+
+struct popup_change {
+	enum history_change change;
+	guint64 id;
+};
+
+static struct {
+	GtkWidget * window;
+	GtkWidget * area;          /**the rows  */
+	GtkWidget * search;        /**label showing the search string  */
+	GtkAdjustment * adj;       /**in pixels  */
+	GArray * rows;             /**guint64 ids of the items shown  */
+	GHashTable * row_index;    /**id (in rows) -> row + 1  */
+	gboolean row_index_stale;  /**rows changed since it was built  */
+	guint n_recent;            /**rows above the separator  */
+	gint selected;             /**row, or -1  */
+	gint row_height;
+	struct menu_style style;
+	guint64 bold_id;           /**the item of the clipboard  */
+	guint64 italic_id;         /**the item of the primary selection  */
+	GHashTable * deleted;      /**ids marked to be deleted  */
+	GString * search_string;
+	gchar * search_casefold;   /**the search the rows were filtered by  */
+	GtkIMContext * im_context;
+	gboolean shown;
+	gboolean in_item_menu;     /**the right-click menu holds the grab  */
+	guint refresh_id;          /**idle source that follows the history  */
+	GArray * changes;          /**struct popup_change, since the rows were filled  */
+	gboolean refill;           /**the changes are too many, or the whole history changed  */
+	GHashTable * casefolds;    /**id -> casefolded text  */
+	gsize casefold_bytes;
+} popup;
+
+/******************************************************************************/
+
+/**the casefolded text of the item, kept while there is room  */
+static const gchar * popup_casefold(struct history_item * c, gchar ** uncached)
+{
+	guint64 id = history_item_get_id(c);
+	gchar * casefold = (gchar *) g_hash_table_lookup(popup.casefolds, &id);
+	gchar * copy;
+	gsize size;
+
+	*uncached = NULL;
+	if (casefold)
+		return casefold;
+	casefold = g_utf8_casefold(history_item_peek_text(c, &copy), -1);
+	g_free(copy);
+	size = strlen(casefold) + 1;
+	if (popup.casefold_bytes + size > POPUP_CASEFOLD_MAX)
+		return *uncached = casefold;
+	g_hash_table_insert(popup.casefolds, g_memdup(&id, sizeof(id)), casefold);
+	popup.casefold_bytes += size;
+	return casefold;
+}
+
+static void popup_casefold_drop(guint64 id)
+{
+	gchar * casefold = (gchar *) g_hash_table_lookup(popup.casefolds, &id);
+
+	if (!casefold)
+		return;
+	popup.casefold_bytes -= strlen(casefold) + 1;
+	g_hash_table_remove(popup.casefolds, &id);
+}
+
+static gboolean popup_item_matches(struct history_item * c, const gchar * key)
+{
+	gchar * uncached;
+	gboolean match;
+
+	if (!key || !key[0])
+		return TRUE;
+	match = strstr(popup_casefold(c, &uncached), key) != NULL;
+	g_free(uncached);
+	return match;
+}
+
+/**fills the rows with the items that match the search. If the search only
+ got longer, the rows it had matched are all that need looking at.  */
+static void popup_model_fill(gboolean narrow)
+{
+	GArray * rows;
+	guint n, pass;
+
+	if (narrow) {
+		rows = g_array_sized_new(FALSE, FALSE, sizeof(guint64), popup.rows->len);
+		popup.n_recent = 0;
+		for (n = 0; n < popup.rows->len; n++) {
+			guint64 id = g_array_index(popup.rows, guint64, n);
+			struct history_item * c = history_lookup(id);
+			if (!c || !popup_item_matches(c, popup.search_casefold))
+				continue;
+			g_array_append_val(rows, id);
+			if (!(c->flags & CLIP_TYPE_PERSISTENT))
+				popup.n_recent++;
+		}
+	} else {
+		rows = g_array_sized_new(FALSE, FALSE, sizeof(guint64), history_length());
+		/**the recent items first, then the pinned ones  */
+		for (pass = 0; pass < 2; pass++) {
+			for (n = 0; n < history_length(); n++) {
+				struct history_item * c = history_nth(n);
+				guint64 id;
+				if (((c->flags & CLIP_TYPE_PERSISTENT) != 0) != pass)
+					continue;
+				if (!popup_item_matches(c, popup.search_casefold))
+					continue;
+				id = history_item_get_id(c);
+				g_array_append_val(rows, id);
+			}
+			if (!pass)
+				popup.n_recent = rows->len;
+		}
+	}
+	if (popup.rows)
+		g_array_free(popup.rows, TRUE);
+	popup.rows = rows;
+	popup.row_index_stale = TRUE;
+	g_array_set_size(popup.changes, 0);
+	popup.refill = FALSE;
+}
+
+/**applies the changes of the history since the rows were filled. The rows of
+ the changed items are taken out; the items added or moved to the front are
+ the first ones of the history, the pinned or unpinned ones are put back in
+ the order of the history. Only the changed items are matched again.  */
+static void popup_model_apply(void)
+{
+	GHashTable * changed = g_hash_table_new(g_int64_hash, g_int64_equal);
+	GHashTable * front = g_hash_table_new(g_int64_hash, g_int64_equal);
+	GHashTable * kept = g_hash_table_new(g_int64_hash, g_int64_equal);
+	GArray * rows[2];
+	guint n, pass;
+	gboolean flags = FALSE;
+
+	for (n = 0; n < popup.changes->len; n++) {
+		struct popup_change * pc = &g_array_index(popup.changes, struct popup_change, n);
+		g_hash_table_insert(changed, &pc->id, pc);
+		if (HISTORY_CHANGE_ADD == pc->change || HISTORY_CHANGE_MOVE_TO_FRONT == pc->change)
+			g_hash_table_insert(front, &pc->id, pc);
+		else if (HISTORY_CHANGE_FLAGS == pc->change)
+			flags = TRUE;
+	}
+	for (n = 0; n < popup.rows->len; n++) {
+		guint64 * id = &g_array_index(popup.rows, guint64, n);
+		if (!g_hash_table_lookup(changed, id))
+			g_hash_table_insert(kept, id, id);
+	}
+
+	rows[0] = g_array_sized_new(FALSE, FALSE, sizeof(guint64), popup.rows->len + g_hash_table_size(front));
+	rows[1] = g_array_new(FALSE, FALSE, sizeof(guint64));
+	for (n = 0; n < history_length(); n++) {
+		struct history_item * c = history_nth(n);
+		guint64 id = history_item_get_id(c);
+		gboolean pinned = (c->flags & CLIP_TYPE_PERSISTENT) != 0;
+
+		/**without a change of sections, the rest keeps its order  */
+		if (!flags && !g_hash_table_lookup(front, &id))
+			break;
+		if (g_hash_table_lookup(kept, &id) ||
+			(g_hash_table_lookup(changed, &id) && popup_item_matches(c, popup.search_casefold)))
+			g_array_append_val(rows[pinned], id);
+	}
+	if (!flags)
+		for (pass = 0; pass < 2; pass++)
+			for (n = pass ? popup.n_recent : 0; n < (pass ? popup.rows->len : popup.n_recent); n++) {
+				guint64 id = g_array_index(popup.rows, guint64, n);
+				if (g_hash_table_lookup(kept, &id))
+					g_array_append_val(rows[pass], id);
+			}
+
+	popup.n_recent = rows[0]->len;
+	g_array_append_vals(rows[0], rows[1]->data, rows[1]->len);
+	g_array_free(rows[1], TRUE);
+	g_array_free(popup.rows, TRUE);
+	popup.rows = rows[0];
+	popup.row_index_stale = TRUE;
+	g_array_set_size(popup.changes, 0);
+	g_hash_table_destroy(kept);
+	g_hash_table_destroy(front);
+	g_hash_table_destroy(changed);
+}
+
+/******************************************************************************/
+
+static gint popup_find_row(guint64 id)
+{
+	gpointer row;
+	guint n;
+
+	if (popup.row_index_stale) {
+		/**the keys are the ids in the rows  */
+		g_hash_table_remove_all(popup.row_index);
+		for (n = 0; n < popup.rows->len; n++)
+			g_hash_table_insert(popup.row_index, &g_array_index(popup.rows, guint64, n), GUINT_TO_POINTER(n + 1));
+		popup.row_index_stale = FALSE;
+	}
+	row = g_hash_table_lookup(popup.row_index, &id);
+	return row ? (gint) GPOINTER_TO_UINT(row) - 1 : -1;
+}
+
+/**the row at a y coordinate of the area, or -1  */
+static gint popup_row_at(gdouble y)
+{
+	gint row = (gint) ((y + gtk_adjustment_get_value(popup.adj)) / popup.row_height);
+
+	if (y < 0 || row >= (gint) popup.rows->len)
+		return -1;
+	return row;
+}
+
+static void popup_update_adjustment(void)
+{
+	GtkAllocation a;
+
+	gtk_widget_get_allocation(popup.area, &a);
+	gtk_adjustment_configure(popup.adj,
+		gtk_adjustment_get_value(popup.adj),
+		0, (gdouble) popup.rows->len * popup.row_height,
+		popup.row_height, a.height, a.height);
+}
+
+/**selects the row and scrolls it into view  */
+static void popup_select(gint row)
+{
+	gdouble top = gtk_adjustment_get_value(popup.adj);
+	gdouble page = gtk_adjustment_get_page_size(popup.adj);
+
+	if (row >= (gint) popup.rows->len)
+		row = popup.rows->len - 1;
+	if (row < 0)
+		row = popup.rows->len ? 0 : -1;
+	popup.selected = row;
+	if (row >= 0) {
+		if (row * popup.row_height < top)
+			gtk_adjustment_set_value(popup.adj, row * popup.row_height);
+		else if ((row + 1) * popup.row_height > top + page)
+			gtk_adjustment_set_value(popup.adj, (row + 1) * popup.row_height - page);
+	}
+	gtk_widget_queue_draw(popup.area);
+}
+
+/******************************************************************************/
+
+static gboolean on_popup_expose(GtkWidget * widget, GdkEventExpose * event, gpointer user_data)
+{
+	GtkStyle * style = gtk_widget_get_style(widget);
+	GdkWindow * window = gtk_widget_get_window(widget);
+	PangoLayout * layout = gtk_widget_create_pango_layout(widget, NULL);
+	GtkAllocation a;
+	gint top = (gint) gtk_adjustment_get_value(popup.adj);
+	gint row, last;
+
+	gtk_widget_get_allocation(widget, &a);
+	pango_layout_set_width(layout, (a.width - 2 * POPUP_PADDING) * PANGO_SCALE);
+	pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
+
+	if (!popup.rows->len) {
+		pango_layout_set_text(layout, _("Empty"), -1);
+		gtk_paint_layout(style, window, GTK_STATE_INSENSITIVE, TRUE, &event->area, widget, "label",
+			POPUP_PADDING, POPUP_PADDING / 2, layout);
+		g_object_unref(layout);
+		return TRUE;
+	}
+
+	/**only the rows in the exposed area  */
+	row = (top + event->area.y) / popup.row_height;
+	last = (top + event->area.y + event->area.height - 1) / popup.row_height;
+	for (; row <= last && row < (gint) popup.rows->len; row++) {
+		guint64 id = g_array_index(popup.rows, guint64, row);
+		struct history_item * c = history_lookup(id);
+		GtkStateType state = row == popup.selected ? GTK_STATE_PRELIGHT : GTK_STATE_NORMAL;
+		gint y = row * popup.row_height - top;
+		gchar * label, * markup;
+
+		if (!c)
+			continue;
+		if (GTK_STATE_PRELIGHT == state)
+			gtk_paint_box(style, window, state, GTK_SHADOW_OUT, &event->area, widget, "menuitem",
+				0, y, a.width, popup.row_height);
+
+		label = history_item_label(c, &popup.style, NULL);
+		markup = g_markup_printf_escaped(
+			id == popup.bold_id ? "<b>%s</b>" : id == popup.italic_id ? "<i>%s</i>" : "%s", label);
+		if (g_hash_table_lookup(popup.deleted, &id)) {
+			gchar * s = g_strconcat("<s>", markup, "</s>", NULL);
+			g_free(markup);
+			markup = s;
+		}
+		pango_layout_set_markup(layout, markup, -1);
+		gtk_paint_layout(style, window, state, TRUE, &event->area, widget, "menuitem",
+			POPUP_PADDING, y + POPUP_PADDING / 2, layout);
+		g_free(markup);
+		g_free(label);
+	}
+
+	if (popup.n_recent && popup.n_recent < popup.rows->len)
+		gtk_paint_hline(style, window, GTK_STATE_NORMAL, &event->area, widget, "menuitem",
+			0, a.width, popup.n_recent * popup.row_height - top);
+
+	g_object_unref(layout);
+	return TRUE;
+}
+
+/******************************************************************************/
+
+static gboolean on_popup_query_tooltip(GtkWidget * widget, gint x, gint y, gboolean keyboard_mode,
+	GtkTooltip * tooltip, gpointer user_data)
+{
+	gint row = keyboard_mode ? popup.selected : popup_row_at(y);
+	struct history_item * c = row >= 0 ? history_lookup(g_array_index(popup.rows, guint64, row)) : NULL;
+	gchar * text = NULL;
+
+	if (!c)
+		return FALSE;
+	g_free(history_item_label(c, &popup.style, &text));
+	if (!text)
+		return FALSE;
+	gtk_tooltip_set_text(tooltip, text);
+	g_free(text);
+	return TRUE;
+}
+
+/******************************************************************************/
+
+static gboolean popup_grab(guint32 activate_time)
+{
+	GdkWindow * window = gtk_widget_get_window(popup.window);
+
+	gtk_grab_add(popup.window);
+	if (gdk_pointer_grab(window, TRUE,
+			GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_POINTER_MOTION_MASK,
+			NULL, NULL, activate_time) != GDK_GRAB_SUCCESS ||
+		gdk_keyboard_grab(window, TRUE, activate_time) != GDK_GRAB_SUCCESS)
+	{
+		g_fprintf(stderr, "history popup: can't grab the pointer and the keyboard\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/******************************************************************************/
+
+/**hides the popup and deletes the items marked for it  */
+static void popup_hide(void)
+{
+	GList * ids, * i;
+
+	if (!popup.shown)
+		return;
+	popup.shown = FALSE;
+	gdk_pointer_ungrab(GDK_CURRENT_TIME);
+	gdk_keyboard_ungrab(GDK_CURRENT_TIME);
+	gtk_grab_remove(popup.window);
+	gtk_im_context_focus_out(popup.im_context);
+	gtk_widget_hide(popup.window);
+	if (popup.refresh_id) {
+		g_source_remove(popup.refresh_id);
+		popup.refresh_id = 0;
+	}
+
+	ids = g_hash_table_get_keys(popup.deleted);
+	for (i = ids; i != NULL; i = i->next)
+		history_delete_item(*(const guint64 *) i->data);
+	g_list_free(ids);
+	g_hash_table_remove_all(popup.deleted);
+}
+
+/******************************************************************************/
+
+static void popup_activate(gint row)
+{
+	struct history_item * c;
+	struct shared_text * txt = NULL;
+	guint64 id;
+
+	if (row < 0)
+		return;
+	id = g_array_index(popup.rows, guint64, row);
+	c = history_lookup(id);
+	/**still there, not marked to be deleted  */
+	if (c && !g_hash_table_lookup(popup.deleted, &id))
+		txt = history_item_get_text(c);
+	popup_hide();
+	if (txt) {
+		update_clipboards(CLIPBOARD_ACTION_SET, txt);
+		shared_text_unref(txt);
+	}
+}
+
+/******************************************************************************/
+
+static void popup_toggle_deleted(gint row)
+{
+	guint64 id = g_array_index(popup.rows, guint64, row);
+
+	if (!g_hash_table_remove(popup.deleted, &id))
+		g_hash_table_insert(popup.deleted, g_memdup(&id, sizeof(id)), GINT_TO_POINTER(TRUE));
+	gtk_widget_queue_draw(popup.area);
+}
+
+static void on_popup_pin_activated(GtkMenuItem * menu_item, gpointer user_data)
+{
+	struct history_item * c = history_lookup(MENU_ITEM_ID(user_data));
+
+	if (c)
+		history_set_item_flags(c, c->flags ^ CLIP_TYPE_PERSISTENT);
+}
+
+static void on_popup_item_menu_done(GtkMenuShell * menu, gpointer user_data)
+{
+	popup.in_item_menu = FALSE;
+	gtk_widget_destroy((GtkWidget *) menu);
+	/**the menu took the grab, the popup goes on  */
+	if (popup.shown && !popup_grab(GDK_CURRENT_TIME))
+		popup_hide();
+}
+
+static void popup_item_menu(gint row, GdkEventButton * event)
+{
+	guint64 id = g_array_index(popup.rows, guint64, row);
+	struct history_item * c = history_lookup(id);
+	GtkWidget * menu, * menu_item;
+	guint64 * item_id;
+
+	if (!c)
+		return;
+	menu = gtk_menu_new();
+	item_id = g_memdup(&id, sizeof(id));
+	g_object_set_data_full((GObject *) menu, "history-item-id", item_id, g_free);
+	g_signal_connect(menu, "selection-done", (GCallback) on_popup_item_menu_done, NULL);
+
+	menu_item = gtk_menu_item_new_with_label((c->flags & CLIP_TYPE_PERSISTENT) ? _("Unpin") : _("Pin"));
+	g_signal_connect(menu_item, "activate", (GCallback) on_popup_pin_activated, item_id);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), menu_item);
+	menu_item = gtk_menu_item_new_with_label(_("Cancel"));
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), menu_item);
+	gtk_widget_show_all(menu);
+
+	popup.in_item_menu = TRUE;
+	gtk_menu_popup(GTK_MENU(menu), NULL, NULL, NULL, NULL, 0, event->time);
+}
+
+/******************************************************************************/
+
+static gboolean on_popup_motion(GtkWidget * widget, GdkEventMotion * event, gpointer user_data)
+{
+	gint row = popup_row_at(event->y);
+
+	if (row >= 0 && row != popup.selected) {
+		popup.selected = row;
+		gtk_widget_queue_draw(widget);
+	}
+	return TRUE;
+}
+
+static gboolean on_popup_button_release(GtkWidget * widget, GdkEventButton * event, gpointer user_data)
+{
+	gint row = popup_row_at(event->y);
+
+	if (row < 0)
+		return FALSE;
+	if (1 == event->button)
+		popup_activate(row);
+	else if (3 == event->button) {
+		if (event->state & GDK_CONTROL_MASK)
+			popup_toggle_deleted(row);
+		else
+			popup_item_menu(row, event);
+	}
+	return TRUE;
+}
+
+static gboolean on_popup_scroll(GtkWidget * widget, GdkEventScroll * event, gpointer user_data)
+{
+	gdouble step = 3 * gtk_adjustment_get_step_increment(popup.adj);
+
+	if (GDK_SCROLL_UP == event->direction)
+		step = -step;
+	else if (GDK_SCROLL_DOWN != event->direction)
+		return FALSE;
+	gtk_adjustment_set_value(popup.adj, gtk_adjustment_get_value(popup.adj) + step);
+	return TRUE;
+}
+
+/**with the pointer grabbed, a click anywhere else closes the popup  */
+static gboolean on_popup_window_button_press(GtkWidget * widget, GdkEventButton * event, gpointer user_data)
+{
+	gint x, y, width, height;
+
+	gdk_window_get_origin(gtk_widget_get_window(widget), &x, &y);
+	gdk_drawable_get_size(gtk_widget_get_window(widget), &width, &height);
+	if (event->x_root < x || event->y_root < y || event->x_root >= x + width || event->y_root >= y + height)
+		popup_hide();
+	return FALSE;
+}
+
+static gboolean on_popup_grab_broken(GtkWidget * widget, GdkEvent * event, gpointer user_data)
+{
+	if (!popup.in_item_menu)
+		popup_hide();
+	return FALSE;
+}
+
+/******************************************************************************/
+
+static void popup_apply_search(void)
+{
+	gchar * key = g_utf8_casefold(popup.search_string->str, -1);
+	gboolean narrow = popup.search_casefold && g_str_has_prefix(key, popup.search_casefold);
+
+	g_free(popup.search_casefold);
+	popup.search_casefold = key;
+	popup_model_fill(narrow);
+
+	gtk_label_set_text((GtkLabel *) popup.search, popup.search_string->str);
+	gtk_widget_set_visible(popup.search, popup.search_string->len > 0);
+	popup_update_adjustment();
+	gtk_adjustment_set_value(popup.adj, 0);
+	popup_select(0);
+}
+
+static void on_popup_im_context_commit(GtkIMContext * context, gchar * str, gpointer user_data)
+{
+	g_string_append(popup.search_string, str);
+	popup_apply_search();
+}
+
+static void popup_search_backspace(gboolean all)
+{
+	gchar * prev_char;
+
+	if (!popup.search_string->len)
+		return;
+	prev_char = all ? popup.search_string->str :
+		g_utf8_find_prev_char(popup.search_string->str, popup.search_string->str + popup.search_string->len);
+	g_string_truncate(popup.search_string, prev_char ? prev_char - popup.search_string->str : 0);
+	popup_apply_search();
+}
+
+/******************************************************************************/
+
+static gboolean on_popup_key(GtkWidget * widget, GdkEventKey * event, gpointer user_data)
+{
+	gint page = (gint) (gtk_adjustment_get_page_size(popup.adj) / popup.row_height);
+
+	if (get_pref_int32("type_search") && gtk_im_context_filter_keypress(popup.im_context, event))
+		return TRUE;
+	if (GDK_KEY_PRESS != event->type)
+		return FALSE;
+
+	switch (event->keyval) {
+		case GDK_KEY_Escape:
+			popup_hide();
+			break;
+		case GDK_KEY_Return:
+		case GDK_KEY_KP_Enter:
+		case GDK_KEY_ISO_Enter:
+			popup_activate(popup.selected);
+			break;
+		case GDK_KEY_Up:
+		case GDK_KEY_KP_Up:
+			popup_select(popup.selected > 0 ? popup.selected - 1 : (gint) popup.rows->len - 1);
+			break;
+		case GDK_KEY_Down:
+		case GDK_KEY_KP_Down:
+			popup_select(popup.selected + 1 < (gint) popup.rows->len ? popup.selected + 1 : 0);
+			break;
+		case GDK_KEY_Page_Up:
+		case GDK_KEY_KP_Page_Up:
+			popup_select(MAX(popup.selected - MAX(page, 1), 0));
+			break;
+		case GDK_KEY_Page_Down:
+		case GDK_KEY_KP_Page_Down:
+			popup_select(popup.selected + MAX(page, 1));
+			break;
+		case GDK_KEY_Home:
+		case GDK_KEY_KP_Home:
+			popup_select(0);
+			break;
+		case GDK_KEY_End:
+		case GDK_KEY_KP_End:
+			popup_select(popup.rows->len - 1);
+			break;
+		case GDK_KEY_BackSpace:
+			if (!get_pref_int32("type_search"))
+				return FALSE;
+			popup_search_backspace((event->state & GDK_CONTROL_MASK) != 0);
+			break;
+		default:
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/******************************************************************************/
+
+static gboolean popup_refresh(gpointer data)
+{
+	gint row = popup.selected;
+	guint64 selected_id = row >= 0 && row < (gint) popup.rows->len ? g_array_index(popup.rows, guint64, row) : 0;
+
+	popup.refresh_id = 0;
+	if (popup.refill)
+		popup_model_fill(FALSE);
+	else
+		popup_model_apply();
+	row = selected_id ? popup_find_row(selected_id) : -1;
+	popup_update_adjustment();
+	popup_select(row >= 0 ? row : popup.selected);
+	return FALSE;
+}
+
+/**while the popup is shown, it follows the changes of the history  */
+static void on_history_popup_changed(enum history_change change, const struct history_item * c)
+{
+	struct popup_change pc;
+
+	if (!popup.window)
+		return;
+	if (HISTORY_CHANGE_ALL == change) {
+		g_hash_table_remove_all(popup.casefolds);
+		popup.casefold_bytes = 0;
+	} else if (HISTORY_CHANGE_DELETE == change)
+		popup_casefold_drop(history_item_get_id(c));
+	if (!popup.shown)
+		return;
+
+	/**past the size of the history, a refill is cheaper  */
+	if (HISTORY_CHANGE_ALL == change || popup.changes->len >= (guint) get_pref_int32("history_limit")) {
+		g_array_set_size(popup.changes, 0);
+		popup.refill = TRUE;
+	} else if (!popup.refill) {
+		pc.change = change;
+		pc.id = history_item_get_id(c);
+		g_array_append_val(popup.changes, pc);
+	}
+	if (!popup.refresh_id)
+		popup.refresh_id = g_idle_add(popup_refresh, NULL);
+}
+
+/******************************************************************************/
+
+static void popup_create(void)
+{
+	GtkWidget * frame, * vbox, * hbox;
+
+	popup.window = gtk_window_new(GTK_WINDOW_POPUP);
+	gtk_window_set_type_hint((GtkWindow *) popup.window, GDK_WINDOW_TYPE_HINT_POPUP_MENU);
+	g_signal_connect((GObject *) popup.window, "key-press-event", (GCallback) on_popup_key, NULL);
+	g_signal_connect((GObject *) popup.window, "key-release-event", (GCallback) on_popup_key, NULL);
+	g_signal_connect((GObject *) popup.window, "button-press-event", (GCallback) on_popup_window_button_press, NULL);
+	g_signal_connect((GObject *) popup.window, "grab-broken-event", (GCallback) on_popup_grab_broken, NULL);
+	g_signal_connect((GObject *) popup.window, "map-event", (GCallback) on_popup_mapped, NULL);
+
+	frame = gtk_frame_new(NULL);
+	gtk_frame_set_shadow_type((GtkFrame *) frame, GTK_SHADOW_OUT);
+	gtk_container_add((GtkContainer *) popup.window, frame);
+	vbox = gtk_vbox_new(FALSE, 0);
+	gtk_container_add((GtkContainer *) frame, vbox);
+
+	popup.search = gtk_label_new(NULL);
+	gtk_misc_set_alignment((GtkMisc *) popup.search, 0, 0.5);
+	gtk_misc_set_padding((GtkMisc *) popup.search, POPUP_PADDING, POPUP_PADDING / 2);
+	gtk_box_pack_start((GtkBox *) vbox, popup.search, FALSE, FALSE, 0);
+
+	hbox = gtk_hbox_new(FALSE, 0);
+	gtk_box_pack_start((GtkBox *) vbox, hbox, TRUE, TRUE, 0);
+	popup.adj = (GtkAdjustment *) gtk_adjustment_new(0, 0, 0, 1, 1, 1);
+	popup.area = gtk_drawing_area_new();
+	gtk_widget_add_events(popup.area,
+		GDK_POINTER_MOTION_MASK | GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_SCROLL_MASK);
+	gtk_widget_set_has_tooltip(popup.area, TRUE);
+	g_signal_connect((GObject *) popup.area, "expose-event", (GCallback) on_popup_expose, NULL);
+	g_signal_connect((GObject *) popup.area, "query-tooltip", (GCallback) on_popup_query_tooltip, NULL);
+	g_signal_connect((GObject *) popup.area, "motion-notify-event", (GCallback) on_popup_motion, NULL);
+	g_signal_connect((GObject *) popup.area, "button-release-event", (GCallback) on_popup_button_release, NULL);
+	g_signal_connect((GObject *) popup.area, "scroll-event", (GCallback) on_popup_scroll, NULL);
+	g_signal_connect_swapped((GObject *) popup.area, "size-allocate", (GCallback) popup_update_adjustment, NULL);
+	g_signal_connect_swapped((GObject *) popup.adj, "value-changed", (GCallback) gtk_widget_queue_draw, popup.area);
+	gtk_box_pack_start((GtkBox *) hbox, popup.area, TRUE, TRUE, 0);
+	gtk_box_pack_start((GtkBox *) hbox, gtk_vscrollbar_new(popup.adj), FALSE, FALSE, 0);
+
+	popup.rows = g_array_new(FALSE, FALSE, sizeof(guint64));
+	popup.row_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+	popup.changes = g_array_new(FALSE, FALSE, sizeof(struct popup_change));
+	popup.casefolds = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+	popup.deleted = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	popup.search_string = g_string_new("");
+	popup.im_context = gtk_im_multicontext_new();
+	gtk_im_context_set_use_preedit(popup.im_context, FALSE);
+	g_signal_connect((GObject *) popup.im_context, "commit", (GCallback) on_popup_im_context_commit, NULL);
+}
+
+/******************************************************************************/
+
+/**sizes the popup to the width of the labels and as many rows as fit in
+ two thirds of the monitor, and places it like the menu  */
+static void popup_place(guint mouse_button)
+{
+	GdkScreen * screen = gtk_widget_get_screen(popup.window);
+	PangoLayout * layout = gtk_widget_create_pango_layout(popup.area, "Xg");
+	PangoFontMetrics * metrics;
+	GdkRectangle monitor;
+	gint x, y, width, height, rows;
+
+	pango_layout_get_pixel_size(layout, NULL, &popup.row_height);
+	popup.row_height += POPUP_PADDING;
+	metrics = pango_context_get_metrics(pango_layout_get_context(layout),
+		gtk_widget_get_style(popup.area)->font_desc, NULL);
+	width = PANGO_PIXELS(pango_font_metrics_get_approximate_char_width(metrics)) * (popup.style.item_length + 3)
+		+ 2 * POPUP_PADDING;
+	pango_font_metrics_unref(metrics);
+	g_object_unref(layout);
+
+	if (mouse_button)
+		gdk_display_get_pointer(gdk_screen_get_display(screen), NULL, &x, &y, NULL);
+	else
+		on_history_menu_position(NULL, &x, &y, NULL, NULL);
+	gdk_screen_get_monitor_geometry(screen, gdk_screen_get_monitor_at_point(screen, x, y), &monitor);
+
+	rows = MIN(MAX(popup.rows->len, 1), (guint) MAX(monitor.height * 2 / 3 / popup.row_height, 1));
+	height = rows * popup.row_height;
+	gtk_widget_set_size_request(popup.area, MIN(width, monitor.width), height);
+
+	x = CLAMP(x, monitor.x, monitor.x + MAX(monitor.width - width, 0));
+	y = CLAMP(y, monitor.y, monitor.y + MAX(monitor.height - height, 0));
+	gtk_window_move((GtkWindow *) popup.window, x, y);
+}
+
+/******************************************************************************/
+
+static gboolean do_show_history_popup(gpointer data)
+{
+	history_menu_query_t * query = (history_menu_query_t *) data;
+	struct history_item * c;
+
+	if (!query)
+		return FALSE;
+	if (!popup.window)
+		popup_create();
+	popup_hide();
+
+	get_menu_style(&popup.style);
+	g_string_truncate(popup.search_string, 0);
+	g_free(popup.search_casefold);
+	popup.search_casefold = NULL;
+	gtk_im_context_reset(popup.im_context);
+	popup_model_fill(FALSE);
+
+	/**the contents as last captured, as in the menu  */
+	c = history_lookup_text(text_clipboard);
+	popup.bold_id = c ? history_item_get_id(c) : 0;
+	c = history_lookup_text(text_primary);
+	popup.italic_id = c ? history_item_get_id(c) : 0;
+
+	gtk_widget_ensure_style(popup.area);
+	popup_place(query->mouse_button);
+	popup_latency.pending = query->requested;
+	gtk_widget_show_all(popup.window);
+	gtk_widget_hide(popup.search);
+	gtk_adjustment_set_value(popup.adj, 0);
+	popup_select(0);
+
+	popup.shown = TRUE;
+	gtk_im_context_set_client_window(popup.im_context, gtk_widget_get_window(popup.window));
+	gtk_im_context_focus_in(popup.im_context);
+	if (!popup_grab(query->activate_time)) {
+		/**the hotkey still holds the keyboard, as for the menu  */
+		popup_latency.pending = 0;
+		popup_hide();
+		if (query->retries++ < POPUP_RETRIES) {
+			g_timeout_add(POPUP_RETRY_DELAY, do_show_history_popup, query);
+			return FALSE;
+		}
+		g_fprintf(stderr, "history popup: can't grab the pointer and the keyboard\n");
+	}
+
+	g_free(query);
+	return FALSE;
+}
+
+/******************************************************************************/
+
+static void show_history_popup(guint mouse_button, guint32 activate_time)
+{
+	if (activate_time == GDK_CURRENT_TIME)
+		activate_time = gtk_get_current_event_time();
+
+	history_menu_query_t * query = g_try_new0(history_menu_query_t, 1);
+	if (!query)
+		return;
+
+	query->mouse_button = mouse_button;
+	query->activate_time = activate_time;
+	query->requested = popup_latency_start(activate_time);
+
+	g_idle_add_full(G_PRIORITY_HIGH, do_show_history_popup, query, NULL);
+}
+
+/******************************************************************************/
+
+/**the menu or the popup, as the preferences say  */
+static void show_history(guint mouse_button, guint32 activate_time)
+{
+	if (get_pref_int32("history_popup"))
+		show_history_popup(mouse_button, activate_time);
+	else
+		show_history_menu(mouse_button, activate_time);
+}
+
+/**builds the menu or the popup ahead of the first popup  */
+static void prewarm_history(void)
+{
+	popup_latency_calibrate();
+	if (get_pref_int32("history_popup")) {
+		if (!popup.window)
+			popup_create();
+		gtk_widget_realize(popup.window);
+	} else
+		history_menu_prewarm();
+}
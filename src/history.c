@@ -19,195 +19,1324 @@
  */
 
 #include "rainbow-cm.h"
+#include "history_file.h"
 
 
-/**This is now a gslist of   */
-GList* history_list=NULL;
 static gint dbg=0;
 
-#define HISTORY_MAGIC_SIZE 32
-#define HISTORY_VERSION     1 /**index (-1) into array below  */
-static gchar* history_magics[]={  
+/**
+ The history, most recent first: a ring buffer of item pointers, position n
+ is in ring[(ring_head + n) & (ring_capacity - 1)]. Adding to the front is
+ O(1); a removal shifts the shorter side, which is a few pointers in
+ contiguous memory. Each item keeps its position plus ring_base, so it is
+ found in O(1): only the items a change shifts have to be updated. The items
+ are also indexed by their id (id_index), so
+ the menu can refer to an item by id no matter how the history changes.
+*/
+static struct history_item ** ring = NULL;
+static guint ring_capacity = 0;   /**power of 2  */
+static guint ring_head = 0;
+static guint ring_len = 0;
+static guint32 ring_base = 0;     /**the slot of position 0, wraps around  */
+
+#define RING_SLOT(n) ring[(ring_head + (n)) & (ring_capacity - 1)]
+
+static GHashTable * id_index = NULL;
+
+gchar* history_magics[]={
 	"1.0RainbowCMHistoryFile",
+	"2.0RainbowCMHistoryFile",
+	"3.0RainbowCMHistoryFile",
 	NULL,
 };
 
-#define HISTORY_FILE0 HISTORY_FILE
+static gboolean journal_stale = TRUE; /**file doesn't match the history, the next write is a full snapshot  */
+static gboolean snapshot_due = FALSE; /**deferred to the exit, under on exit durability  */
+/**both count a record as history_record_size() does, a compressed one as if
+ its text weren't: a snapshot is only compressed when the writer writes it  */
+static guint64 journal_size = 0;     /**bytes in the journal file, once the queued records are written  */
+static guint64 journal_live = 0;     /**bytes the live items would take in a snapshot  */
+static guint64 next_item_id = 1;
+
+/**items removed while the writer may still read their text from a snapshot  */
+static GSList * deferred_frees = NULL;
+/**arena texts let go of by live items (which then shared a copy), with the
+ same wait: a snapshot's copy of the item still points into the arena  */
+static GSList * deferred_arena_frees = NULL;
+
+/**
+ Text items by content, for the duplicate check of every capture. The key and
+ the value are the item itself, hashed by the text hash kept in res[2],
+ res[3]. The texts are compared only when the hashes match.
+*/
+static GHashTable * text_index = NULL;
+static history_change_func change_func = NULL;
+
+/**
+ Items that refer to each file of the blob store. A file is named by the hash
+ and the length of its text, so items whose previews differ (a collision) or
+ the unindexed duplicates of an older file share one; it is removed with the
+ last of them.
+*/
+struct blob_key {
+	guint64 hash;
+	guint32 len;
+	guint count;  /**items, not part of the key  */
+};
+
+static GHashTable * blob_refs = NULL;  /**the key and the value are a struct blob_key  */
+
+struct dedup_stats {
+	guint lookups;     /**captures checked for a duplicate  */
+	guint found;       /**duplicates moved to the front  */
+	guint compares;    /**full text comparisons  */
+	guint collisions;  /**comparisons of different texts with the same hash  */
+};
+static struct dedup_stats dedup_stats;
+
+/**
+ A version 2 history file is mapped rather than read: the text of a loaded
+ item points into the ADD record, which is NUL-padded. The records are
+ never modified in place (the journal is only appended to, and compaction
+ renames a new file over it), so the mapping stays valid. It is released
+ when the last item referring to it is freed.
+*/
+static GMappedFile * history_map = NULL;
+static guint history_map_items = 0;
+/**the dictionary the deflated texts of the mapped file need  */
+static struct history_dict * load_dict = NULL;
+/**size of the record header in the mapped file, it depends on the version  */
+static guint32 map_record_size = sizeof(struct history_record);
+
+static guint pack_source = 0;
+static gboolean pack_blocked = FALSE; /**by a queued snapshot, retried once it is written  */
+
+#define HISTORY_EACH(n, item, code) \
+{\
+    guint n;\
+    for (n = 0; n < ring_len; n++)\
+	{\
+        struct history_item * item = RING_SLOT(n);\
+        {\
+			code\
+		}\
+    }\
+}
+
+#define PINNED(item) ((item)->flags & CLIP_TYPE_PERSISTENT)
+
+static void write_snapshot_locked(void);
+static void queue_snapshot_locked(void);
+static void history_item_release(struct history_item *c);
+static void schedule_pack(void);
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void ring_grow(void)
+{
+	guint capacity = ring_capacity ? ring_capacity * 2 : 64;
+	struct history_item ** items = g_new(struct history_item *, capacity);
+	guint n;
+
+	for (n = 0; n < ring_len; n++)
+		items[n] = RING_SLOT(n);
+	g_free(ring);
+	ring = items;
+	ring_capacity = capacity;
+	ring_head = 0;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void ring_push_front(struct history_item *c)
+{
+	if (ring_len == ring_capacity)
+		ring_grow();
+	ring_head = (ring_head + ring_capacity - 1) & (ring_capacity - 1);
+	ring[ring_head] = c;
+	c->slot = --ring_base;
+	ring_len++;
+}
+
+/***************************************************************************/
+/** Removes the item at the position, shifting the shorter side. The base
+moves with the front, so the items behind it keep their slots.
+\n\b Arguments:
+\n\b Returns:	the item.
+****************************************************************************/
+static struct history_item *ring_remove_at(guint n)
+{
+	struct history_item * c = RING_SLOT(n);
+	guint i;
+
+	if (n < ring_len / 2) {
+		for (i = n; i > 0; i--) {
+			RING_SLOT(i) = RING_SLOT(i - 1);
+			RING_SLOT(i)->slot++;
+		}
+		ring_head = (ring_head + 1) & (ring_capacity - 1);
+		ring_base++;
+	} else {
+		for (i = n; i + 1 < ring_len; i++) {
+			RING_SLOT(i) = RING_SLOT(i + 1);
+			RING_SLOT(i)->slot--;
+		}
+	}
+	ring_len--;
+	return c;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	position of the item, or -1.
+****************************************************************************/
+static gint ring_position(const struct history_item *c)
+{
+	guint n = c->slot - ring_base;
+	if (n < ring_len && RING_SLOT(n) == c)
+		return n;
+	return -1;
+}
+
+/***************************************************************************/
+/** Moves the item to the position, where the removals left a gap.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void ring_set(guint n, struct history_item *c)
+{
+	RING_SLOT(n) = c;
+	c->slot = ring_base + n;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static guint id_index_hash(gconstpointer key)
+{
+	guint64 id = history_item_get_id((const struct history_item *) key);
+	return (guint) (id ^ (id >> 32));
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean id_index_equal(gconstpointer a, gconstpointer b)
+{
+	return history_item_get_id((const struct history_item *) a) ==
+		history_item_get_id((const struct history_item *) b);
+}
+
+/***************************************************************************/
+/** Number of items in the history.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+guint history_length(void)
+{
+	return ring_len;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:	position, 0 is the most recent item.
+\n\b Returns:	the item, or NULL if out of range.
+****************************************************************************/
+struct history_item *history_nth(guint n)
+{
+	if (n >= ring_len)
+		return NULL;
+	return RING_SLOT(n);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the item with the id, or NULL if it is no longer in the history.
+****************************************************************************/
+struct history_item *history_lookup(guint64 id)
+{
+	struct history_item probe;
+
+	if (!id_index)
+		return NULL;
+	history_item_set_id(&probe, id);
+	return (struct history_item *) g_hash_table_lookup(id_index, &probe);
+}
+
+/***************************************************************************/
+/** Sets the function told of each change of the history, such as the menu.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_set_change_func(history_change_func func)
+{
+	change_func = func;
+}
+
+static void history_changed(enum history_change change, const struct history_item *c)
+{
+	if (change_func)
+		change_func(change, c);
+}
+
+/***************************************************************************/
+/** Pass in the text via the struct. We assume len is correct, and BYTE based,
+not character.
+\n\b Arguments:
+\n\b Returns:	length of resulting string.
+****************************************************************************/
+glong validate_utf8_text(gchar *text, glong len)
+{
+	const gchar *valid;
+	if(NULL == text || len <= 0)
+		return 0;
+	text[len]=0;
+	if(FALSE == g_utf8_validate(text,-1,&valid)) {
+		len=valid-text;
+		text[len]=0;
+		g_fprintf(stderr,"Truncating invalid utf8 text entry: '%s'\n",text);
+	}
+	return len;
+}
+
+#define TEXT_HASH_M G_GUINT64_CONSTANT(0xc6a4a7935bd1e995)
+
+static inline guint64 text_hash_word(guint64 h, guint64 k)
+{
+	k *= TEXT_HASH_M;
+	k ^= k >> 47;
+	k *= TEXT_HASH_M;
+	h ^= k;
+	return h * TEXT_HASH_M;
+}
+
+/***************************************************************************/
+/** The length is part of the hash, it must be known before the text.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_text_hash_begin(struct text_hash_state *s, gsize len)
+{
+	s->h = G_GUINT64_CONSTANT(0x9e3779b97f4a7c15) ^ (len * TEXT_HASH_M);
+	s->len = len;
+	s->seen = 0;
+	s->tail_len = 0;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_text_hash_update(struct text_hash_state *s, const gchar *data, gsize n)
+{
+	guint64 h = s->h;
+	guint64 k;
+
+	s->seen += n;
+	if (s->tail_len) {
+		gsize take = MIN(n, 8 - s->tail_len);
+		memcpy(s->tail + s->tail_len, data, take);
+		s->tail_len += take;
+		data += take;
+		n -= take;
+		if (s->tail_len < 8) {
+			s->h = h;
+			return;
+		}
+		memcpy(&k, s->tail, 8);
+		h = text_hash_word(h, k);
+		s->tail_len = 0;
+	}
+	for (; n >= 8; data += 8, n -= 8) {
+		memcpy(&k, data, 8);
+		h = text_hash_word(h, k);
+	}
+	memcpy(s->tail, data, n);
+	s->tail_len = n;
+	s->h = h;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the hash, or 0 if the text wasn't of the announced length.
+****************************************************************************/
+guint64 history_text_hash_end(struct text_hash_state *s)
+{
+	guint64 h = s->h;
+
+	if (s->seen != s->len)
+		return 0;
+	if (s->tail_len) {
+		guint64 k = 0;
+		memcpy(&k, s->tail, s->tail_len);
+		h ^= k;
+		h *= TEXT_HASH_M;
+	}
+	h ^= h >> 47;
+	h *= TEXT_HASH_M;
+	h ^= h >> 47;
+	return h ? h : 1;
+}
+
+/***************************************************************************/
+/** 64-bit hash of the text (MurmurHash64A), a word at a time. Never 0, which
+marks an item whose hash hasn't been computed.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+guint64 history_text_hash(const gchar *text, gsize len)
+{
+	struct text_hash_state s;
+
+	history_text_hash_begin(&s, len);
+	history_text_hash_update(&s, text, len);
+	return history_text_hash_end(&s);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static guint text_index_hash(gconstpointer key)
+{
+	guint64 h = history_item_get_hash((const struct history_item *) key);
+	return (guint) (h ^ (h >> 32));
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean text_index_equal(gconstpointer a, gconstpointer b)
+{
+	const struct history_item * x = (const struct history_item *) a;
+	const struct history_item * y = (const struct history_item *) b;
+
+	if (x == y)
+		return TRUE;
+	if (history_item_get_hash(x) != history_item_get_hash(y) || x->len != y->len)
+		return FALSE;
+	dedup_stats.compares++;
+	/**a blob is named by the hash and the length of its text, only its preview is compared  */
+	if (memcmp(history_item_text((struct history_item *) x), history_item_text((struct history_item *) y),
+			MIN(history_item_text_len(x), history_item_text_len(y))) != 0) {
+		dedup_stats.collisions++;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Indexes the item, unless an item with the same text is already indexed.
+Must be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void text_index_add(struct history_item *c)
+{
+	if (CLIP_TYPE_TEXT != c->type)
+		return;
+	if (!text_index)
+		text_index = g_hash_table_new(text_index_hash, text_index_equal);
+	if (0 == history_item_get_hash(c))
+		history_item_set_hash(c, history_text_hash(history_item_text(c), c->len));
+	if (!g_hash_table_lookup(text_index, c))
+		g_hash_table_insert(text_index, c, c);
+}
+
+/***************************************************************************/
+/** Must be called with hist_lock held, before the item is freed.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void text_index_remove(struct history_item *c)
+{
+	gpointer key;
+
+	/**an older copy of a duplicate text (from a version 1 file) isn't indexed  */
+	if (text_index && g_hash_table_lookup_extended(text_index, c, &key, NULL) && key == c)
+		g_hash_table_remove(text_index, c);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static guint blob_key_hash(gconstpointer key)
+{
+	const struct blob_key * k = (const struct blob_key *) key;
+	return (guint) (k->hash ^ (k->hash >> 32)) ^ k->len;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean blob_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct blob_key * x = (const struct blob_key *) a;
+	const struct blob_key * y = (const struct blob_key *) b;
+	return x->hash == y->hash && x->len == y->len;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void blob_key_free(gpointer key)
+{
+	g_slice_free(struct blob_key, key);
+}
+
+/***************************************************************************/
+/** Counts the item among those of its blob. Must be called with hist_lock
+held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void blob_ref(const struct history_item *c)
+{
+	struct blob_key probe = { history_item_get_hash(c), c->len, 0 };
+	struct blob_key * k;
+
+	if (!blob_refs)
+		blob_refs = g_hash_table_new_full(blob_key_hash, blob_key_equal, blob_key_free, NULL);
+	if (!(k = (struct blob_key *) g_hash_table_lookup(blob_refs, &probe))) {
+		k = g_slice_new(struct blob_key);
+		*k = probe;
+		g_hash_table_insert(blob_refs, k, k);
+	}
+	k->count++;
+}
+
+/***************************************************************************/
+/** Must be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:	TRUE if the item was the last one of its blob.
+****************************************************************************/
+static gboolean blob_unref(const struct history_item *c)
+{
+	struct blob_key probe = { history_item_get_hash(c), c->len, 0 };
+	struct blob_key * k = blob_refs ? (struct blob_key *) g_hash_table_lookup(blob_refs, &probe) : NULL;
+
+	if (!k)
+		return TRUE;
+	if (--k->count)
+		return FALSE;
+	g_hash_table_remove(blob_refs, k);
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Removes the item from the indexes, and its text from the blob store
+unless another item still refers to it. Must be called with hist_lock
+held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_unindex(struct history_item *c)
+{
+	g_hash_table_remove(id_index, c);
+	text_index_remove(c);
+	if ((c->flags & CLIP_TYPE_BLOB) && blob_unref(c))
+		history_writer_delete_blob(history_blob_path(history_item_get_hash(c), c->len));
+}
+
+/***************************************************************************/
+/** Adds the item to the front of the history and to the indexes. Must be
+called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_insert_front(struct history_item *c)
+{
+	ring_push_front(c);
+	if (!id_index)
+		id_index = g_hash_table_new(id_index_hash, id_index_equal);
+	g_hash_table_insert(id_index, c, c);
+	text_index_add(c);
+	if (c->flags & CLIP_TYPE_BLOB)
+		blob_ref(c);
+}
+
+/***************************************************************************/
+/** Removes the item at the position from the history and the indexes. Must
+be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:	the item, which the caller frees.
+****************************************************************************/
+static struct history_item *history_remove_at(guint n)
+{
+	struct history_item * c = ring_remove_at(n);
+	history_unindex(c);
+	return c;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean history_map_contains(const gchar *p)
+{
+	if (!history_map || !p)
+		return FALSE;
+	const gchar * start = g_mapped_file_get_contents(history_map);
+	return p >= start && p < start + g_mapped_file_get_length(history_map);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct history_item *history_item_new(void)
+{
+	return g_slice_new0(struct history_item);
+}
+
+/***************************************************************************/
+/** Frees the text of the item, unless it belongs to the mapped file.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_item_release_text(struct history_item *c)
+{
+	if (c->shared) {
+		shared_text_unref(c->shared);
+		c->shared = NULL;
+	} else if (c->flags & CLIP_TYPE_ARENA) {
+		/**a queued snapshot may still read the text, and its chunk must
+		 stay mapped until then  */
+		if (history_writer_snapshot_pending())
+			deferred_arena_frees = g_slist_prepend(deferred_arena_frees, c->text);
+		else
+			history_arena_free(c->text);
+		c->flags &= ~CLIP_TYPE_ARENA;
+	} else if (history_map_contains(c->text)) {
+		/**a queued snapshot may still read the deflated texts  */
+		if (--history_map_items == 0 && !history_writer_snapshot_pending()) {
+			g_mapped_file_unref(history_map);
+			history_map = NULL;
+		}
+	} else {
+		g_free(c->text);
+	}
+	c->text = NULL;
+}
+
+/***************************************************************************/
+/** Frees the item and its text.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_item_release(struct history_item *c)
+{
+	history_item_release_text(c);
+	g_slice_free(struct history_item, c);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the beginning of the text, cut on a character boundary.
+****************************************************************************/
+static gchar *make_preview(const gchar *text, guint32 len)
+{
+	guint32 n = MIN(len, HISTORY_BLOB_PREVIEW);
+	while (n > 0 && n < len && (text[n] & 0xC0) == 0x80)
+		n--;
+	return g_strndup(text, n);
+}
+
+/***************************************************************************/
+/** Moves the text of the item to the blob store. Only the items loaded from
+an older history are moved this way, new ones are stored there right away.
+Must be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_item_move_to_blob(struct history_item *c)
+{
+	struct shared_text * text = history_item_get_text(c);
+	gchar * preview = make_preview(text->str, text->len);
+
+	history_writer_put_blob(history_blob_path(history_item_get_hash(c), c->len), text);
+	history_item_release_text(c);
+	c->text = preview;
+	c->flags |= CLIP_TYPE_BLOB;
+	blob_ref(c);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the record of an item whose text is still deflated in the
+mapped file: the text points to the compressed data, right after the headers.
+****************************************************************************/
+static const struct history_record *history_item_record(const struct history_item *c)
+{
+	return (const struct history_record *) (c->text - HISTORY_ITEM_HEADER_SIZE - map_record_size);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	length of the text the item holds: the preview of a blob.
+****************************************************************************/
+guint32 history_item_text_len(const struct history_item *c)
+{
+	if (c->flags & CLIP_TYPE_DEFLATED)
+		return history_item_record(c)->res[1];
+	return (c->flags & CLIP_TYPE_BLOB) ? strlen(c->text) : c->len;
+}
+
+/***************************************************************************/
+/** Inflates the text of an item loaded from a compressed history file.
+Thread-safe, the writer uses it for the items it rewrites.
+\n\b Arguments:
+\n\b Returns:	the text, to be freed with g_free().
+****************************************************************************/
+gchar *history_item_inflate_copy(const struct history_item *c)
+{
+	const struct history_record * r = history_item_record(c);
+	guint32 len = r->res[1];
+	gchar * text = g_malloc(len + 1);
+
+	/**the CRC of a version 3 record was checked on load  */
+	gboolean validated = (map_record_size == sizeof(struct history_record)) && (r->flags & HISTORY_RECORD_VALIDATED);
+
+	if (!history_inflate(text, len, c->text, r->res[0], load_dict) || (!validated && !g_utf8_validate(text, len, NULL))) {
+		g_fprintf(stderr, "Unable to decompress history entry %" G_GINT64_MODIFIER "u\n", history_item_get_id(c));
+		memset(text, '?', len);
+	}
+	text[len] = 0;
+	return text;
+}
+
+/***************************************************************************/
+/** The texts in a compressed history file are inflated the first time they
+are needed, most of them never are.
+\n\b Arguments:
+\n\b Returns:	the text the item holds.
+****************************************************************************/
+const gchar *history_item_text(struct history_item *c)
+{
+	if (c->flags & CLIP_TYPE_DEFLATED) {
+		gchar * text = history_item_inflate_copy(c);
+		history_item_release_text(c);
+		c->text = text;
+		c->flags &= ~CLIP_TYPE_DEFLATED;
+	}
+	return c->text;
+}
+
+/***************************************************************************/
+/** The text the item holds, for a look at it: a deflated text is inflated
+into a copy, and the item keeps it deflated.
+\n\b Arguments:	copy - set to the copy, for the caller to free, or NULL.
+\n\b Returns:
+****************************************************************************/
+const gchar *history_item_peek_text(const struct history_item *c, gchar **copy)
+{
+	if (c->flags & CLIP_TYPE_DEFLATED)
+		return *copy = history_item_inflate_copy(c);
+	*copy = NULL;
+	return c->text;
+}
+
+/***************************************************************************/
+/** The full text of the item, read from the blob store if needed. The item
+shares its text from then on, a text in the mapped file or in the arena is
+copied once.
+\n\b Arguments:
+\n\b Returns:	a reference to the text, to be released with shared_text_unref().
+****************************************************************************/
+struct shared_text *history_item_get_text(struct history_item *c)
+{
+	if (c->flags & CLIP_TYPE_BLOB) {
+		struct shared_text * text = history_blob_read(history_item_get_hash(c), c->len);
+		if (text)
+			text->hash = history_item_get_hash(c);
+		/**better the beginning of the text than nothing  */
+		return text ? text : shared_text_new(history_item_text(c), -1);
+	}
+	if (!c->shared) {
+		gchar * text = (gchar *) history_item_text(c);
+		if (history_map_contains(text) || (c->flags & CLIP_TYPE_ARENA)) {
+			struct shared_text * copy = shared_text_new(text, c->len);
+			history_item_release_text(c);
+			c->shared = copy;
+		} else
+			c->shared = shared_text_take(text, c->len);
+		c->text = c->shared->str;
+		c->shared->hash = history_item_get_hash(c);
+	}
+	return shared_text_ref(c->shared);
+}
+
+/***************************************************************************/
+/** Frees the item. While a snapshot is queued, the writer thread may still
+read the text, so the item is kept until history_snapshot_written().
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_item_free(struct history_item *c)
+{
+	if (!c)
+		return;
+	if (history_writer_snapshot_pending())
+		deferred_frees = g_slist_prepend(deferred_frees, c);
+	else
+		history_item_release(c);
+}
+
+/***************************************************************************/
+/** Called by the writer (in the main loop) once no queued snapshot refers to
+the texts anymore.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_snapshot_written(void)
+{
+	GSList * list, * arena_texts;
+
+	g_mutex_lock(hist_lock);
+	list = deferred_frees;
+	deferred_frees = NULL;
+	arena_texts = deferred_arena_frees;
+	deferred_arena_frees = NULL;
+	if (history_map && 0 == history_map_items) {
+		g_mapped_file_unref(history_map);
+		history_map = NULL;
+	}
+	g_mutex_unlock(hist_lock);
+
+	g_slist_free_full(list, (GDestroyNotify) history_item_release);
+	/**before a pack, which may unmap their chunks  */
+	g_slist_free_full(arena_texts, (GDestroyNotify) history_arena_free);
+
+	if (pack_blocked) {
+		pack_blocked = FALSE;
+		schedule_pack();
+	}
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE if the text of the item belongs in the arena and isn't
+there yet.
+****************************************************************************/
+static gboolean history_item_packable(const struct history_item *c)
+{
+	if (!c->text || (c->flags & CLIP_TYPE_IN_MEMORY) || history_map_contains(c->text))
+		return FALSE;
+	/**a text the clipboards still hold stays shared  */
+	if (c->shared && g_atomic_int_get(&c->shared->ref) > 1)
+		return FALSE;
+	return history_item_text_len(c) <= HISTORY_ARENA_MAX_TEXT;
+}
+
+/***************************************************************************/
+/** Moves the text of the item into the arena. Must be called with hist_lock
+held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void history_item_pack(struct history_item *c)
+{
+	guint32 len = history_item_text_len(c);
+	gchar * text = history_arena_alloc(c->text, len);
+	gboolean in_arena = (text != NULL);
+
+	if (!text) {
+		if (!(c->flags & CLIP_TYPE_ARENA))
+			return;
+		/**being compacted, its chunk is about to be released  */
+		text = g_strndup(c->text, len);
+	}
+	history_item_release_text(c);
+	c->text = text;
+	if (in_arena)
+		c->flags |= CLIP_TYPE_ARENA;
+}
+
+/***************************************************************************/
+/** Packs the texts of the history into the arena, in the order of the
+history. Compacts the arena when the evicted items have left too much of it
+unused. Runs from an idle, once the clipboards have let go of the new text.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean history_pack_idle(gpointer data)
+{
+	GPtrArray * old = NULL;
+
+	pack_source = 0;
+	/**the writer may still read the texts  */
+	if (history_writer_snapshot_pending()) {
+		pack_blocked = TRUE;
+		return FALSE;
+	}
 
-#define HISTORY_EACH(element, item, code) \
-{\
-    GList * element;\
-    for (element = history_list; element != NULL; element = element->next)\
-	{\
-        struct history_item * item = (struct history_item *) element->data;\
-        {\
-			code\
-		}\
-    }\
+	g_mutex_lock(hist_lock);
+	if (history_arena_wasteful())
+		old = history_arena_detach();
+	HISTORY_EACH(n, c, {
+		if ((old && (c->flags & CLIP_TYPE_ARENA)) || history_item_packable(c))
+			history_item_pack(c);
+	});
+	if (old)
+		history_arena_release(old);
+	g_mutex_unlock(hist_lock);
+
+	return FALSE;
 }
 
-#define PINNED(item) ((item)->flags & CLIP_TYPE_PERSISTENT)
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void schedule_pack(void)
+{
+	if (!pack_source)
+		pack_source = g_idle_add(history_pack_idle, NULL);
+}
 
 /***************************************************************************/
-/** Pass in the text via the struct. We assume len is correct, and BYTE based,
-not character.
+/** Queues a record for a change that has already been applied to
+the history. Must be called with hist_lock held.
 \n\b Arguments:
-\n\b Returns:	length of resulting string.
+\n\b Returns:
 ****************************************************************************/
-glong validate_utf8_text(gchar *text, glong len)
+static void journal_append(guint16 op, struct history_item *c)
 {
-	const gchar *valid;
-	if(NULL == text || len <= 0)
-		return 0;
-	text[len]=0;
-	if(FALSE == g_utf8_validate(text,-1,&valid)) {
-		len=valid-text;
-		text[len]=0;
-		g_fprintf(stderr,"Truncating invalid utf8 text entry: '%s'\n",text);
+	guint64 dead;
+
+	if (!get_pref_int32("save_history")) {
+		journal_stale = TRUE;
+		return;
 	}
-	return len;
+
+	if (history_writer_take_failure())
+		journal_stale = TRUE;
+
+	if (journal_stale) {
+		/**the snapshot already includes this change  */
+		queue_snapshot_locked();
+		return;
+	}
+
+	history_writer_append(op, c);
+
+	journal_size += history_record_size(op, c);
+	if (HISTORY_OP_ADD == op)
+		journal_live += history_record_size(HISTORY_OP_ADD, c);
+	else if (HISTORY_OP_DELETE == op)
+		journal_live -= history_record_size(HISTORY_OP_ADD, c);
+
+	/**compaction is a snapshot like any other, written by the writer thread  */
+	dead = journal_size - HISTORY_MAGIC_SIZE > journal_live ? journal_size - HISTORY_MAGIC_SIZE - journal_live : 0;
+	if (dead > HISTORY_COMPACT_MIN_DEAD && dead > journal_live)
+		queue_snapshot_locked();
 }
 
 /***************************************************************************/
-/** Reads history from ~/.local/share/<application>/history .
-Current scheme is to have the total zize of element followed by the type, then the data
+/** Reads the version 1 history: the total size of the element followed by
+the item header, then the data.
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-void read_history ()
+static GList *read_history_v1(FILE *history_file)
 {
+	GList * list = NULL;
 	size_t x;
+	guint32 size=1, end;
 
-	gchar * history_path = g_build_filename(g_get_user_data_dir(),HISTORY_FILE0,NULL); 
-	gchar * magic = g_malloc0(2+HISTORY_MAGIC_SIZE);
+	while (size)
+	{
+		struct history_item *c;
+		if (fread(&size, 4, 1, history_file) != 1)
+			size = 0;
+		if (size < HISTORY_V1_ITEM_SIZE + 4)
+			break;
+		c = history_item_new();
+		end = size-(HISTORY_V1_ITEM_SIZE + 4);
 
-	FILE* history_file = fopen(history_path, "rb");
-	g_free(history_path);
+		if (fread(c, HISTORY_ITEM_HEADER_SIZE, 1, history_file) !=1 ||
+		    fseek(history_file, HISTORY_V1_ITEM_SIZE - HISTORY_ITEM_HEADER_SIZE, SEEK_CUR) != 0)
+			g_fprintf(stderr,"history_read: Invalid type!");
 
-	if (history_file)
-	{
-		g_mutex_lock(hist_lock);
+		if (c->len != end)
+			g_fprintf(stderr,"len check: invalid: ex %d got %d\n",end,c->len);
+		history_item_set_hash(c, 0); /**not set by version 1  */
+
+		/* Malloc according to the size of the item */
+		c->text = g_malloc0(end + 1);
 
-		guint32 size=1, end;
-		if (fread(magic,HISTORY_MAGIC_SIZE , 1, history_file) != 1)
+		/* Read item and add ending character */
+		if ((x =fread(c->text,end,1,history_file)) != 1)
 		{
-			g_fprintf(stderr,"No magic! Assume no history.\n");
-			goto done;
+			c->text[end] = 0;
+			g_fprintf(stderr,"history_read: Invalid text, code %ld!\n'%s'\n",(unsigned long)x,c->text);
+			history_item_free(c);
 		}
+		else
+		{
+			c->text[end] = 0;
+			c->len=validate_utf8_text(c->text,c->len);
+			if(dbg)
+				g_fprintf(stderr,"len %d type %d '%s'\n",c->len,c->type,c->text);
+			if (0 != c->len) { /* Prepend item and read next size */
+				history_item_set_id(c, next_item_id++);
+				list = g_list_prepend(list, c);
+			} else
+				history_item_free(c);
+		}
+	}
 
-		if(dbg)
-			g_printf("History Magic OK. Reading\n");
+	return g_list_reverse(list);
+}
+
+/***************************************************************************/
+/** Replays the version 2 or 3 journal from the mapped file into a list, most
+recent first. The text of the items is left in the mapping. A record that
+fails its CRC ends the journal: its size can't be trusted, nor can whatever
+follows it. A record that is damaged otherwise is skipped.
+\n\b Arguments:	size - set to the size of the records read, counted as
+journal_size counts them; used - set to the bytes of the file the journal
+takes, up to the first record that fails its CRC.
+\n\b Returns:	TRUE if all of the records were read.
+****************************************************************************/
+static gboolean read_history_journal(const gchar *data, gsize length, gint version, GList **plist,
+	guint64 *size, gsize *used)
+{
+	/**the replay moves items around a lot, a list does that in O(1)  */
+	GList * list = NULL;
+	/**id -> GList element, for the replay only  */
+	GHashTable * index = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	const gchar * p = data + HISTORY_MAGIC_SIZE;
+	const gchar * end = data + length;
+	gboolean checksummed = (version >= 3);
+	guint32 header_size;
+	guint damaged = 0;
+
+	map_record_size = checksummed ? sizeof(struct history_record) : HISTORY_V2_RECORD_SIZE;
+	header_size = map_record_size + HISTORY_ITEM_HEADER_SIZE;
+	*size = HISTORY_MAGIC_SIZE;
+
+	for (; p < end; p += ((const struct history_record *) p)->size)
+	{
+		struct history_record r;
+		struct history_item header;
+		const gchar * text = p + header_size;
+		guint32 space;
+		guint64 id;
+		GList * element;
+		gboolean validated;
+
+		if ((gsize) (end - p) < header_size)
+			break;
+		memset(&r, 0, sizeof(r));
+		memcpy(&r, p, map_record_size);
+		memcpy(&header, p + map_record_size, HISTORY_ITEM_HEADER_SIZE);
+		if (r.size < header_size || r.size % HISTORY_RECORD_ALIGN || r.size > (gsize) (end - p)) {
+			g_fprintf(stderr, "history_read: invalid record size %u\n", r.size);
+			break;
+		}
+		if (checksummed && history_record_crc(p) != r.crc) {
+			g_fprintf(stderr, "history_read: damaged record at %lu, the journal ends there\n", (unsigned long) (p - data));
+			end = p;
+			break;
+		}
+		/**a compressed text at its full length, as history_record_size() counts it  */
+		if (HISTORY_OP_ADD == r.op && (r.flags & HISTORY_RECORD_DEFLATE))
+			*size += (HISTORY_RECORD_HEADER_SIZE + r.res[1] + 1 + HISTORY_RECORD_ALIGN - 1) & ~(HISTORY_RECORD_ALIGN - 1);
+		else
+			*size += r.size;
+		space = r.size - header_size;
+		/**the CRC vouches for the text the writer has checked  */
+		validated = checksummed && (r.flags & HISTORY_RECORD_VALIDATED);
 
-	    while (size)
+		id = history_item_get_id(&header);
+		if (id >= next_item_id)
+			next_item_id = id + 1;
+		element = (GList *) g_hash_table_lookup(index, &id);
+
+		if (HISTORY_OP_DICTIONARY == r.op)
+		{
+			/**a snapshot starts with it, the file has at most one  */
+			if (!load_dict && header.len < space)
+				load_dict = history_dict_new(text, header.len);
+		}
+		else if (HISTORY_OP_ADD == r.op && (r.flags & HISTORY_RECORD_DEFLATE))
 		{
 			struct history_item *c;
-			if (fread(&size, 4, 1, history_file) != 1)
-				size = 0;
-			if (0 == size)
+
+			if (r.res[0] >= space || r.res[1] > header.len ||
+					(!(header.flags & CLIP_TYPE_BLOB) && r.res[1] != header.len)) {
+				g_fprintf(stderr, "history_read: invalid compressed text length %u, skipped\n", r.res[0]);
+				damaged++;
+				continue;
+			}
+			if (!history_compress_available()) {
+				g_fprintf(stderr, "history_read: the history is compressed, but zlib support is not built in\n");
 				break;
-			/* Malloc according to the size of the item */
-			c = (struct history_item *)g_malloc0(size + 1);
-			end = size-(sizeof(struct history_item) + 4);
+			}
+
+			/**inflated (and validated, unless the CRC vouches for it) when it is needed  */
+			c = history_item_new();
+			memcpy(c, &header, HISTORY_ITEM_HEADER_SIZE);
+			c->text = (gchar *) text;
+			c->flags |= CLIP_TYPE_DEFLATED;
+			history_map_items++;
+
+			if (0 == c->len || element)
+				history_item_free(c);
+			else {
+				list = g_list_prepend(list, c);
+				g_hash_table_insert(index, g_memdup(&id, sizeof(id)), list);
+			}
+		}
+		else if (HISTORY_OP_ADD == r.op)
+		{
+			guint32 text_len = header.len;
+			const gchar * valid;
+			struct history_item *c;
 
-			if (fread(c, sizeof(struct history_item), 1, history_file) !=1)
-				g_fprintf(stderr,"history_read: Invalid type!");
+			if (header.flags & CLIP_TYPE_BLOB) {
+				/**the preview, NUL-terminated  */
+				const gchar * nul = memchr(text, 0, space);
+				text_len = nul ? (guint32) (nul - text) : space;
+			}
+			if (text_len >= space || text[text_len] != 0) {
+				g_fprintf(stderr, "history_read: invalid text length %u, skipped\n", header.len);
+				damaged++;
+				continue;
+			}
 
-			if (c->len != end)
-				g_fprintf(stderr,"len check: invalid: ex %d got %d\n",end,c->len);
+			c = history_item_new();
+			memcpy(c, &header, HISTORY_ITEM_HEADER_SIZE);
+			if (validated || g_utf8_validate(text, text_len, &valid)) {
+				c->text = (gchar *) text;
+				history_map_items++;
+			} else if (c->flags & CLIP_TYPE_BLOB) {
+				/**the blob itself is fine  */
+				c->text = g_strndup(text, valid - text);
+			} else {
+				c->len = valid - text;
+				c->text = g_strndup(text, c->len);
+				history_item_set_hash(c, 0);
+				g_fprintf(stderr,"Truncating invalid utf8 text entry: '%s'\n",c->text);
+			}
 
-			/* Read item and add ending character */
-			if ((x =fread(&c->text,end,1,history_file)) != 1)
-			{
-				c->text[end] = 0;
-				g_fprintf(stderr,"history_read: Invalid text, code %ld!\n'%s'\n",(unsigned long)x,c->text);
+			if (0 == c->len || element)
+				history_item_free(c);
+			else {
+				list = g_list_prepend(list, c);
+				g_hash_table_insert(index, g_memdup(&id, sizeof(id)), list);
 			}
-			else
+		}
+		else if (element)
+		{
+			switch (r.op)
 			{
-				c->text[end] = 0;
-				c->len=validate_utf8_text(c->text,c->len);
-				if(dbg)
-					g_fprintf(stderr,"len %d type %d '%s'\n",c->len,c->type,c->text);
-				if (0 != c->len) /* Prepend item and read next size */
-			      	history_list = g_list_prepend(history_list, c);
-				else
-					g_free(c);
+				case HISTORY_OP_DELETE:
+					history_item_free(element->data);
+					list = g_list_delete_link(list, element);
+					g_hash_table_remove(index, &id);
+					break;
+				case HISTORY_OP_FLAGS:
+				{
+					struct history_item * c = (struct history_item *) element->data;
+					c->flags = header.flags | (c->flags & CLIP_TYPE_IN_MEMORY);
+					break;
+				}
+				case HISTORY_OP_MOVE_TO_FRONT:
+					list = g_list_remove_link(list, element);
+					list = g_list_concat(element, list);
+					break;
+				default:
+					g_fprintf(stderr, "history_read: unknown record %u\n", (unsigned) r.op);
+					break;
 			}
-	    }
-
-done:
-		g_free(magic);
-		fclose(history_file);
-		history_list = g_list_reverse(history_list);
-		g_mutex_unlock(hist_lock);
+		}
 	}
 
-	if(dbg)
-		g_printf("History read done\n");
+	g_hash_table_destroy(index);
+	*plist = list;
+	*used = end - data;
+	return p == end && 0 == damaged;
 }
 
-/* Saves history to ~/.local/share/<application>/history */
-
 /***************************************************************************/
-/** write total len, then write type, then write data.
+/** Reads history from ~/.local/share/<application>/history .
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-void save_history(void)
+void read_history ()
 {
-	gchar* history_path = NULL;
-	FILE* history_file = NULL;
+	gchar * history_path = g_build_filename(g_get_user_data_dir(),HISTORY_FILE0,NULL);
+	GMappedFile * map = g_mapped_file_new(history_path, FALSE, NULL);
 
-	check_dirs();
+	if (map)
+	{
+		const gchar * data = g_mapped_file_get_contents(map);
+		gsize length = g_mapped_file_get_length(map);
+		GList * list = NULL;
+		GList * element;
+		guint32 blob_threshold = get_pref_int32("blob_threshold") * 1024;
 
-	g_mutex_lock(hist_lock);
+		g_mutex_lock(hist_lock);
 
-	history_path = g_build_filename(g_get_user_data_dir(), HISTORY_FILE0, NULL);
-	if (!history_path)
-	{
-		g_fprintf(stderr, "history_path is NULL\n");
-		goto end;
-	}
+		if (length < HISTORY_MAGIC_SIZE)
+		{
+			g_fprintf(stderr,"No magic! Assume no history.\n");
+			goto done;
+		}
 
-	history_file = fopen(history_path, "wb");
-	if (!history_file)
-	{
-		g_fprintf(stderr, "Unable to open history file '%s'\n", history_path);
-		goto end;
+		if(dbg)
+			g_printf("History Magic OK. Reading\n");
+
+		if (strncmp(data, history_magics[HISTORY_VERSION-1], HISTORY_MAGIC_SIZE) == 0 ||
+			strncmp(data, history_magics[1], HISTORY_MAGIC_SIZE) == 0)
+		{
+			gint version = (data[0] == '3') ? 3 : 2;
+			guint64 size;
+			gsize used;
+			history_map = g_mapped_file_ref(map);
+			/**appending after a torn record would make the rest of the journal unreadable;
+			   a version 2 file is converted by the first write  */
+			journal_stale = !read_history_journal(data, length, version, &list, &size, &used) || version != HISTORY_VERSION;
+			/**cut at a record that failed its CRC, the records before it are appended to  */
+			if (!journal_stale && used < length && truncate(history_path, used) != 0) {
+				g_fprintf(stderr, "Unable to cut the history file at %lu\n", (unsigned long) used);
+				journal_stale = TRUE;
+			}
+			if (!journal_stale)
+				journal_size = size;
+			if (0 == history_map_items) {
+				g_mapped_file_unref(history_map);
+				history_map = NULL;
+			}
+			/**the records appended to the file are compressed the same way  */
+			if (!journal_stale)
+				history_writer_set_dict(load_dict);
+		}
+		else
+		{
+			/**converted to the journal on the first write  */
+			FILE* history_file = fopen(history_path, "rb");
+			if (history_file) {
+				if (fseek(history_file, HISTORY_MAGIC_SIZE, SEEK_SET) == 0)
+					list = read_history_v1(history_file);
+				fclose(history_file);
+			}
+			journal_stale = TRUE;
+		}
+
+		/**the hashes are stored in the file, only the items of older files are hashed here  */
+		journal_live = 0;
+		for (element = g_list_last(list); element != NULL; element = element->prev) {
+			struct history_item * c = (struct history_item *) element->data;
+			history_insert_front(c);
+			if (!(c->flags & CLIP_TYPE_BLOB) && c->len > blob_threshold) {
+				history_item_move_to_blob(c);
+				journal_stale = TRUE;
+			}
+			journal_live += history_record_size(HISTORY_OP_ADD, c);
+		}
+		g_list_free(list);
+		schedule_pack();
+		history_changed(HISTORY_CHANGE_ALL, NULL);
+
+done:
+		g_mutex_unlock(hist_lock);
+		g_mapped_file_unref(map);
 	}
+	g_free(history_path);
 
-	GList* element;
-	gchar * magic = g_malloc0(2+HISTORY_MAGIC_SIZE);
-	if (NULL == magic)
-		goto end;
+	if(dbg)
+		g_printf("History read done\n");
+}
 
-	memcpy(magic, history_magics[HISTORY_VERSION-1], strlen(history_magics[HISTORY_VERSION-1]));
-	fwrite(magic, HISTORY_MAGIC_SIZE, 1, history_file);
+/* Saves history to ~/.local/share/<application>/history */
 
-	/* Write each element to a binary file */
-	for (element = history_list; element != NULL; element = element->next)
-	{
-		struct history_item *c;
-		gint32 len;
+/***************************************************************************/
+/** Queues the whole history as a fresh journal that replaces the current one.
+Must be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void write_snapshot_locked(void)
+{
+	journal_size = history_writer_snapshot();
+	journal_live = journal_size - HISTORY_MAGIC_SIZE;
+	journal_stale = FALSE;
+	snapshot_due = FALSE;
+}
 
-		c = (struct history_item *) element->data;
-		if (c->len >0)
-		{
-			len = c->len + sizeof(struct history_item) + 4;
-			fwrite(&len, 4, 1, history_file);
-			fwrite(c, sizeof(struct history_item), 1, history_file);
-			fwrite(c->text, c->len, 1, history_file);
-		}
+/***************************************************************************/
+/** Queues a snapshot, or under on exit durability leaves it to the exit like
+the other writes: the history isn't copied for it before then, and the
+changes made meanwhile aren't journaled. Must be called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void queue_snapshot_locked(void)
+{
+	if (HISTORY_DURABILITY_ON_EXIT == get_pref_int32("history_durability")) {
+		snapshot_due = TRUE;
+		journal_stale = TRUE;
+		return;
 	}
+	write_snapshot_locked();
+}
 
-	/* Write 0 to indicate end of file */
-	gint end = 0;
-	fwrite(&end, 4, 1, history_file);
+/***************************************************************************/
+/** Queues the snapshot deferred to the exit, if any. Called before the
+writer is shut down.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_save_on_exit(void)
+{
+	g_mutex_lock(hist_lock);
+	if (snapshot_due && get_pref_int32("save_history"))
+		write_snapshot_locked();
+	g_mutex_unlock(hist_lock);
+}
 
-end:
-	if (history_file)
-		fclose(history_file);
-	if (history_path)
-		g_free(history_path);
+/***************************************************************************/
+/** Rewrites the history file from scratch, dropping the dead journal records.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void save_history(void)
+{
+	g_mutex_lock(hist_lock);
+	write_snapshot_locked();
 	g_mutex_unlock(hist_lock);
 }
 
@@ -216,131 +1345,242 @@ end:
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-static struct history_item *new_clip_item(gint type, guint32 len, void *data)
+static struct history_item *new_clip_item(gint type, struct shared_text *text)
 {
 	struct history_item *c;
-	if(NULL == (c=g_malloc0(sizeof(struct history_item)+len))){
+	if(NULL == (c=history_item_new())){
 		g_fprintf(stderr,"Hit NULL for malloc of history_item!\n");
 		return NULL;
 	}
-		
+
 	c->type = type;
-	memcpy(c->text,data,len);
-	c->len=len;
+	c->shared = shared_text_ref(text);
+	c->text = text->str;
+	c->len = text->len;
+	history_item_set_id(c, next_item_id++);
 	return c;
 }
+
 /***************************************************************************/
-/**  checks to see if text is already in history. Also is a find text
-\n\b Arguments: if mode is 1, delete it too.
-\n\b Returns: -1 if not found, or nth element.
+/** Sets up an item to look the text up in the index with. The preview of a
+text in the blob store is compared as that of a blob item.
+\n\b Arguments:
+\n\b Returns:
 ****************************************************************************/
-static gint find_duplicate_text_item(const gchar * text)
+static void text_probe(struct history_item *probe, const struct shared_text *text)
 {
-	GList * element;
-	gint i;
-	if (!text)
-		return -1;
+	probe->len = shared_text_length(text);
+	probe->text = text->str;
+	if (text->blob_len)
+		probe->flags = CLIP_TYPE_BLOB;
+	history_item_set_hash(probe, shared_text_hash(text));
+}
 
-	for (i=0, element = history_list; element != NULL; element = element->next, ++i)
-	{
-		struct history_item * hi = (struct history_item *) element->data;
-		if (CLIP_TYPE_TEXT == hi->type)
-		{
-			if (g_strcmp0((gchar *) hi->text, text) == 0)
-			{
-				return i;
-			}
-		}
-	}
-	return -1;
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the item with the text, or NULL.
+****************************************************************************/
+struct history_item *history_lookup_text(const struct shared_text *text)
+{
+	struct history_item probe = {0};
+	struct history_item * c;
+
+	if (!text || !text_index)
+		return NULL;
+	text_probe(&probe, text);
+
+	g_mutex_lock(hist_lock);
+	c = (struct history_item *) g_hash_table_lookup(text_index, &probe);
+	g_mutex_unlock(hist_lock);
+	return c;
 }
+
 /***************************************************************************/
-/**  Adds item to the end of history .
+/**  Adds item to the end of history. A text received into the blob store
+is moved into place, whether it makes a new item or not.
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
-void history_add_text_item(gchar * text, gint flags)
+void history_add_text_item(struct shared_text *text, gint flags)
 {
 	struct history_item * hi = NULL;
+	struct history_item probe = {0};
 
 	if (!text)
 		return;
 
+	text_probe(&probe, text);
+	if (text->spill) {
+		/**the history takes the file, the text no longer removes it  */
+		history_writer_move_blob(text->spill, history_blob_path(shared_text_hash(text), text->blob_len));
+		text->spill = NULL;
+	}
+
 	g_mutex_lock(hist_lock);
 
-	gint dup_index = find_duplicate_text_item(text);
+	dedup_stats.lookups++;
+	hi = text_index ? (struct history_item *) g_hash_table_lookup(text_index, &probe) : NULL;
 
-	if (dup_index >= 0)
+	if (hi && hi == history_nth(0))
+	{
+		/**already the most recent one, nothing to record  */
+		g_mutex_unlock(hist_lock);
+		return;
+	}
+	else if (hi)
 	{
-		GList * element = g_list_nth(history_list, dup_index);
-		history_list = g_list_remove_link(history_list, element);
-		hi = element->data;
-		g_list_free(element);
+		/**the indexes refer to the item, moving it doesn't change them  */
+		dedup_stats.found++;
+		ring_remove_at(ring_position(hi));
+		ring_push_front(hi);
+		journal_append(HISTORY_OP_MOVE_TO_FRONT, hi);
+		history_changed(HISTORY_CHANGE_MOVE_TO_FRONT, hi);
 	}
 	else
 	{
-		hi = new_clip_item(CLIP_TYPE_TEXT, strlen(text), text);
-		if (!hi)
+		guint64 hash = history_item_get_hash(&probe);
+
+		if (text->blob_len) {
+			/**already in the blob store, the text is the preview  */
+			hi = new_clip_item(CLIP_TYPE_TEXT, text);
+			if (hi) {
+				hi->len = text->blob_len;
+				flags |= CLIP_TYPE_BLOB;
+			}
+		} else if (probe.len > (guint32) get_pref_int32("blob_threshold") * 1024) {
+			struct shared_text * preview = shared_text_take(make_preview(text->str, probe.len), -1);
+			hi = new_clip_item(CLIP_TYPE_TEXT, preview);
+			shared_text_unref(preview);
+			if (hi) {
+				hi->len = probe.len;
+				flags |= CLIP_TYPE_BLOB;
+				history_writer_put_blob(history_blob_path(hash, probe.len), shared_text_ref(text));
+			}
+		} else
+			hi = new_clip_item(CLIP_TYPE_TEXT, text);
+		if (!hi) {
+			g_mutex_unlock(hist_lock);
 			return;
+		}
 		hi->flags = flags;
+		history_item_set_hash(hi, hash);
+		history_insert_front(hi);
+		journal_append(HISTORY_OP_ADD, hi);
+		history_changed(HISTORY_CHANGE_ADD, hi);
 	}
 
-	history_list = g_list_prepend(history_list, hi);
-
 	g_mutex_unlock(hist_lock);
 
 	truncate_history();
+	schedule_pack();
+}
+
+/***************************************************************************/
+/**  Removes the item from the history and frees it.
+\n\b Arguments:	id of the item, nothing is done if it is already gone.
+\n\b Returns:
+****************************************************************************/
+void history_delete_item(guint64 id)
+{
+	g_mutex_lock(hist_lock);
+	struct history_item * c = history_lookup(id);
+	if (c) {
+		history_remove_at(ring_position(c));
+		journal_append(HISTORY_OP_DELETE, c);
+		history_changed(HISTORY_CHANGE_DELETE, c);
+		history_item_free(c);
+		schedule_pack();
+	}
+	g_mutex_unlock(hist_lock);
+}
+
+/***************************************************************************/
+/**  Changes the flags of the item (pinned or not).
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_set_item_flags(struct history_item *c, gint16 flags)
+{
+	g_mutex_lock(hist_lock);
+	if (c && c->flags != flags) {
+		c->flags = flags;
+		journal_append(HISTORY_OP_FLAGS, c);
+		history_changed(HISTORY_CHANGE_FLAGS, c);
+	}
+	g_mutex_unlock(hist_lock);
 }
 
 /***************************************************************************/
 /**  Truncates history to history_limit items, while preserving persistent
-    data, if specified by the user. FIXME: This may not shorten the history 
-    
+    data, if specified by the user. FIXME: This may not shorten the history
+
 \n\b Arguments:
 \n\b Returns:
 ****************************************************************************/
 void truncate_history()
 {
     g_mutex_lock(hist_lock);
-    guint ll = g_list_length(history_list);
     guint lim = get_pref_int32("history_limit");
-    if (ll > lim) { /* Shorten history if necessary */
-        GList * last = g_list_last(history_list);
-        while (last->prev && ll > lim) {
-            struct history_item * c = (struct history_item *) last->data;
-            last=last->prev;
+    if (ring_len > lim) { /* Shorten history if necessary */
+        guint excess = ring_len - lim;
+        guint n, kept;
+        GSList * dropped = NULL, * i;
+
+        /**the oldest unpinned items go, never the most recent one  */
+        for (n = ring_len - 1; n > 0 && excess; n--) {
+            struct history_item * c = RING_SLOT(n);
             if (!PINNED(c)) {
-                history_list=g_list_remove(history_list,c);
-                --ll;
+                history_unindex(c);
+                dropped = g_slist_prepend(dropped, c);
+                RING_SLOT(n) = NULL;
+                --excess;
             }
         }
+        for (n = kept = 0; n < ring_len; n++)
+            if (RING_SLOT(n))
+                ring_set(kept++, RING_SLOT(n));
+        ring_len = kept;
+
+        /**logged once the history is consistent again, the append may write a snapshot  */
+        for (i = dropped; i != NULL; i = i->next) {
+            journal_append(HISTORY_OP_DELETE, i->data);
+            history_changed(HISTORY_CHANGE_DELETE, i->data);
+            history_item_free(i->data);
+        }
+        g_slist_free(dropped);
+        schedule_pack();
     }
     g_mutex_unlock(hist_lock);
-
-    if (get_pref_int32("save_history"))
-        save_history();
 }
 
 /***************************************************************************/
 
 void clear_history(void)
 {
+	guint kept = 0;
+
 	g_mutex_lock(hist_lock);
 
-again:
-	HISTORY_EACH(element, item, {
-		if (!PINNED(item)) {
-			history_list = g_list_remove_link(history_list, element);
-			g_free(item);
-			g_list_free(element);
-			goto again;
+	HISTORY_EACH(n, item, {
+		if (PINNED(item))
+			ring_set(kept++, item);
+		else {
+			history_unindex(item);
+			history_item_free(item);
 		}
 	});
+	ring_len = kept;
+	schedule_pack();
+	history_changed(HISTORY_CHANGE_ALL, NULL);
 
-	g_mutex_unlock(hist_lock);
-
+	/**a snapshot of the pinned items is smaller than a tombstone for each of the others  */
 	if (get_pref_int32("save_history"))
-		save_history();
+		queue_snapshot_locked();
+	else
+		journal_stale = TRUE;
+
+	g_mutex_unlock(hist_lock);
 }
 /***************************************************************************/
 /** .
@@ -355,14 +1595,12 @@ int save_history_as_text(gchar *path)
 	{
 		int first = 1;
 		int pinned = 0;
-		GList* element;
 		g_mutex_lock(hist_lock);
 
 		for (pinned = 0; pinned < 2; pinned++)
 		{
-			for (element = history_list; element != NULL; element = element->next)
-			{
-				struct history_item * c = (struct history_item *) element->data;
+			HISTORY_EACH(n, c, {
+				struct shared_text * text;
 				if (!c->text)
 					continue;
 				if (!!pinned != !!PINNED(c))
@@ -376,9 +1614,16 @@ int save_history_as_text(gchar *path)
 						"----------------------------------------"
 						"\n\n");
 				}
-				fprintf(fp,"%s",c->text);
+				if (c->flags & CLIP_TYPE_BLOB) {
+					text = history_item_get_text(c);
+					fprintf(fp,"%s",text->str);
+					shared_text_unref(text);
+				} else {
+					/**read in place, in the order of the arena  */
+					fprintf(fp,"%s",history_item_text(c));
+				}
 				first = 0;
-			}
+			});
 		}
 		g_mutex_unlock(hist_lock);
 		fclose(fp);
@@ -386,6 +1631,26 @@ int save_history_as_text(gchar *path)
 
 	return 0;
 }
+/***************************************************************************/
+/** Removes the files of the blob store that no item refers to.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_collect_blobs(void)
+{
+	GHashTable * live = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	g_mutex_lock(hist_lock);
+	HISTORY_EACH(n, c, {
+		if (c->flags & CLIP_TYPE_BLOB)
+			g_hash_table_insert(live, history_blob_path(history_item_get_hash(c), c->len), GINT_TO_POINTER(1));
+	});
+	g_mutex_unlock(hist_lock);
+
+	history_blob_collect(live);
+	g_hash_table_destroy(live);
+}
+
 /***************************************************************************/
 /** Dialog to save the history file.
 \n\b Arguments:
@@ -414,3 +1679,20 @@ void history_save_as(void)
 	gtk_widget_destroy (dialog);
 }
 
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_print_stats(GString *s)
+{
+	g_mutex_lock(hist_lock);
+	g_string_append_printf(s,
+		_("History items: %u\n"
+		  "Duplicate checks: %u, duplicates found: %u\n"
+		  "Text comparisons: %u, hash collisions: %u\n"),
+		ring_len,
+		dedup_stats.lookups, dedup_stats.found,
+		dedup_stats.compares, dedup_stats.collisions);
+	g_mutex_unlock(hist_lock);
+}
@@ -28,17 +28,82 @@ G_BEGIN_DECLS
 #define CLIP_TYPE_TEXT       0x1
 #define CLIP_TYPE_IMG        0x2
 #define CLIP_TYPE_PERSISTENT 0x4
+#define CLIP_TYPE_BLOB       0x8 /**the text is in the blob store, the item keeps a preview  */
+#define CLIP_TYPE_DEFLATED   0x10 /**in memory only: the text is still compressed in the history file  */
+#define CLIP_TYPE_ARENA      0x20 /**in memory only: the text is in the arena  */
+#define CLIP_TYPE_IN_MEMORY  (CLIP_TYPE_DEFLATED | CLIP_TYPE_ARENA) /**not written to the history file  */
 
 struct history_item {
 	guint32 len; /**length of data item, MUST be first in structure  */
 	gint16 type; /**currently, text or image  */
 	gint16 flags;	/**persistence, or??  */
 	guint32 res[4];
-	gchar text[8]; /**reserve 64 bits (8 bytes) for pointer to data.  */
+	gchar *text; /**the data: a heap block or a record in the mapped history file  */
+	struct shared_text *shared; /**in memory only: the owner of the text, if it is shared  */
+	guint32 slot; /**in memory only: the position in the history, plus the ring's base  */
 }__attribute__((__packed__));
 
+/**res[0], res[1]: id of the item, unique within the history file  */
+static inline guint64 history_item_get_id(const struct history_item *c)
+{
+	return ((guint64) c->res[1] << 32) | c->res[0];
+}
 
-extern GList* history_list;
+static inline void history_item_set_id(struct history_item *c, guint64 id)
+{
+	c->res[0] = (guint32) id;
+	c->res[1] = (guint32) (id >> 32);
+}
+
+/**res[2], res[3]: 64-bit hash of the text, 0 if not computed yet  */
+static inline guint64 history_item_get_hash(const struct history_item *c)
+{
+	return ((guint64) c->res[3] << 32) | c->res[2];
+}
+
+static inline void history_item_set_hash(struct history_item *c, guint64 hash)
+{
+	c->res[2] = (guint32) hash;
+	c->res[3] = (guint32) (hash >> 32);
+}
+
+guint32 history_item_text_len(const struct history_item *c);
+
+const gchar *history_item_text(struct history_item *c);
+
+const gchar *history_item_peek_text(const struct history_item *c, gchar **copy);
+
+gchar *history_item_inflate_copy(const struct history_item *c);
+
+struct shared_text *history_item_get_text(struct history_item *c);
+
+/**history_text_hash() of a text that arrives in pieces, of a length known
+ in advance  */
+struct text_hash_state {
+	guint64 h;
+	gsize len;      /**announced  */
+	gsize seen;
+	guint tail_len;
+	guchar tail[8]; /**the bytes short of a word  */
+};
+
+void history_text_hash_begin(struct text_hash_state *s, gsize len);
+
+void history_text_hash_update(struct text_hash_state *s, const gchar *data, gsize n);
+
+guint64 history_text_hash_end(struct text_hash_state *s);
+
+guint64 history_text_hash(const gchar *text, gsize len);
+
+guint history_length(void);
+
+struct history_item *history_nth(guint n);
+
+struct history_item *history_lookup(guint64 id);
+
+struct history_item *history_item_new(void);
+
+void history_item_free(struct history_item *c);
 
 glong validate_utf8_text(gchar *text, glong len);
 
@@ -46,13 +111,41 @@ void read_history();
 
 void save_history(void);
 
-void history_add_text_item(gchar * text, gint flags);
+void history_save_on_exit(void);
+
+void history_snapshot_written(void);
+
+/**the changes an observer of the history is told of  */
+enum history_change {
+	HISTORY_CHANGE_ALL,            /**the whole history was replaced or cleared  */
+	HISTORY_CHANGE_ADD,
+	HISTORY_CHANGE_DELETE,         /**called before the item is freed  */
+	HISTORY_CHANGE_FLAGS,
+	HISTORY_CHANGE_MOVE_TO_FRONT,
+};
+
+/**called with hist_lock held, it must not change the history  */
+typedef void (*history_change_func)(enum history_change change, const struct history_item *c);
+
+void history_set_change_func(history_change_func func);
+
+struct history_item *history_lookup_text(const struct shared_text *text);
+
+void history_add_text_item(struct shared_text *text, gint flags);
+
+void history_delete_item(guint64 id);
+
+void history_set_item_flags(struct history_item *c, gint16 flags);
 
 void truncate_history();
 
 void clear_history(void);
 
+void history_collect_blobs(void);
+
 void history_save_as(void);
+
+void history_print_stats(GString *s);
 G_END_DECLS
 
 #endif
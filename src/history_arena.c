@@ -0,0 +1,207 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        history_arena.c
+\n\b Description: Storage of the history texts in large chunks.
+
+The texts of the history items are packed one after another into chunks of
+HISTORY_ARENA_CHUNK_SIZE, instead of a heap block each. A pass over the
+whole history (deduplication, search, saving) then reads memory in order,
+and the heap isn't fragmented by the texts coming and going.
+
+A chunk is unmapped as soon as none of its texts is in use. When too much of
+the chunks is taken by the texts of evicted items, the history moves all of
+its texts into fresh chunks (history_arena_detach()), in the order of the
+history, and the old chunks are released at once.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+#include <sys/mman.h>
+
+struct arena_chunk {
+	guint32 used;  /**bytes handed out, including the headers  */
+	guint32 live;  /**bytes of the entries still in use  */
+	guint32 res[2];
+};
+
+/**precedes each text  */
+struct arena_entry {
+	struct arena_chunk *chunk;
+	guint32 size;  /**of the entry, including this header and the padding  */
+	guint32 res;
+};
+
+#define ENTRY_ALIGN 8
+
+struct arena_stats {
+	guint chunks_mapped;  /**since the start  */
+	guint chunks_freed;
+	guint compactions;
+};
+
+/**main thread only  */
+static GPtrArray * chunks = NULL;          /**struct arena_chunk, the current one last  */
+static struct arena_chunk * current = NULL;
+static guint64 live_bytes = 0;
+static struct arena_stats stats;
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	a new chunk, or NULL if the memory can't be mapped.
+****************************************************************************/
+static struct arena_chunk *chunk_new(void)
+{
+	struct arena_chunk * chunk = mmap(NULL, HISTORY_ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == chunk) {
+		g_fprintf(stderr, "Unable to map a history text chunk\n");
+		return NULL;
+	}
+	chunk->used = sizeof(struct arena_chunk);
+	chunk->live = 0;
+	if (!chunks)
+		chunks = g_ptr_array_new();
+	g_ptr_array_add(chunks, chunk);
+	stats.chunks_mapped++;
+	return chunk;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void chunk_free(struct arena_chunk *chunk)
+{
+	munmap(chunk, HISTORY_ARENA_CHUNK_SIZE);
+	stats.chunks_freed++;
+}
+
+/***************************************************************************/
+/** Copies the text (and a terminating NUL) into the arena.
+\n\b Arguments:
+\n\b Returns:	the copy, or NULL if the text is too large for the arena.
+****************************************************************************/
+gchar *history_arena_alloc(const gchar *text, guint32 len)
+{
+	struct arena_entry * entry;
+	guint32 size;
+
+	if (len > HISTORY_ARENA_MAX_TEXT)
+		return NULL;
+	size = (sizeof(struct arena_entry) + len + 1 + ENTRY_ALIGN - 1) & ~(ENTRY_ALIGN - 1);
+
+	if (!current || HISTORY_ARENA_CHUNK_SIZE - current->used < size) {
+		current = chunk_new();
+		if (!current)
+			return NULL;
+	}
+
+	entry = (struct arena_entry *) ((gchar *) current + current->used);
+	entry->chunk = current;
+	entry->size = size;
+	current->used += size;
+	current->live += size;
+	live_bytes += size;
+
+	memcpy(entry + 1, text, len);
+	((gchar *) (entry + 1))[len] = 0;
+	return (gchar *) (entry + 1);
+}
+
+/***************************************************************************/
+/** Frees a text returned by history_arena_alloc(). The chunk goes back to
+the OS when it has no texts left.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_arena_free(gchar *text)
+{
+	struct arena_entry * entry = (struct arena_entry *) text - 1;
+	struct arena_chunk * chunk = entry->chunk;
+
+	chunk->live -= entry->size;
+	live_bytes -= entry->size;
+	/**a detached chunk is freed by history_arena_release()  */
+	if (0 == chunk->live && chunk != current && g_ptr_array_remove_fast(chunks, chunk))
+		chunk_free(chunk);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE if the texts of the evicted items take enough of the
+chunks for the compaction to pay off.
+****************************************************************************/
+gboolean history_arena_wasteful(void)
+{
+	guint64 mapped = chunks ? (guint64) chunks->len * HISTORY_ARENA_CHUNK_SIZE : 0;
+	guint64 waste = mapped - live_bytes;
+	return waste > 2 * HISTORY_ARENA_CHUNK_SIZE && waste > live_bytes;
+}
+
+/***************************************************************************/
+/** Starts a compaction: the texts allocated from now on go into new chunks.
+The caller moves the texts it keeps, then releases the old chunks.
+\n\b Arguments:
+\n\b Returns:	the old chunks.
+****************************************************************************/
+GPtrArray *history_arena_detach(void)
+{
+	GPtrArray * old = chunks ? chunks : g_ptr_array_new();
+	chunks = g_ptr_array_new();
+	current = NULL;
+	stats.compactions++;
+	return old;
+}
+
+/***************************************************************************/
+/** Unmaps the chunks detached by history_arena_detach(). None of their
+texts may be in use anymore.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_arena_release(GPtrArray *old)
+{
+	guint i;
+	for (i = 0; i < old->len; i++) {
+		struct arena_chunk * chunk = (struct arena_chunk *) g_ptr_array_index(old, i);
+		live_bytes -= chunk->live;
+		chunk_free(chunk);
+	}
+	g_ptr_array_free(old, TRUE);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_arena_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Text chunks: %u of %u KB (%" G_GUINT64_FORMAT " KB in use), "
+		  "mapped: %u, freed: %u, compactions: %u\n"),
+		chunks ? chunks->len : 0, HISTORY_ARENA_CHUNK_SIZE / 1024, live_bytes / 1024,
+		stats.chunks_mapped, stats.chunks_freed, stats.compactions);
+}
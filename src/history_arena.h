@@ -0,0 +1,45 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HISTORY_ARENA_H
+#define HISTORY_ARENA_H
+
+G_BEGIN_DECLS
+
+/**the chunks are mapped directly, so that a freed chunk goes back to the OS  */
+#define HISTORY_ARENA_CHUNK_SIZE (256 * 1024)
+/**larger texts keep a heap block of their own  */
+#define HISTORY_ARENA_MAX_TEXT   (32 * 1024)
+
+gchar *history_arena_alloc(const gchar *text, guint32 len);
+
+void history_arena_free(gchar *text);
+
+gboolean history_arena_wasteful(void);
+
+GPtrArray *history_arena_detach(void);
+
+void history_arena_release(GPtrArray *chunks);
+
+void history_arena_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
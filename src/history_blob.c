@@ -0,0 +1,207 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** \file ******************************************************************
+\n\b File:        history_blob.c
+\n\b Description: Content-addressed store for the texts of large items.
+
+The text of an item larger than the blob_threshold preference is kept in a
+file of its own under ~/.local/share/rainbow-cm/blobs, named by the hash and
+the length of the text, so the items with the same content share it. The
+history (in memory and in the journal) keeps only the first
+HISTORY_BLOB_PREVIEW bytes, and the full text is read when it is pasted.
+
+The files are written and removed by the history writer thread. A selection
+larger than the threshold is received straight into a file of the store,
+which the writer then moves into place under the name of its text.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	file name of the blob, without the directory.
+****************************************************************************/
+static gchar *history_blob_name(guint64 hash, guint32 len)
+{
+	return g_strdup_printf("%016" G_GINT64_MODIFIER "x-%u", hash, len);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+gchar *history_blob_path(guint64 hash, guint32 len)
+{
+	gchar * name = history_blob_name(hash, len);
+	gchar * path = g_build_filename(g_get_user_data_dir(), HISTORY_BLOB_DIR, name, NULL);
+	g_free(name);
+	return path;
+}
+
+/***************************************************************************/
+/** Reads the text, including the blobs not written yet.
+\n\b Arguments:
+\n\b Returns:	a reference to the text, or NULL if the blob is missing.
+****************************************************************************/
+struct shared_text *history_blob_read(guint64 hash, guint32 len)
+{
+	gchar * path = history_blob_path(hash, len);
+	struct shared_text * text = history_writer_find_blob(path);
+
+	if (!text) {
+		gchar * data = NULL;
+		gsize length = 0;
+		if (!g_file_get_contents(path, &data, &length, NULL))
+			g_fprintf(stderr, "Blob '%s' is missing\n", path);
+		else if (length != len) {
+			g_fprintf(stderr, "Blob '%s' is damaged\n", path);
+			g_free(data);
+		} else
+			text = shared_text_take(data, length);
+	}
+	g_free(path);
+	return text;
+}
+
+/***************************************************************************/
+/** Writes the blob, unless it exists. Runs in the writer thread.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+gboolean history_blob_write(const gchar *path, const gchar *data, gsize len, gboolean do_sync)
+{
+	gchar * tmp_path;
+	gchar * dir;
+	FILE * f;
+	gboolean ok;
+
+	if (g_file_test(path, G_FILE_TEST_EXISTS))
+		return TRUE; /**same name, same content  */
+
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	tmp_path = g_strconcat(path, ".tmp", NULL);
+	f = fopen(tmp_path, "wb");
+	ok = f && (len == 0 || fwrite(data, len, 1, f) == 1) && fflush(f) == 0;
+	if (ok && do_sync && fsync(fileno(f)) != 0 && errno != EINVAL)
+		ok = FALSE;
+	if (f && fclose(f) != 0)
+		ok = FALSE;
+	if (ok && rename(tmp_path, path) != 0)
+		ok = FALSE;
+	if (!ok) {
+		g_fprintf(stderr, "Unable to write blob '%s'\n", path);
+		unlink(tmp_path);
+	}
+	g_free(tmp_path);
+	return ok;
+}
+
+/***************************************************************************/
+/** Creates a file in the blob store for a text received into it. Until it is
+moved into place, the name is a temporary one, which a crash leaves to
+history_blob_collect().
+\n\b Arguments:	path - set to the path of the file.
+\n\b Returns:	the file open for writing and reading back, or NULL.
+****************************************************************************/
+FILE *history_blob_create(gchar **path)
+{
+	gchar * dir = g_build_filename(g_get_user_data_dir(), HISTORY_BLOB_DIR, NULL);
+	FILE * f = NULL;
+	gint fd;
+
+	g_mkdir_with_parents(dir, 0700);
+	*path = g_build_filename(dir, "incoming-XXXXXX", NULL);
+	g_free(dir);
+	fd = g_mkstemp(*path);
+	if (fd >= 0 && !(f = fdopen(fd, "w+b"))) {
+		close(fd);
+		unlink(*path);
+	}
+	if (!f) {
+		g_fprintf(stderr, "Unable to create blob '%s'\n", *path);
+		g_free(*path);
+		*path = NULL;
+	}
+	return f;
+}
+
+/***************************************************************************/
+/** Moves a received text into place, unless the blob exists. Runs in the
+writer thread.
+\n\b Arguments:	source - the file the text was received into.
+\n\b Returns:
+****************************************************************************/
+gboolean history_blob_move(const gchar *source, const gchar *path, gboolean do_sync)
+{
+	gboolean ok = TRUE;
+
+	if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+		unlink(source); /**same name, same content  */
+		return TRUE;
+	}
+	if (do_sync) {
+		gint fd = open(source, O_RDONLY);
+		ok = fd >= 0 && (fsync(fd) == 0 || errno == EINVAL);
+		if (fd >= 0)
+			close(fd);
+	}
+	if (ok && rename(source, path) != 0)
+		ok = FALSE;
+	if (!ok) {
+		g_fprintf(stderr, "Unable to write blob '%s'\n", path);
+		unlink(source);
+	}
+	return ok;
+}
+
+/***************************************************************************/
+/** Removes the blobs that no item refers to, left behind by a crash or by a
+session without saving the history.
+\n\b Arguments:	live - set of the blob paths in use.
+\n\b Returns:
+****************************************************************************/
+void history_blob_collect(GHashTable *live)
+{
+	gchar * dir_path = g_build_filename(g_get_user_data_dir(), HISTORY_BLOB_DIR, NULL);
+	GDir * dir = g_dir_open(dir_path, 0, NULL);
+	const gchar * name;
+
+	if (dir) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			gchar * path = g_build_filename(dir_path, name, NULL);
+			if (!g_hash_table_lookup(live, path))
+				history_writer_delete_blob(path);
+			else
+				g_free(path);
+		}
+		g_dir_close(dir);
+	}
+	g_free(dir_path);
+}
@@ -0,0 +1,45 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HISTORY_BLOB_H
+#define HISTORY_BLOB_H
+
+G_BEGIN_DECLS
+
+#define HISTORY_BLOB_DIR APP_PROG_NAME "/blobs"
+
+/**bytes of the text kept in the history for an item in the blob store  */
+#define HISTORY_BLOB_PREVIEW 4096
+
+gchar *history_blob_path(guint64 hash, guint32 len);
+
+struct shared_text *history_blob_read(guint64 hash, guint32 len);
+
+gboolean history_blob_write(const gchar *path, const gchar *data, gsize len, gboolean do_sync);
+
+FILE *history_blob_create(gchar **path);
+
+gboolean history_blob_move(const gchar *source, const gchar *path, gboolean do_sync);
+
+void history_blob_collect(GHashTable *live);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** \file ******************************************************************
+\n\b File:        history_compress.c
+\n\b Description: Compression of the texts in the history file.
+
+Each text is deflated on its own (raw deflate, no header), so an item can be
+inflated when it is shown or pasted, without touching the others. Most
+clipboard items are short, which leaves deflate little to work with. A
+dictionary made of the user's own recent texts fixes that: URLs, paths, code
+and log lines start matching from the first byte.
+
+The dictionary is written at the start of the history file. The writer
+thread trains the next one from each snapshot it writes, and the next
+snapshot is written with it.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/**bytes taken from the beginning of each text for the dictionary: the
+ repeated parts of clipboard texts are mostly prefixes  */
+#define DICT_SAMPLE 256
+/**shorter texts are stored as is  */
+#define MIN_DEFLATE_SIZE 32
+
+struct history_dict {
+	gint ref;
+	guint32 len;
+	gchar data[1];
+};
+
+struct compress_stats {
+	guint64 raw;       /**bytes before compression  */
+	guint64 stored;    /**bytes after compression  */
+	guint items;       /**texts compressed  */
+	guint skipped;     /**texts that didn't shrink  */
+	guint inflated;    /**texts inflated  */
+};
+
+G_LOCK_DEFINE_STATIC(stats);
+static struct compress_stats stats;
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE if the program was built with zlib.
+****************************************************************************/
+gboolean history_compress_available(void)
+{
+#ifdef HAVE_ZLIB
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct history_dict *history_dict_new(const gchar *data, guint32 len)
+{
+	struct history_dict * dict;
+
+	len = MIN(len, HISTORY_DICT_MAX);
+	dict = g_malloc(sizeof(struct history_dict) + len);
+	dict->ref = 1;
+	dict->len = len;
+	memcpy(dict->data, data, len);
+	return dict;
+}
+
+/***************************************************************************/
+/** Builds a dictionary from the texts (most recent first) and the previous
+dictionary. Deflate finds the matches near the end of the dictionary more
+cheaply, so the most recent texts go last, and what is left of the old
+dictionary goes first: the buffer is filled from its end. Thread-safe.
+\n\b Arguments:
+\n\b Returns:	the dictionary, or NULL if there is nothing to build it from.
+****************************************************************************/
+struct history_dict *history_dict_train(GPtrArray *texts, const struct history_dict *old)
+{
+	gchar * buf = g_malloc(HISTORY_DICT_MAX);
+	gsize start = HISTORY_DICT_MAX;
+	struct history_dict * dict;
+	guint i;
+
+	for (i = 0; i < texts->len && start; i++) {
+		const gchar * text = (const gchar *) g_ptr_array_index(texts, i);
+		gsize n = MIN(strnlen(text, DICT_SAMPLE), start);
+		start -= n;
+		memcpy(buf + start, text, n);
+	}
+	if (old && start) {
+		guint32 n = MIN(old->len, start);
+		start -= n;
+		memcpy(buf + start, old->data + old->len - n, n);
+	}
+
+	dict = start < HISTORY_DICT_MAX ? history_dict_new(buf + start, HISTORY_DICT_MAX - start) : NULL;
+	g_free(buf);
+	return dict;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct history_dict *history_dict_ref(struct history_dict *dict)
+{
+	if (dict)
+		g_atomic_int_inc(&dict->ref);
+	return dict;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_dict_unref(struct history_dict *dict)
+{
+	if (dict && g_atomic_int_dec_and_test(&dict->ref))
+		g_free(dict);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+const gchar *history_dict_data(const struct history_dict *dict, guint32 *len)
+{
+	*len = dict->len;
+	return dict->data;
+}
+
+/***************************************************************************/
+/** Appends the deflated text to the buffer. Thread-safe.
+\n\b Arguments:
+\n\b Returns:	size of the compressed data, 0 if the text is stored as is
+(the buffer is unchanged then).
+****************************************************************************/
+guint32 history_deflate(GByteArray *out, const gchar *text, guint32 len, const struct history_dict *dict)
+{
+#ifdef HAVE_ZLIB
+	z_stream z;
+	guint start = out->len;
+	uLong bound;
+	guint32 size = 0;
+
+	if (len < MIN_DEFLATE_SIZE)
+		return 0;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	if (dict)
+		deflateSetDictionary(&z, (const Bytef *) dict->data, dict->len);
+
+	bound = deflateBound(&z, len);
+	g_byte_array_set_size(out, start + bound);
+	z.next_in = (Bytef *) text;
+	z.avail_in = len;
+	z.next_out = out->data + start;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out < len)
+		size = z.total_out;
+	deflateEnd(&z);
+
+	g_byte_array_set_size(out, start + size);
+
+	G_LOCK(stats);
+	if (size) {
+		stats.items++;
+		stats.raw += len;
+		stats.stored += size;
+	} else
+		stats.skipped++;
+	G_UNLOCK(stats);
+	return size;
+#else
+	return 0;
+#endif
+}
+
+/***************************************************************************/
+/** Inflates exactly len bytes into out. Thread-safe.
+\n\b Arguments:
+\n\b Returns:	FALSE if the data is damaged, or zlib is not available.
+****************************************************************************/
+gboolean history_inflate(gchar *out, guint32 len, const gchar *in, guint32 in_len, const struct history_dict *dict)
+{
+#ifdef HAVE_ZLIB
+	z_stream z;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+		return FALSE;
+	if (dict)
+		inflateSetDictionary(&z, (const Bytef *) dict->data, dict->len);
+
+	z.next_in = (Bytef *) in;
+	z.avail_in = in_len;
+	z.next_out = (Bytef *) out;
+	z.avail_out = len;
+	ret = inflate(&z, Z_FINISH);
+	inflateEnd(&z);
+
+	G_LOCK(stats);
+	stats.inflated++;
+	G_UNLOCK(stats);
+	return ret == Z_STREAM_END && z.total_out == len;
+#else
+	return FALSE;
+#endif
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_compress_print_stats(GString *s)
+{
+	G_LOCK(stats);
+	g_string_append_printf(s,
+		_("Texts compressed: %u (%" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT " bytes), stored as is: %u\n"
+		  "Texts inflated: %u\n"),
+		stats.items, stats.raw, stats.stored, stats.skipped,
+		stats.inflated);
+	G_UNLOCK(stats);
+}
@@ -0,0 +1,51 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HISTORY_COMPRESS_H
+#define HISTORY_COMPRESS_H
+
+G_BEGIN_DECLS
+
+/**the largest dictionary deflate can use  */
+#define HISTORY_DICT_MAX (32 * 1024)
+
+struct history_dict;
+
+gboolean history_compress_available(void);
+
+struct history_dict *history_dict_new(const gchar *data, guint32 len);
+
+struct history_dict *history_dict_train(GPtrArray *texts, const struct history_dict *old);
+
+struct history_dict *history_dict_ref(struct history_dict *dict);
+
+void history_dict_unref(struct history_dict *dict);
+
+const gchar *history_dict_data(const struct history_dict *dict, guint32 *len);
+
+guint32 history_deflate(GByteArray *out, const gchar *text, guint32 len, const struct history_dict *dict);
+
+gboolean history_inflate(gchar *out, guint32 len, const gchar *in, guint32 in_len, const struct history_dict *dict);
+
+void history_compress_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
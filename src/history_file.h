@@ -0,0 +1,101 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ * Copyright (C) 2007-2008 by Xyhthyx <xyhthyx@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** On-disk format of the history file, shared by the loader and the writer. */
+
+#ifndef HISTORY_FILE_H
+#define HISTORY_FILE_H
+
+G_BEGIN_DECLS
+
+#define HISTORY_FILE0 HISTORY_FILE
+#define HISTORY_FILE_TMP HISTORY_FILE ".tmp"
+
+#define HISTORY_MAGIC_SIZE 32
+#define HISTORY_VERSION     3 /**index (-1) into history_magics[]  */
+extern gchar* history_magics[];
+
+/**
+ Version 2 of the history file is an append-only journal. Each change of the
+ history is appended as a small record, and the loader replays the records in
+ order. An item is identified by the 64-bit id kept in its res[0], res[1].
+
+ The records of deleted items and the move/flags records are dead space. When
+ it grows past HISTORY_COMPACT_MIN_DEAD and past the size of the live data,
+ the journal is compacted in the background: the current history is written
+ to a new file as a sequence of ADD records, which then replaces the journal.
+
+ Version 3 adds a CRC-32C to each record. The loader checks it instead of
+ validating the UTF-8 of every text again, and skips a damaged record rather
+ than everything after it.
+*/
+#define HISTORY_OP_ADD           1 /**new item, the text follows the headers  */
+#define HISTORY_OP_DELETE        2 /**tombstone  */
+#define HISTORY_OP_FLAGS         3 /**the flags of the item have changed  */
+#define HISTORY_OP_MOVE_TO_FRONT 4 /**an existing item became the most recent one  */
+#define HISTORY_OP_DICTIONARY    5 /**the compression dictionary of the records that follow, in place of the text  */
+
+/**history_record.flags  */
+#define HISTORY_RECORD_DEFLATE   0x1 /**the text is deflated: res[0] is its compressed size, res[1] its size  */
+#define HISTORY_RECORD_VALIDATED 0x2 /**the text was valid UTF-8 when it was written  */
+
+#define HISTORY_COMPACT_MIN_DEAD (256 * 1024)
+
+struct history_record {
+	guint32 size;   /**size of the record, including the headers and the padding  */
+	guint16 op;     /**HISTORY_OP_*  */
+	guint16 flags;  /**HISTORY_RECORD_*  */
+	guint32 res[2]; /**see HISTORY_RECORD_DEFLATE, else 0  */
+	guint32 crc;    /**version 3: CRC-32C of the record, without this field and the next  */
+	guint32 pad;
+}__attribute__((__packed__));
+
+/**version 2 had no CRC  */
+#define HISTORY_V2_RECORD_SIZE G_STRUCT_OFFSET(struct history_record, crc)
+
+/**version 1 wrote the whole struct, with 8 bytes of the text in place of the pointer  */
+#define HISTORY_V1_ITEM_SIZE 32
+
+/**record header, then the item header, then the text (ADD only) with at least one 0 byte of padding  */
+#define HISTORY_ITEM_HEADER_SIZE   G_STRUCT_OFFSET(struct history_item, text)
+#define HISTORY_RECORD_HEADER_SIZE (sizeof(struct history_record) + HISTORY_ITEM_HEADER_SIZE)
+#define HISTORY_RECORD_ALIGN       8
+
+/**the CRC of a complete record  */
+static inline guint32 history_record_crc(const gchar *record)
+{
+	guint32 size = ((const struct history_record *) record)->size;
+	guint32 crc = crc32c_update(~0U, record, HISTORY_V2_RECORD_SIZE);
+	crc = crc32c_update(crc, record + sizeof(struct history_record), size - sizeof(struct history_record));
+	return ~crc;
+}
+
+/**size of the journal record of the given operation on the item, before compression  */
+static inline guint32 history_record_size(guint16 op, const struct history_item *c)
+{
+	guint32 size = HISTORY_RECORD_HEADER_SIZE;
+	if (HISTORY_OP_ADD == op || HISTORY_OP_DICTIONARY == op)
+		size += history_item_text_len(c) + 1;
+	return (size + HISTORY_RECORD_ALIGN - 1) & ~(HISTORY_RECORD_ALIGN - 1);
+}
+
+G_END_DECLS
+
+#endif
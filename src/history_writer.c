@@ -0,0 +1,731 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        history_writer.c
+\n\b Description: Write-behind persistence of the history journal.
+
+The main loop only encodes the journal records of a change (the cost is
+proportional to the changed item) and queues them. A dedicated thread appends
+the queued records in batches, so a burst of changes within the write delay
+costs a single write, and a slow disk never blocks the clipboard or the popup.
+
+A snapshot (compaction, clear, explicit save) copies the item headers. The
+texts are kept alive by history.c until history_snapshot_written() is called.
+Having written a snapshot, the thread trains the compression dictionary of
+the next one from its texts, so the main loop never does.
+
+The blob store files are written and removed here too, in the order they are
+queued, and before the journal records that refer to them.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+#include "history_file.h"
+
+#include <errno.h>
+
+#define WRITE_CHUNK (64 * 1024)
+
+struct history_writer_stats {
+	guint changes;     /**journal records queued  */
+	guint writes;      /**batches appended to the journal  */
+	guint snapshots;   /**snapshots written  */
+	guint avoided;     /**records that didn't need a write of their own  */
+	guint64 bytes;     /**bytes written  */
+	gint64 lag_last;   /**microseconds from the oldest change of a batch to its write  */
+	gint64 lag_max;
+	guint blobs_written;
+	guint blobs_removed;
+};
+
+struct blob_job {
+	gchar *path;
+	struct shared_text *data;  /**NULL: remove the blob, unless there is a source  */
+	gchar *source;             /**a received text to move into place  */
+};
+
+static GMutex * writer_lock = NULL;
+static GCond * writer_cond = NULL;
+static GThread * writer_thread = NULL;
+
+static gchar * history_path = NULL;
+static gchar * tmp_path = NULL;
+
+/**protected by writer_lock  */
+static GByteArray * pending = NULL;  /**encoded records waiting to be appended  */
+static guint pending_records = 0;
+static GArray * snapshot = NULL;     /**struct history_item, oldest first  */
+static GSList * blob_jobs = NULL;    /**struct blob_job, most recent first  */
+static GSList * running_jobs = NULL; /**the ones being run, oldest first  */
+static struct history_dict * snapshot_dict = NULL; /**the dictionary of the snapshot  */
+static gboolean snapshot_compress = FALSE;
+static struct history_dict * trained_dict = NULL; /**for the next snapshot  */
+static gint64 first_change_time = 0; /**monotonic time of the oldest pending record  */
+static gint64 due_time = 0;
+static gboolean sync_writes = FALSE;
+static gboolean quit = FALSE;
+static gboolean failed = FALSE;
+static struct history_writer_stats stats;
+
+/**writer thread only  */
+static FILE * journal_file = NULL;
+static gboolean journal_broken = FALSE; /**a write failed, only a snapshot can follow  */
+
+/**main thread only  */
+static guint snapshots_outstanding = 0;
+static struct history_dict * current_dict = NULL; /**the dictionary of the journal on disk  */
+
+/***************************************************************************/
+/** Appends a journal record to the buffer.
+\n\b Arguments:
+\n\b Returns:	size of the record.
+****************************************************************************/
+static guint32 encode_record(GByteArray *buf, guint16 op, const struct history_item *c,
+	const struct history_dict *dict, gboolean compress)
+{
+	static const guint8 zeros[HISTORY_RECORD_ALIGN];
+	struct history_record r;
+	struct history_item h;
+	guint start = buf->len;
+	guint32 used = HISTORY_RECORD_HEADER_SIZE;
+
+	memset(&r, 0, sizeof(r));
+	r.size = history_record_size(op, c);
+	r.op = op;
+	/**every text in the history is valid, the loader doesn't check it again  */
+	if (HISTORY_OP_ADD == op)
+		r.flags |= HISTORY_RECORD_VALIDATED;
+	memcpy(&h, c, HISTORY_ITEM_HEADER_SIZE);
+	h.flags &= ~CLIP_TYPE_IN_MEMORY;
+
+	g_byte_array_append(buf, (const guint8 *) &r, sizeof(r));
+	g_byte_array_append(buf, (const guint8 *) &h, HISTORY_ITEM_HEADER_SIZE);
+	if (HISTORY_OP_ADD == op || HISTORY_OP_DICTIONARY == op) {
+		guint32 text_len = history_item_text_len(c);
+		gchar * inflated = NULL;
+		const gchar * text = c->text;
+		guint32 zlen = 0;
+
+		/**loaded from the file and not needed since, the text is still deflated  */
+		if (c->flags & CLIP_TYPE_DEFLATED)
+			text = inflated = history_item_inflate_copy(c);
+		if (compress && HISTORY_OP_ADD == op)
+			zlen = history_deflate(buf, text, text_len, dict);
+		if (zlen) {
+			r.flags |= HISTORY_RECORD_DEFLATE;
+			r.res[0] = zlen;
+			r.res[1] = text_len;
+			r.size = (HISTORY_RECORD_HEADER_SIZE + zlen + 1 + HISTORY_RECORD_ALIGN - 1) & ~(HISTORY_RECORD_ALIGN - 1);
+			memcpy(buf->data + start, &r, sizeof(r));
+			used += zlen;
+		} else {
+			g_byte_array_append(buf, (const guint8 *) text, text_len);
+			used += text_len;
+		}
+		g_free(inflated);
+	}
+	g_byte_array_append(buf, zeros, r.size - used);
+	r.crc = history_record_crc((const gchar *) buf->data + start);
+	memcpy(buf->data + start + G_STRUCT_OFFSET(struct history_record, crc), &r.crc, sizeof(r.crc));
+	return r.size;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean flush_file(FILE *f, gboolean do_sync)
+{
+	if (fflush(f) != 0)
+		return FALSE;
+	if (do_sync && fsync(fileno(f)) != 0 && errno != EINVAL)
+		return FALSE;
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Writes the items as a fresh journal and renames it over the history file.
+Runs in the writer thread.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean write_snapshot(GArray *items, const struct history_dict *dict, gboolean compress,
+	gboolean do_sync, guint64 *written)
+{
+	FILE * f;
+	GByteArray * buf;
+	gchar magic[HISTORY_MAGIC_SIZE];
+	gchar * dir;
+	guint i;
+
+	dir = g_path_get_dirname(history_path);
+	g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+
+	f = fopen(tmp_path, "wb");
+	if (!f) {
+		g_fprintf(stderr, "Unable to open history file '%s'\n", tmp_path);
+		return FALSE;
+	}
+
+	memset(magic, 0, sizeof(magic));
+	memcpy(magic, history_magics[HISTORY_VERSION-1], strlen(history_magics[HISTORY_VERSION-1]));
+	buf = g_byte_array_new();
+	g_byte_array_append(buf, (const guint8 *) magic, sizeof(magic));
+	if (dict) {
+		struct history_item d;
+		guint32 len;
+		memset(&d, 0, sizeof(d));
+		d.text = (gchar *) history_dict_data(dict, &len);
+		d.len = len;
+		encode_record(buf, HISTORY_OP_DICTIONARY, &d, NULL, FALSE);
+	}
+
+	for (i = 0; i < items->len; i++) {
+		encode_record(buf, HISTORY_OP_ADD, &g_array_index(items, struct history_item, i), dict, compress);
+		if (buf->len >= WRITE_CHUNK || i + 1 == items->len) {
+			if (fwrite(buf->data, buf->len, 1, f) != 1)
+				goto error;
+			*written += buf->len;
+			g_byte_array_set_size(buf, 0);
+		}
+	}
+	if (buf->len && fwrite(buf->data, buf->len, 1, f) != 1)
+		goto error;
+	*written += buf->len;
+
+	if (!flush_file(f, do_sync))
+		goto error;
+	fclose(f);
+	f = NULL;
+	if (rename(tmp_path, history_path) != 0)
+		goto error;
+
+	if (journal_file)
+		fclose(journal_file);
+	journal_file = NULL;
+
+	g_byte_array_free(buf, TRUE);
+	return TRUE;
+
+error:
+	g_fprintf(stderr, "Unable to write history file '%s'\n", tmp_path);
+	if (f)
+		fclose(f);
+	unlink(tmp_path);
+	g_byte_array_free(buf, TRUE);
+	return FALSE;
+}
+
+/***************************************************************************/
+/** Runs in the writer thread.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean append_records(GByteArray *records, gboolean do_sync, guint64 *written)
+{
+	if (!journal_file)
+		journal_file = fopen(history_path, "ab");
+	if (!journal_file) {
+		g_fprintf(stderr, "Unable to open history file '%s'\n", history_path);
+		return FALSE;
+	}
+	if (fwrite(records->data, records->len, 1, journal_file) != 1 || !flush_file(journal_file, do_sync)) {
+		g_fprintf(stderr, "Unable to append to the history file\n");
+		/**a torn record is followed by garbage, the file is replaced by the next snapshot  */
+		fclose(journal_file);
+		journal_file = NULL;
+		return FALSE;
+	}
+	*written += records->len;
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Runs in the writer thread. The jobs are in the order they were queued.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void run_blob_jobs(GSList *jobs, gboolean do_sync, guint64 *written, guint *nwritten, guint *nremoved)
+{
+	GSList * i;
+
+	for (i = jobs; i != NULL; i = i->next) {
+		struct blob_job * job = (struct blob_job *) i->data;
+		if (job->data) {
+			if (history_blob_write(job->path, job->data->str, job->data->len, do_sync)) {
+				*written += job->data->len;
+				(*nwritten)++;
+			}
+		} else if (job->source) {
+			/**its bytes were written as they were received  */
+			if (history_blob_move(job->source, job->path, do_sync))
+				(*nwritten)++;
+		} else if (unlink(job->path) == 0)
+			(*nremoved)++;
+	}
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void blob_job_free(struct blob_job *job)
+{
+	g_free(job->path);
+	g_free(job->source);
+	shared_text_unref(job->data);
+	g_slice_free(struct blob_job, job);
+}
+
+/***************************************************************************/
+/** Trains a dictionary from the texts of the snapshot, most recent first.
+Runs in the writer thread, the texts are kept for it.
+\n\b Arguments:
+\n\b Returns:	the dictionary, or NULL.
+****************************************************************************/
+static struct history_dict *train_dict(GArray *items, const struct history_dict *dict)
+{
+	GPtrArray * texts = g_ptr_array_sized_new(items->len);
+	struct history_dict * trained;
+	guint i = items->len;
+
+	while (i--) {
+		const struct history_item *c = &g_array_index(items, struct history_item, i);
+		if (c->len && !(c->flags & CLIP_TYPE_DEFLATED))
+			g_ptr_array_add(texts, c->text);
+	}
+	trained = history_dict_train(texts, dict);
+	g_ptr_array_free(texts, TRUE);
+	return trained;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean snapshot_written_idle(gpointer data)
+{
+	if (--snapshots_outstanding == 0)
+		history_snapshot_written();
+	return FALSE;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gpointer writer_thread_func(gpointer data)
+{
+	g_mutex_lock(writer_lock);
+
+	while (TRUE)
+	{
+		gint64 now = g_get_monotonic_time();
+
+		if (!snapshot && !pending->len && !blob_jobs) {
+			if (quit)
+				break;
+			g_cond_wait(writer_cond, writer_lock);
+			continue;
+		}
+
+		/**snapshots are written right away, they release the items held for them
+		   (under on exit durability the history queues one only at the exit);
+		   the blobs right away, they are held in memory until then  */
+		if (!snapshot && !blob_jobs && !quit && now < due_time) {
+			GTimeVal tv;
+			g_get_current_time(&tv);
+			g_time_val_add(&tv, MIN(due_time - now, (gint64) G_MAXLONG));
+			g_cond_timed_wait(writer_cond, writer_lock, &tv);
+			continue;
+		}
+
+		GArray * items = snapshot;
+		struct history_dict * dict = snapshot_dict;
+		gboolean compress = snapshot_compress;
+		GSList * jobs = g_slist_reverse(blob_jobs);
+		guint nblobs_written = 0, nblobs_removed = 0;
+		GByteArray * records = pending;
+		guint nrecords = pending_records;
+		gint64 oldest = first_change_time;
+		gboolean do_sync = sync_writes;
+		gboolean ok = TRUE;
+		guint64 written = 0;
+		struct history_dict * trained = NULL;
+
+		snapshot = NULL;
+		snapshot_dict = NULL;
+		blob_jobs = NULL;
+		running_jobs = jobs;
+		pending = g_byte_array_new();
+		pending_records = 0;
+
+		g_mutex_unlock(writer_lock);
+
+		/**the blobs go first, the records that refer to them must not be on disk without them  */
+		run_blob_jobs(jobs, do_sync, &written, &nblobs_written, &nblobs_removed);
+		if (items) {
+			journal_broken = !write_snapshot(items, dict, compress, do_sync, &written);
+			if (compress)
+				trained = train_dict(items, dict);
+		}
+		ok = !journal_broken;
+		if (ok && records->len)
+			ok = append_records(records, do_sync, &written);
+		journal_broken = !ok;
+
+		g_mutex_lock(writer_lock);
+
+		stats.bytes += written;
+		stats.blobs_written += nblobs_written;
+		stats.blobs_removed += nblobs_removed;
+		running_jobs = NULL;
+		g_slist_free_full(jobs, (GDestroyNotify) blob_job_free);
+		if (!ok)
+			failed = TRUE;
+		if (trained) {
+			if (trained_dict)
+				history_dict_unref(trained_dict);
+			trained_dict = trained;
+		}
+		if (items) {
+			stats.snapshots++;
+			g_array_free(items, TRUE);
+			if (dict)
+				history_dict_unref(dict);
+			g_idle_add(snapshot_written_idle, NULL);
+		}
+		if (nrecords) {
+			stats.writes++;
+			stats.avoided += nrecords - 1;
+			stats.lag_last = g_get_monotonic_time() - oldest;
+			stats.lag_max = MAX(stats.lag_max, stats.lag_last);
+		}
+		g_byte_array_free(records, TRUE);
+	}
+
+	if (journal_file)
+		fclose(journal_file);
+	journal_file = NULL;
+
+	g_mutex_unlock(writer_lock);
+	return NULL;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_init(void)
+{
+	GError * error = NULL;
+
+	history_path = g_build_filename(g_get_user_data_dir(), HISTORY_FILE0, NULL);
+	tmp_path = g_build_filename(g_get_user_data_dir(), HISTORY_FILE_TMP, NULL);
+
+	writer_lock = g_mutex_new();
+	writer_cond = g_cond_new();
+	pending = g_byte_array_new();
+
+	writer_thread = g_thread_create(writer_thread_func, NULL, TRUE, &error);
+	if (!writer_thread) {
+		g_fprintf(stderr, "Unable to start the history writer: %s\n", error->message);
+		g_error_free(error);
+	}
+}
+
+/***************************************************************************/
+/** Writes everything that is still queued and stops the thread.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_shutdown(void)
+{
+	if (!writer_thread)
+		return;
+	g_mutex_lock(writer_lock);
+	quit = TRUE;
+	g_cond_signal(writer_cond);
+	g_mutex_unlock(writer_lock);
+	g_thread_join(writer_thread);
+	writer_thread = NULL;
+}
+
+/***************************************************************************/
+/** Queues a journal record for the change that has been applied to the item.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_append(guint16 op, const struct history_item *c)
+{
+	gint64 now = g_get_monotonic_time();
+	gint32 durability = get_pref_int32("history_durability");
+	gboolean compress = get_pref_int32("compress_history") && history_compress_available();
+
+	g_mutex_lock(writer_lock);
+
+	if (!pending_records) {
+		first_change_time = now;
+		if (HISTORY_DURABILITY_ON_EXIT == durability)
+			due_time = G_MAXINT64;
+		else if (HISTORY_DURABILITY_PERIODIC == durability)
+			due_time = now + (gint64) get_pref_int32("history_write_delay") * 1000;
+		else
+			due_time = now;
+	}
+	sync_writes = (HISTORY_DURABILITY_EVERY_CHANGE == durability);
+
+	encode_record(pending, op, c, current_dict, compress);
+	pending_records++;
+	stats.changes++;
+
+	if (due_time <= now)
+		g_cond_signal(writer_cond);
+	g_mutex_unlock(writer_lock);
+
+	if (!writer_thread)
+		g_fprintf(stderr, "History writer is not running, the change is not saved\n");
+}
+
+/***************************************************************************/
+/** Queues a snapshot of the history. The records queued earlier are dropped,
+the snapshot includes them. The texts of the items must stay valid until
+history_snapshot_written(). It is compressed with the dictionary trained from
+the last snapshot written, or else the one of the journal on disk. Must be
+called with hist_lock held.
+\n\b Arguments:
+\n\b Returns:	size of the new journal.
+****************************************************************************/
+guint64 history_writer_snapshot(void)
+{
+	guint n = history_length();
+	GArray * items = g_array_sized_new(FALSE, FALSE, sizeof(struct history_item), n);
+	guint64 size = HISTORY_MAGIC_SIZE;
+	gboolean compress = get_pref_int32("compress_history") && history_compress_available();
+	struct history_dict * dict = NULL;
+
+	if (compress) {
+		g_mutex_lock(writer_lock);
+		dict = trained_dict;
+		trained_dict = NULL;
+		g_mutex_unlock(writer_lock);
+		if (!dict)
+			dict = history_dict_ref(current_dict);
+	}
+	history_writer_set_dict(dict); /**the reference from training goes to the snapshot  */
+	if (dict) {
+		struct history_item d;
+		guint32 len;
+		memset(&d, 0, sizeof(d));
+		history_dict_data(dict, &len);
+		d.len = len;
+		size += history_record_size(HISTORY_OP_DICTIONARY, &d);
+	}
+
+	/* Oldest first, so that replaying the ADD records restores the order */
+	while (n--)
+	{
+		struct history_item *c = history_nth(n);
+		if (c->len == 0)
+			continue;
+		g_array_append_vals(items, c, 1);
+		size += history_record_size(HISTORY_OP_ADD, c);
+	}
+
+	g_mutex_lock(writer_lock);
+	if (snapshot) {
+		g_array_free(snapshot, TRUE); /**not taken yet, replaced  */
+		if (snapshot_dict)
+			history_dict_unref(snapshot_dict);
+	} else
+		snapshots_outstanding++;
+	snapshot = items;
+	snapshot_dict = dict;
+	snapshot_compress = compress;
+	stats.avoided += pending_records;
+	g_byte_array_set_size(pending, 0);
+	pending_records = 0;
+	sync_writes = (HISTORY_DURABILITY_EVERY_CHANGE == get_pref_int32("history_durability"));
+	g_cond_signal(writer_cond);
+	g_mutex_unlock(writer_lock);
+
+	return size;
+}
+
+/***************************************************************************/
+/** Sets the dictionary the journal on disk was written with; the records
+appended to it are compressed with it. Takes a reference.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_set_dict(struct history_dict *dict)
+{
+	if (dict)
+		history_dict_ref(dict);
+	if (current_dict)
+		history_dict_unref(current_dict);
+	current_dict = dict;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void queue_blob_job(gchar *path, struct shared_text *data, gchar *source)
+{
+	struct blob_job * job = g_slice_new(struct blob_job);
+	job->path = path;
+	job->data = data;
+	job->source = source;
+
+	g_mutex_lock(writer_lock);
+	blob_jobs = g_slist_prepend(blob_jobs, job);
+	g_cond_signal(writer_cond);
+	g_mutex_unlock(writer_lock);
+}
+
+/***************************************************************************/
+/** Queues a blob store file to be written. Takes the path and the reference
+to the text.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_put_blob(gchar *path, struct shared_text *data)
+{
+	queue_blob_job(path, data, NULL);
+}
+
+/***************************************************************************/
+/** Queues a text received into a file of the blob store to be moved into
+place. Takes both paths.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_move_blob(gchar *source, gchar *path)
+{
+	queue_blob_job(path, NULL, source);
+}
+
+/***************************************************************************/
+/** Queues a blob store file to be removed. Takes the path.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_delete_blob(gchar *path)
+{
+	queue_blob_job(path, NULL, NULL);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	a reference to the blob if it is queued to be written, else NULL.
+****************************************************************************/
+struct shared_text *history_writer_find_blob(const gchar *path)
+{
+	struct blob_job * found = NULL;
+	struct shared_text * data = NULL;
+	gchar * source = NULL;
+	GSList * i;
+
+	g_mutex_lock(writer_lock);
+	for (i = blob_jobs; i != NULL && !found; i = i->next)
+		if (strcmp(((struct blob_job *) i->data)->path, path) == 0)
+			found = (struct blob_job *) i->data;
+	/**being written, the last job for the path counts  */
+	for (i = found ? NULL : running_jobs; i != NULL; i = i->next)
+		if (strcmp(((struct blob_job *) i->data)->path, path) == 0)
+			found = (struct blob_job *) i->data;
+	if (found) {
+		data = shared_text_ref(found->data);
+		source = g_strdup(found->source);
+	}
+	g_mutex_unlock(writer_lock);
+
+	/**a received text is read where it is; if it has been moved since, the
+	   caller finds it in place  */
+	if (source) {
+		gchar * text;
+		gsize len;
+		if (g_file_get_contents(source, &text, &len, NULL))
+			data = shared_text_take(text, len);
+		g_free(source);
+	}
+	return data;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE while a queued snapshot may still read item texts.
+****************************************************************************/
+gboolean history_writer_snapshot_pending(void)
+{
+	return snapshots_outstanding > 0 && writer_thread;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE if a write failed since the last call; the journal on disk
+must then be replaced by a snapshot.
+****************************************************************************/
+gboolean history_writer_take_failure(void)
+{
+	gboolean result;
+	g_mutex_lock(writer_lock);
+	result = failed;
+	failed = FALSE;
+	g_mutex_unlock(writer_lock);
+	return result;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void history_writer_print_stats(GString *s)
+{
+	g_mutex_lock(writer_lock);
+	g_string_append_printf(s,
+		_("History changes: %u\n"
+		  "History writes: %u, writes avoided: %u\n"
+		  "History snapshots: %u\n"
+		  "History bytes written: %" G_GUINT64_FORMAT "\n"
+		  "Writer lag: %.1f ms (max %.1f ms)\n"
+		  "Changes waiting to be written: %u\n"
+		  "Blobs written: %u, removed: %u\n"),
+		stats.changes,
+		stats.writes, stats.avoided,
+		stats.snapshots,
+		stats.bytes,
+		stats.lag_last / 1000.0, stats.lag_max / 1000.0,
+		pending_records,
+		stats.blobs_written, stats.blobs_removed);
+	g_mutex_unlock(writer_lock);
+}
@@ -0,0 +1,56 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISTORY_WRITER_H
+#define HISTORY_WRITER_H
+
+G_BEGIN_DECLS
+
+/**values of the history_durability preference  */
+#define HISTORY_DURABILITY_EVERY_CHANGE 1 /**write and sync each change right away  */
+#define HISTORY_DURABILITY_PERIODIC     2 /**merge the changes made within history_write_delay  */
+#define HISTORY_DURABILITY_ON_EXIT      3 /**keep the changes in memory until exit  */
+
+void history_writer_init(void);
+
+void history_writer_shutdown(void);
+
+void history_writer_append(guint16 op, const struct history_item *c);
+
+guint64 history_writer_snapshot(void);
+
+void history_writer_set_dict(struct history_dict *dict);
+
+gboolean history_writer_snapshot_pending(void);
+
+void history_writer_put_blob(gchar *path, struct shared_text *data);
+
+void history_writer_move_blob(gchar *source, gchar *path);
+
+void history_writer_delete_blob(gchar *path);
+
+struct shared_text *history_writer_find_blob(const gchar *path);
+
+gboolean history_writer_take_failure(void);
+
+void history_writer_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
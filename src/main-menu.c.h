@@ -62,12 +62,43 @@ static void on_clear_history_menu_item_activated(GtkMenuItem *menu_item, gpointe
 		remove_deleted_items(h); /**fix bug 92, Shift/ctrl right-click followed by clear segfaults/double free.  */	
 		clear_history();
 		/*g_printf("Clear hist done, h=%p, h->delete_list=%p\n",h, h->delete_list); */
-		update_clipboards(CLIPBOARD_ACTION_RESET, "");
+		update_clipboards(CLIPBOARD_ACTION_RESET, NULL);
 	}
 }
 
 /******************************************************************************/
 
+static void on_statistics_menu_item_activated(GtkMenuItem *menu_item, gpointer user_data)
+{
+	GString * s = g_string_new(NULL);
+	GtkWidget * dialog;
+
+	history_print_stats(s);
+	history_writer_print_stats(s);
+	history_compress_print_stats(s);
+	history_arena_print_stats(s);
+	clipboard_fetch_print_stats(s);
+	selection_receiver_print_stats(s);
+	selection_server_print_stats(s);
+	event_coalesce_print_stats(s);
+	capture_print_stats(s);
+	selection_settle_print_stats(s);
+	popup_latency_print_stats(s);
+
+	dialog = gtk_message_dialog_new(
+		NULL,
+		0,
+		GTK_MESSAGE_INFO,
+		GTK_BUTTONS_CLOSE,
+		"%s", s->str);
+	gtk_window_set_title((GtkWindow *) dialog, _("Rainbow CM Statistics"));
+	gtk_dialog_run((GtkDialog *) dialog);
+	gtk_widget_destroy(dialog);
+	g_string_free(s, TRUE);
+}
+
+/******************************************************************************/
+
 static void on_enabled_menu_item_toggled(GtkCheckMenuItem * menu_item, gpointer user_data)
 {
 	set_pref_int32("enabled", gtk_check_menu_item_get_active(menu_item));
@@ -158,6 +189,11 @@ static GtkWidget * create_main_menu(void)
 		NULL,
 		(GCallback) on_preferences_menu_item_activated);
 
+	add_menu_item(menu,
+		_("S_tatistics"),
+		_("Show the performance counters of the clipboard history."),
+		(GCallback) on_statistics_menu_item_activated);
+
 	add_menu_item(menu,
 		_("_About"),
 		NULL,
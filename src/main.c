@@ -46,9 +46,54 @@
 
 static GtkClipboard * selection_primary;
 static GtkClipboard * selection_clipboard;
-static gchar * text_primary = NULL;
-static gchar * text_clipboard = NULL;
-static gchar * last_text = NULL; /**last text change, for either clipboard  */
+static struct shared_text * text_primary = NULL;
+static struct shared_text * text_clipboard = NULL;
+static struct shared_text * last_text = NULL; /**last text change, for either clipboard  */
+static struct clipboard_fetch * fetch_primary = NULL;
+static struct clipboard_fetch * fetch_clipboard = NULL;
+static struct selection_server * serve_primary = NULL;
+static struct selection_server * serve_clipboard = NULL;
+static struct event_coalesce * coalesce_primary = NULL;
+static struct event_coalesce * coalesce_clipboard = NULL;
+
+/**
+ The owner-change signals come from XFixesSelectionNotify. The owner window
+ and the time it acquired the selection identify the contents: as long as
+ both stay the same, so do the contents, and there is nothing to fetch.
+*/
+struct selection_owner {
+	GdkNativeWindow owner; /**0 if the selection has none  */
+	guint32 time;          /**selection timestamp of the owner  */
+	gboolean changed;      /**the change wasn't fetched yet  */
+	guint sets;            /**our changes of the selection, whose owner-change hasn't come yet  */
+};
+static struct selection_owner owner_primary;
+static struct selection_owner owner_clipboard;
+
+/**
+ Capture runs in stages, each of which may drop the event:
+   owner    - the same owner and timestamp as last time
+   coalesce - merged into a burst of changes, see event_coalesce.c
+   fetch    - the check of a selection, up to the reply of its owner
+   filter   - invalid or whitespace-only text
+   change   - the same contents as saved already
+   commit   - save the contents and add them to the history
+ Only a commit touches the history and the history file.
+*/
+struct capture_stats {
+	guint events;     /**owner-change signals  */
+	guint same_owner; /**signals that didn't change the owner  */
+	guint own;        /**signals for our own changes  */
+	guint checks;     /**fetches started  */
+	guint skipped;    /**checks dropped before the fetch: disabled, selection in progress  */
+	guint replies;    /**fetches completed  */
+	guint no_text;    /**replies without text  */
+	guint restored;   /**empty selections restored  */
+	guint filtered;
+	guint unchanged;
+	guint committed;
+};
+static struct capture_stats capture_stats;
 
 
 static GtkStatusIcon *status_icon=NULL; 
@@ -64,6 +109,7 @@ typedef enum {
 
 static void schedule_deferred_clipboard_update(void);
 static void disable_deferred_clipboard_update(void);
+static void update_clipboards(CLIPBOARD_ACTION action, struct shared_text * text_to_set);
 
 /******************************************************************************/
 
@@ -111,9 +157,34 @@ static gboolean should_text_be_saved(gchar * text)
 
 /******************************************************************************/
 
-static void save_and_set_clipboard_text(GtkClipboard * clip, gchar * text, int really_set)
+/**
+ gtk_clipboard_set_text() keeps a copy of the text for as long as we own the
+ selection, and copies it again for each paste. The selection server holds a
+ reference to the shared text instead, and writes each paste from it.
+*/
+static void set_clipboard_text(GtkClipboard * clip, struct shared_text * text)
+{
+	if (!text || !text->len) {
+		gtk_clipboard_set_text(clip, "", 0);
+		return;
+	}
+	selection_server_set(clip == selection_primary ? serve_primary : serve_clipboard, text);
+}
+
+/******************************************************************************/
+
+static void save_and_set_clipboard_text(GtkClipboard * clip, struct shared_text * text, int really_set)
 {
-	gchar ** p_saved_text;
+	struct shared_text ** p_saved_text;
+	struct shared_text * full = NULL;
+
+	/**a capture received into the blob store is read back to be served  */
+	if (really_set && text && text->blob_len) {
+		if (!(full = history_blob_read(text->hash, text->blob_len)))
+			return;
+		full->hash = text->hash;
+		text = full;
+	}
 
 	if (clip==selection_primary) {
 		p_saved_text = &text_primary;
@@ -121,48 +192,31 @@ static void save_and_set_clipboard_text(GtkClipboard * clip, gchar * text, int r
 		p_saved_text = &text_clipboard;
 	}
 
-	if (really_set)
-		gtk_clipboard_set_text(clip, text ? text : "", -1);
+	if (really_set) {
+		/**the owner-change that follows is recognized as ours; a fetch
+		   in flight would bring back the contents we replace  */
+		(clip == selection_primary ? &owner_primary : &owner_clipboard)->sets++;
+		clipboard_fetch_cancel(clip == selection_primary ? fetch_primary : fetch_clipboard);
+		set_clipboard_text(clip, text);
+	}
 
 	if (*p_saved_text != text)
 	{
-		if (*p_saved_text) {
-			g_free(*p_saved_text);
-			*p_saved_text = NULL;
-		}
-
-		if (text)
-			*p_saved_text = g_strdup(text);
+		/**the same buffer is kept by both clipboards and the history  */
+		shared_text_unref(*p_saved_text);
+		*p_saved_text = shared_text_ref(text);
 	}
 
 	last_text = *p_saved_text;
+	shared_text_unref(full);
 }
 
-/******************************************************************************/
-
-static gboolean content_exists(GtkClipboard *clip)
-{
-	gint count;
-	GdkAtom *targets;
-	gboolean contents = gtk_clipboard_wait_for_targets(clip, &targets, &count);
-	g_free(targets);
-	return contents;
-}
-
-/******************************************************************************/
-
-static gchar * get_clipboard_text(GtkClipboard * clip)
-{
-	if (gtk_clipboard_wait_is_text_available(clip))
-		return(gtk_clipboard_wait_for_text(clip));
-	return NULL;
-}
 
 /******************************************************************************/
 
-static gchar * update_clipboard(GtkClipboard * clipboard, CLIPBOARD_ACTION action, gchar * text_to_set)
+static struct shared_text * update_clipboard(GtkClipboard * clipboard, CLIPBOARD_ACTION action, struct shared_text * text_to_set)
 {
-	gchar ** p_saved_text;
+	struct shared_text ** p_saved_text;
 
 	if (clipboard == selection_primary) {
 		p_saved_text = &text_primary;
@@ -185,8 +239,10 @@ static gchar * update_clipboard(GtkClipboard * clipboard, CLIPBOARD_ACTION actio
 		}
 		case CLIPBOARD_ACTION_SET:
 		{
-			if (g_strcmp0(text_to_set, *p_saved_text) != 0)
+			if (!shared_text_equal(text_to_set, *p_saved_text)) {
 				save_and_set_clipboard_text(clipboard, text_to_set, 1);
+				history_add_text_item(text_to_set, 0);
+			}
 			break;
 		}
 		case CLIPBOARD_ACTION_CHECK:
@@ -194,64 +250,139 @@ static gchar * update_clipboard(GtkClipboard * clipboard, CLIPBOARD_ACTION actio
 			if (!clipboard_management_enabled)
 			{
 				disable_deferred_clipboard_update();
+				capture_stats.skipped++;
 				break;
 			}
 
 			if (clipboard == selection_primary)
 			{
 				/* HACK: don't spam the history with useless records when text selection is in progress */
-				GdkModifierType button_state;
-				gdk_window_get_pointer(NULL, NULL, NULL, &button_state);
-				if (button_state & (GDK_BUTTON1_MASK|GDK_SHIFT_MASK)) { /* button down, done. */
-					schedule_deferred_clipboard_update();
+				gboolean held;
+				if (!selection_settle_held(&held)) {
+					/**a round trip, when the state isn't followed  */
+					GdkModifierType button_state;
+					gdk_window_get_pointer(NULL, NULL, NULL, &button_state);
+					held = (button_state & (GDK_BUTTON1_MASK|GDK_SHIFT_MASK)) != 0;
+				}
+				if (held) { /* button down, done. */
+					if (!selection_settle_wait())
+						schedule_deferred_clipboard_update();
+					capture_stats.skipped++;
 					break;
 				} else {
+					selection_settle_cancel();
 					disable_deferred_clipboard_update();
 				}
 			}
 
-			gchar * new_text = get_clipboard_text(clipboard);
-			if (new_text) {
-				if (validate_utf8_text(new_text, strlen(new_text)) == 0) {
-					g_free(new_text);
-					break;
-				}
-			}
+			/**the rest is done by on_clipboard_received()  */
+			clipboard_fetch_start(clipboard == selection_primary ? fetch_primary : fetch_clipboard,
+				restore_empty && *p_saved_text);
+			(clipboard == selection_primary ? &owner_primary : &owner_clipboard)->changed = FALSE;
+			capture_stats.checks++;
+			break;
+		}
+	}
 
-			if (!new_text) {
-				if (restore_empty && !content_exists(clipboard) && *p_saved_text)
-					save_and_set_clipboard_text(clipboard, *p_saved_text, 1);
-				break;
-			}
+	return *p_saved_text;
+}
 
-			if (g_strcmp0(*p_saved_text, new_text) == 0)
-			{
-				g_free(new_text);
-				break;
-			}
+/******************************************************************************/
 
-			if (!should_text_be_saved(new_text))
-			{
-				g_free(new_text);
-				break;
+static void synchronize_clipboards(void)
+{
+	if (clipboard_management_enabled &&
+		synchronize &&
+		track_primary_selection &&
+		track_clipboard_selection)
+	{
+		/**the other one is checked once its fetch completes  */
+		if (clipboard_fetch_busy(fetch_primary) || clipboard_fetch_busy(fetch_clipboard))
+			return;
+		if (text_primary || text_clipboard) {
+			struct shared_text * last = last_text;
+			if (last && !shared_text_equal(text_primary, text_clipboard)) {
+				/**last_text is replaced by the update  */
+				shared_text_ref(last);
+				update_clipboards(CLIPBOARD_ACTION_SET, last);
+				shared_text_unref(last);
 			}
+		}
+	}
+}
 
-			save_and_set_clipboard_text(clipboard, new_text, 0);
+/******************************************************************************/
 
-			g_free(new_text);
-			break;
+/**capture filter stage  */
+static struct shared_text * capture_filter(struct shared_text * received)
+{
+	/**only the preview of a text in the blob store is looked at  */
+	if (0 == received->len || !should_text_be_saved(received->str)) {
+		shared_text_unref(received);
+		capture_stats.filtered++;
+		return NULL;
+	}
+	/**the received text becomes the shared one, it isn't copied  */
+	return received;
+}
+
+/******************************************************************************/
+
+/**completes CLIPBOARD_ACTION_CHECK once the selection owner has replied  */
+static void on_clipboard_received(GtkClipboard * clipboard, struct shared_text * received, gboolean empty, gpointer user_data)
+{
+	struct shared_text ** p_saved_text = (clipboard == selection_primary) ? &text_primary : &text_clipboard;
+	struct shared_text * new_text;
+
+	capture_stats.replies++;
+	if (!received) {
+		capture_stats.no_text++;
+		if (restore_empty && empty && *p_saved_text) {
+			save_and_set_clipboard_text(clipboard, *p_saved_text, 1);
+			capture_stats.restored++;
 		}
+		goto done;
 	}
 
-	if (last_text)
-		history_add_text_item(last_text, 0);
+	new_text = capture_filter(received);
+	if (!new_text)
+		goto done;
 
-	return *p_saved_text;
+	/* change detection */
+	if (shared_text_equal(*p_saved_text, new_text)) {
+		shared_text_unref(new_text);
+		capture_stats.unchanged++;
+		goto done;
+	}
+
+	/* commit */
+	save_and_set_clipboard_text(clipboard, new_text, 0);
+	history_add_text_item(new_text, 0);
+	shared_text_unref(new_text);
+	capture_stats.committed++;
+
+done:
+	/**a commit of the other selection may have waited for this fetch  */
+	synchronize_clipboards();
+}
+
+/******************************************************************************/
+
+static void capture_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Owner changes: %u (same owner: %u, our own: %u)\n"
+		  "Clipboard checks: %u (skipped: %u), replies: %u, without text: %u (restored: %u)\n"
+		  "Captured texts: %u filtered out, %u unchanged, %u saved\n"),
+		capture_stats.events, capture_stats.same_owner, capture_stats.own,
+		capture_stats.checks, capture_stats.skipped, capture_stats.replies,
+		capture_stats.no_text, capture_stats.restored,
+		capture_stats.filtered, capture_stats.unchanged, capture_stats.committed);
 }
 
 /******************************************************************************/
 
-static void update_clipboards(CLIPBOARD_ACTION action, gchar * text_to_set)
+static void update_clipboards(CLIPBOARD_ACTION action, struct shared_text * text_to_set)
 {
 	/*g_printf("upclips\n"); */
 	update_clipboard(selection_primary, action, text_to_set);
@@ -262,23 +393,14 @@ static void update_clipboards(CLIPBOARD_ACTION action, gchar * text_to_set)
 
 static void check_clipboards(void)
 {
-	gchar * ptext = update_clipboard(selection_primary, CLIPBOARD_ACTION_CHECK, NULL);
-	gchar * ctext = update_clipboard(selection_clipboard, CLIPBOARD_ACTION_CHECK, NULL);
-
-	if (clipboard_management_enabled &&
-		synchronize &&
-		track_primary_selection &&
-		track_clipboard_selection)
-	{
-		if (ptext || ctext) {
-			gchar * last = last_text;
-			if (last && g_strcmp0(ptext, ctext) != 0) {
-				last = g_strdup(last);
-				update_clipboards(CLIPBOARD_ACTION_SET, last);
-				g_free(last);
-			}
-		}
-	}
+	/**the fetches complete in on_clipboard_received(); one still waiting for
+	   a slow owner is left alone, only an owner change supersedes it.
+	   The owner of PRIMARY may update the text while the button is down
+	   without taking the selection again, so it's checked regardless  */
+	if (!clipboard_fetch_busy(fetch_primary))
+		update_clipboard(selection_primary, CLIPBOARD_ACTION_CHECK, NULL);
+	if (!clipboard_fetch_busy(fetch_clipboard) && owner_clipboard.changed)
+		update_clipboard(selection_clipboard, CLIPBOARD_ACTION_CHECK, NULL);
 }
 
 /******************************************************************************/
@@ -310,20 +432,65 @@ static void disable_deferred_clipboard_update(void)
 
 static void on_clipboard_owner_change(GtkClipboard * clipboard, GdkEvent * event, gpointer user_data)
 {
-	check_clipboards();
+	struct selection_owner * o = (clipboard == selection_primary) ? &owner_primary : &owner_clipboard;
+	GdkEventOwnerChange * e = &event->owner_change;
+
+	capture_stats.events++;
+	if (e->owner && gdk_window_lookup(e->owner)) {
+		/**one of our windows; it isn't our text if a widget took the selection  */
+		if (o->sets) {
+			o->sets--;
+			o->owner = e->owner;
+			o->time = e->selection_time;
+			o->changed = FALSE;
+			capture_stats.own++;
+			return;
+		}
+	} else {
+		/**a change of ours that never took effect  */
+		o->sets = 0;
+	}
+
+	if (e->owner && e->owner == o->owner && e->selection_time == o->time && !o->changed) {
+		capture_stats.same_owner++;
+		return;
+	}
+	o->owner = e->owner;
+	o->time = e->selection_time;
+	o->changed = TRUE;
+
+	event_coalesce_push(clipboard == selection_primary ? coalesce_primary : coalesce_clipboard,
+		e->owner, get_pref_int32("coalesce_window"));
+}
+
+/**the owner changed, once per burst of changes  */
+static void on_owner_changes(gpointer data)
+{
+	/**a fetch of the previous contents is stale now  */
+	update_clipboard((GtkClipboard *) data, CLIPBOARD_ACTION_CHECK, NULL);
 }
 
 /******************************************************************************/
 
 #include "history-menu.c.h"
+#include "history-popup.c.h"
 #include "main-menu.c.h"
 
 /******************************************************************************/
 
+/**both the menu and the popup follow the history  */
+static void on_history_change(enum history_change change, const struct history_item * c)
+{
+	on_history_changed(change, c);
+	on_history_popup_changed(change, c);
+}
+
+/******************************************************************************/
+
 /* Called when status icon is left-clicked */
 static void status_icon_clicked(GtkStatusIcon *status_icon, gpointer user_data)
 {
-  show_history_menu(1, GDK_CURRENT_TIME);
+  show_history(1, GDK_CURRENT_TIME);
 }
 
 /******************************************************************************/
@@ -354,7 +521,8 @@ void update_status_icon(void)
 
 void on_history_hotkey(char *keystring, gpointer user_data)
 {
-	show_history_menu(0, GDK_CURRENT_TIME);
+	/**the X time of the key press, which the popup latency is measured from  */
+	show_history(0, keybinder_get_current_event_time());
 }
 
 void on_menu_hotkey(char *keystring, gpointer user_data)
@@ -369,13 +537,12 @@ void on_disable_cm_hotkey(char *keystring, gpointer user_data) { set_pref_int32(
 
 /******************************************************************************/
 
-void on_run_command_hotkey(char *keystring, gpointer user_data)
+static void run_command(GtkClipboard *clipboard, const gchar *text, gpointer user_data)
 {
 	gint argc = 0;
 	gchar **argv = NULL;
 	GError *error = NULL;
 
-	gchar * text = get_clipboard_text(selection_primary);
 	if (!text)
 		goto out;
 
@@ -421,8 +588,23 @@ out:
 		g_error_free(error);
 	if (argv)
 		g_strfreev(argv);
-	if (text)
-		g_free(text);
+}
+
+void on_run_command_hotkey(char *keystring, gpointer user_data)
+{
+	gtk_clipboard_request_text(selection_primary, run_command, NULL);
+}
+
+/******************************************************************************/
+
+/**puts the most recent item back into an empty selection  */
+static void restore_on_startup(GtkClipboard *clipboard, const gchar *text, gpointer user_data)
+{
+	if (!text && 0 != history_length()) {
+		struct shared_text * last = history_item_get_text(history_nth(0));
+		update_clipboard(clipboard, CLIPBOARD_ACTION_SET, last);
+		shared_text_unref(last);
+	}
 }
 
 /******************************************************************************/
@@ -433,26 +615,29 @@ static void application_init(void)
 	selection_primary = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
 	selection_clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
 
+	fetch_primary = clipboard_fetch_new(selection_primary, GDK_SELECTION_PRIMARY, on_clipboard_received, NULL);
+	fetch_clipboard = clipboard_fetch_new(selection_clipboard, GDK_SELECTION_CLIPBOARD, on_clipboard_received, NULL);
+	serve_primary = selection_server_new(GDK_SELECTION_PRIMARY);
+	serve_clipboard = selection_server_new(GDK_SELECTION_CLIPBOARD);
+	coalesce_primary = event_coalesce_new(on_owner_changes, selection_primary);
+	coalesce_clipboard = event_coalesce_new(on_owner_changes, selection_clipboard);
+	selection_settle_init(check_clipboards);
+
 	hist_lock= g_mutex_new();
+	history_writer_init();
+	history_set_change_func(on_history_change);
 
   /* Read history */
   if (get_pref_int32("save_history")){
-		gchar *x;
 		/*g_printf("Calling read_hist\n"); */
 		read_history();
-		if(NULL != history_list){
-			struct history_item *c;
-			c=(struct history_item *)(history_list->data);	
-			if (NULL == (x=get_clipboard_text(selection_primary)))
-				update_clipboard(selection_primary, CLIPBOARD_ACTION_SET, c->text);
-			else
-				g_free (x);
-			if (NULL == (x=get_clipboard_text(selection_clipboard)))
-				update_clipboard(selection_clipboard, CLIPBOARD_ACTION_SET, c->text);
-			else
-				g_free(x);
+		if(0 != history_length()){
+			gtk_clipboard_request_text(selection_primary, restore_on_startup, NULL);
+			gtk_clipboard_request_text(selection_clipboard, restore_on_startup, NULL);
 		}
 	}
+	history_collect_blobs();
+	prewarm_history();
 
 	g_signal_connect(selection_primary, "owner-change", (GCallback) on_clipboard_owner_change, NULL);
 	g_signal_connect(selection_clipboard, "owner-change", (GCallback) on_clipboard_owner_change, NULL);
@@ -473,6 +658,9 @@ int main(int argc, char *argv[])
 	bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
 	textdomain(GETTEXT_PACKAGE);
 
+#if !GLIB_CHECK_VERSION(2,32,0)
+	g_thread_init(NULL);
+#endif
 	gtk_init(&argc, &argv);
 
 	/**this just maps to the static struct, prefs do not need to be loaded  */
@@ -490,13 +678,15 @@ int main(int argc, char *argv[])
 	application_init();
 	gtk_main();
 
+	history_save_on_exit();
+	history_writer_shutdown();
+
 	unbind_keys();
 
 	/*
 	g_free(prefs.history_key);
 	g_free(prefs.menu_key);
 	*/
-	g_list_free(history_list);
 
 	return 0;
 }
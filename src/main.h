@@ -25,18 +25,21 @@ G_BEGIN_DECLS
 
 extern GMutex *hist_lock;
 
-#define POPUP_DELAY    100
+/**the popups are shown at once; while the hotkey still holds the keyboard
+ grab, they try again every POPUP_RETRY_DELAY ms, up to POPUP_RETRIES times  */
+#define POPUP_RETRY_DELAY 10
+#define POPUP_RETRIES     50
 
 struct widget_info{
 	GtkWidget *menu; /**top level history list window  */
 	GtkWidget *item; /**item we are looking at  */
 	GdkEventKey *event; /**event info where we filled this struct  */
-	gint index;      /**index into the array  */
+	guint64 id;      /**id of the history item  */
 };
-/**keeps track of each menu item and the element it's created from.  */
+/**keeps track of each menu item and the history item it's created from.  */
 struct s_item_info {
 	GtkWidget *item;
-	GList *element;
+	guint64 id;  /**id of the history item  */
 };
 
 struct history_info{
@@ -44,7 +47,6 @@ struct history_info{
 	GList *delete_list; /**struct s_item_info - for the delete list  */
 	GList *persist_list; /**struct s_item_info - for the persistent list  */
 	struct widget_info wi;  /**temp  for usage in popups  */
-	gint change_flag;	/**bit wise flags for history state  */
 	GtkIMContext * im_context;
 	GString * search_string;
 	gchar * search_string_casefold;
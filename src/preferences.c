@@ -21,7 +21,7 @@
 #include "rainbow-cm.h"
 #include <sys/wait.h>
 
-#define MAX_HISTORY 1000
+#define MAX_HISTORY 100000
 
 #define INIT_HISTORY_KEY      NULL
 #define INIT_MENU_KEY         NULL
@@ -32,6 +32,15 @@
 #define DEF_ITEM_LENGTH       50
 #define DEF_ITEM_LENGTH_MAX   200
 #define DEF_ELLIPSIZE         2
+#define DEF_COALESCE_WINDOW   100
+#define DEF_CAPTURE_LIMIT     0
+#define MAX_CAPTURE_LIMIT     (1024 * 1024)
+#define DEF_HISTORY_DURABILITY HISTORY_DURABILITY_PERIODIC
+#define DEF_HISTORY_WRITE_DELAY 1000
+#define MAX_HISTORY_WRITE_DELAY 60000
+#define DEF_BLOB_THRESHOLD    64
+#define MAX_BLOB_THRESHOLD    (1024 * 1024)
+#define DEF_COMPRESS_HISTORY  FALSE
 #define DEF_HISTORY_KEY       "<Mod4>Insert"
 #define DEF_MENU_KEY          "<Mod4><Ctrl>Insert"
 #define DEF_ENABLE_CM_KEY     "<Mod4>plus"
@@ -72,6 +81,10 @@ struct myadj align_hist_y={1,100,1,10};
 struct myadj align_data_lim={0,1000000,1,10};
 struct myadj align_hist_lim={5, MAX_HISTORY, 1, 10};
 struct myadj align_line_lim={5, DEF_ITEM_LENGTH_MAX, 1, 5};
+struct myadj align_coalesce_window={0, EVENT_COALESCE_MAX_WINDOW, 10, 100};
+struct myadj align_capture_limit={0, MAX_CAPTURE_LIMIT, 1024, 16384};
+struct myadj align_write_delay={0, MAX_HISTORY_WRITE_DELAY, 100, 1000};
+struct myadj align_blob_threshold={1, MAX_BLOB_THRESHOLD, 16, 256};
 
 static const char * ellipsize_values[] = {
 	N_("beginning"),
@@ -80,6 +93,13 @@ static const char * ellipsize_values[] = {
 	NULL
 };
 
+static const char * durability_values[] = {
+	N_("on every change"),
+	N_("periodically"),
+	N_("on exit only"),
+	NULL
+};
+
 struct pref_item {
 	gchar *name;      /** name/id to find pref  */
 	gint32 val;       /** int/bool value*/
@@ -139,13 +159,52 @@ static struct pref_item myprefs[]={
 	.desc=N_("Restore the contents of the e_mpty clipboard."),
 	.tooltip=N_("Restore the contents of the clipboard when it gets empty.\n\nThe clipboard typically gets empty when an application that has held the clipboard contents is closed."),
 	.val=1},
+	{.adj=&align_coalesce_window,.section=PREF_SECTION_CLIP,
+	 .name="coalesce_window",.type=PREF_TYPE_SPIN,
+	 .desc=N_("Merge the clipboard changes made within {{}} ms"),
+	 .tooltip=N_("Some applications set the clipboard many times a second. The changes made within this interval are read once, and an application that keeps on is read less and less often, up to every two seconds.\n\n0 reads every change."),
+	 .val=DEF_COALESCE_WINDOW},
 
 	{.section=PREF_SECTION_HISTORY,.type=PREF_TYPE_FRAME,.desc=N_("<b>History</b>")},
 	{.section=PREF_SECTION_HISTORY,.name="save_history",.type=PREF_TYPE_TOGGLE,.desc=N_("Sa_ve history across sessions"),.tooltip=N_("Keep history in a file across sessions."),.val=DEF_SAVE_HISTORY},
 	{.adj=&align_hist_lim,.section=PREF_SECTION_HISTORY,.name="history_limit",.type=PREF_TYPE_SPIN,.desc=N_("History limit: {{}} entries"),.tooltip=N_("Maximum number of clipboard entries to keep"),.val=DEF_HISTORY_LIMIT},
+	{.section=PREF_SECTION_HISTORY,
+	 .name="history_durability",.type=PREF_TYPE_COMBO,
+	 .desc=N_("Write the history to disk {{}}"),
+	 .tooltip=N_("When the changes of the history are written to the history file.\n\n"
+	  "On every change: each change is written and flushed to disk right away.\n"
+	  "Periodically: the changes are written in batches, a crash may lose the last few of them.\n"
+	  "On exit only: the file is written when Rainbow CM quits."),
+	 .val=DEF_HISTORY_DURABILITY,
+	 .combo_values=durability_values},
+	{.adj=&align_write_delay,.section=PREF_SECTION_HISTORY,
+	 .name="history_write_delay",.type=PREF_TYPE_SPIN,
+	 .desc=N_("Merge the changes made within {{}} ms"),
+	 .tooltip=N_("The changes made within this interval are written to disk at once (periodic mode only)."),
+	 .val=DEF_HISTORY_WRITE_DELAY},
+	{.adj=&align_blob_threshold,.section=PREF_SECTION_HISTORY,
+	 .name="blob_threshold",.type=PREF_TYPE_SPIN,
+	 .desc=N_("Store the items larger than {{}} KB in separate files"),
+	 .tooltip=N_("The text of a large item is kept in a file of its own, shared by the items with the same content. The history keeps only the beginning of the text, which keeps the history file small and fast to save."),
+	 .val=DEF_BLOB_THRESHOLD},
+	{.section=PREF_SECTION_HISTORY,
+	 .name="compress_history",.type=PREF_TYPE_TOGGLE,
+	 .desc=N_("Co_mpress the history file"),
+	 .tooltip=N_("The texts are compressed with a dictionary made of the recent history, which suits short items. A compressed item is decompressed when it is first shown or pasted.\n\nRequires Rainbow CM to be built with zlib."),
+	 .val=DEF_COMPRESS_HISTORY},
 
 	{.section=PREF_SECTION_FILTERING,.type=PREF_TYPE_FRAME,.desc=N_("<b>Filtering</b>")},
 	{.section=PREF_SECTION_FILTERING,.name="ignore_whiteonly",.type=PREF_TYPE_TOGGLE,.desc=N_("Ignore whitespace strings"),.tooltip=N_("Ignore any clipboard data that contain only whitespace characters (space, tab, new line etc).")},
+	{.adj=&align_capture_limit,.section=PREF_SECTION_FILTERING,
+	 .name="capture_limit",.type=PREF_TYPE_SPIN,
+	 .desc=N_("Ignore the clipboard data larger than {{}} KB"),
+	 .tooltip=N_("Applications that tell the size of their clipboard data are not even read from when the data is too large. The data of the others is dropped once received.\n\n0 sets no limit."),
+	 .val=DEF_CAPTURE_LIMIT},
+	{.section=PREF_SECTION_FILTERING,
+	 .name="capture_truncate",.type=PREF_TYPE_TOGGLE,
+	 .desc=N_("_Keep the beginning of larger data"),
+	 .tooltip=N_("Instead of ignoring the clipboard data larger than the limit, keep as much of its beginning as the limit allows."),
+	 .val=FALSE},
 
 	{.section=PREF_SECTION_POPUP,.type=PREF_TYPE_FRAME,
 	 .desc=N_("<b>The History Popup Menu</b>"),
@@ -156,6 +215,12 @@ static struct pref_item myprefs[]={
 	 .desc=N_("Search _As You Type"),
 	 .tooltip=N_("Enables Instant Search in the History menu.\n\nType a word when the History menu is shown to see only the entries that contains this word.")
 	},
+	{.section=PREF_SECTION_POPUP,
+	 .name="history_popup",.type=PREF_TYPE_TOGGLE,
+	 .desc=N_("Show the History in a _scrolled list"),
+	 .tooltip=N_("Shows the History in a scrolled list instead of a menu. The list draws only the entries in view, so it opens at once even with a large history limit."),
+	 .val=FALSE
+	},
 	{.section=PREF_SECTION_POPUP,
 	 .name="display_nonprinting_characters",.type=PREF_TYPE_TOGGLE,
 	 .desc=N_("Display _non-printing characters"),
@@ -473,6 +538,26 @@ static void check_sanity(void)
 	if ((!x) || (x > 3) || (x < 0))
 		set_pref_int32("ellipsize",DEF_ELLIPSIZE);
 
+	x = get_pref_int32("coalesce_window");
+	if ((x < 0) || (x > EVENT_COALESCE_MAX_WINDOW))
+		set_pref_int32("coalesce_window",DEF_COALESCE_WINDOW);
+
+	x = get_pref_int32("capture_limit");
+	if ((x < 0) || (x > MAX_CAPTURE_LIMIT))
+		set_pref_int32("capture_limit",DEF_CAPTURE_LIMIT);
+
+	x = get_pref_int32("history_durability");
+	if ((x < HISTORY_DURABILITY_EVERY_CHANGE) || (x > HISTORY_DURABILITY_ON_EXIT))
+		set_pref_int32("history_durability",DEF_HISTORY_DURABILITY);
+
+	x = get_pref_int32("history_write_delay");
+	if ((x > MAX_HISTORY_WRITE_DELAY) || (x < 0))
+		set_pref_int32("history_write_delay",DEF_HISTORY_WRITE_DELAY);
+
+	x = get_pref_int32("blob_threshold");
+	if ((x < 1) || (x > MAX_BLOB_THRESHOLD))
+		set_pref_int32("blob_threshold",DEF_BLOB_THRESHOLD);
+
 	set_keys_from_prefs();
 }
 /* Apply the new preferences */
@@ -33,8 +33,19 @@
 
 #include "about.h"
 #include "utils.h"
+#include "shared_text.h"
+#include "clipboard_fetch.h"
+#include "event_coalesce.h"
 #include "preferences.h"
+#include "selection_settle.h"
+#include "crc32c.h"
 #include "history.h"
+#include "selection_receiver.h"
+#include "selection_server.h"
+#include "history_arena.h"
+#include "history_compress.h"
+#include "history_writer.h"
+#include "history_blob.h"
 #include "main.h"
 #include "keybinder.h"
 #include "i18n.h"
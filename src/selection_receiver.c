@@ -0,0 +1,607 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        selection_receiver.c
+\n\b Description: Receives the text of a selection piece by piece.
+
+GTK gathers the whole of a transfer before it hands anything over, and then
+converts it into yet another copy. This asks the owner for UTF8_STRING
+itself. A large text comes in as an INCR transfer: a series of chunks, each
+of which the owner writes to a property of our window once we've deleted
+the previous one. Each chunk is appended to the one buffer that becomes the
+shared text, and is validated as UTF-8 and hashed on the way. So the text is
+read only once, and the peak is the text and one chunk. The size the owner
+announces for an INCR transfer sizes the buffer up front (up to
+RECEIVER_PREALLOC_MAX, the owner may announce anything), and lets the
+history hash be computed as the chunks arrive.
+
+A text larger than the blob threshold isn't gathered at all: from the chunk
+that takes it past the threshold (or from the start, if the owner said so),
+the validated bytes are written to a file of the blob store, and only the
+preview the history keeps stays in memory, with the chunk being validated.
+The history moves the file into place when it takes the text.
+
+A transfer over the size limit is abandoned as soon as it's known to be.
+Each transfer uses the next of a few properties, so the chunks of a
+cancelled one can't be taken for those of its successor.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#define RECEIVER_PROPERTIES 4
+/**the most allocated on the word of the owner, the buffer grows past it only
+ with the data actually received  */
+#define RECEIVER_PREALLOC_MAX (1024 * 1024)
+/**bytes read at a time to hash a spilled text  */
+#define RECEIVER_READ_CHUNK (64 * 1024)
+
+enum receiver_state {
+	RECEIVER_IDLE,
+	RECEIVER_CONVERT,  /**waiting for SelectionNotify  */
+	RECEIVER_INCR,     /**waiting for the next chunk  */
+};
+
+struct selection_receiver {
+	selection_receiver_func func;
+	gpointer data;
+	GdkWindow *window;
+	Display *display;
+	Window xwindow;
+	Atom selection;
+	Atom properties[RECEIVER_PROPERTIES];
+	guint serial;          /**of the transfer, picks its property  */
+	enum receiver_state state;
+	gsize limit;           /**bytes, 0 if none  */
+	gboolean truncate;
+	gsize spill;           /**a larger text goes to the blob store, 0: never  */
+	gchar *buf;
+	gsize len;
+	gsize alloc;
+	gsize valid;           /**the bytes validated as UTF-8, and hashed  */
+	FILE *file;            /**of the blob store, once the text is spilled  */
+	gchar *path;
+	gsize preview;         /**spilled: the bytes at the beginning of the buffer
+	                          that are kept, the rest is the chunk  */
+	gboolean cut;          /**the rest of the transfer is dropped  */
+	gboolean truncated;    /**at the limit  */
+	gboolean hashing;      /**the size was known, see hash  */
+	struct text_hash_state hash;
+	gint64 activity;       /**monotonic time of the last event of the transfer  */
+};
+
+struct receiver_stats {
+	guint transfers;
+	guint incr;        /**of them INCR ones  */
+	guint chunks;
+	guint refused;
+	guint64 bytes;
+	gsize chunk_max;
+	gsize text_max;
+};
+
+static struct receiver_stats stats;
+
+static Atom atom_utf8;
+static Atom atom_incr;
+
+static GdkFilterReturn receiver_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data);
+
+/***************************************************************************/
+/** Creates the window the owner writes the selection to.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct selection_receiver *selection_receiver_new(GdkAtom selection, selection_receiver_func func, gpointer data)
+{
+	struct selection_receiver *r = g_new0(struct selection_receiver, 1);
+	GdkWindowAttr attributes = {0};
+	gchar *name = gdk_atom_name(selection);
+	guint i;
+
+	attributes.window_type = GDK_WINDOW_TEMP;
+	attributes.wclass = GDK_INPUT_ONLY;
+	attributes.x = attributes.y = -100;
+	attributes.width = attributes.height = 10;
+	attributes.override_redirect = TRUE;
+	attributes.event_mask = GDK_PROPERTY_CHANGE_MASK;
+	r->window = gdk_window_new(NULL, &attributes, GDK_WA_X | GDK_WA_Y | GDK_WA_NOREDIR);
+	r->display = GDK_WINDOW_XDISPLAY(r->window);
+	r->xwindow = GDK_WINDOW_XID(r->window);
+	r->selection = gdk_x11_atom_to_xatom(selection);
+	for (i = 0; i < RECEIVER_PROPERTIES; i++) {
+		gchar *property = g_strdup_printf("RAINBOW_CM_%s_%u", name, i);
+		r->properties[i] = XInternAtom(r->display, property, False);
+		g_free(property);
+	}
+	g_free(name);
+
+	if (!atom_utf8) {
+		atom_utf8 = XInternAtom(r->display, "UTF8_STRING", False);
+		atom_incr = XInternAtom(r->display, "INCR", False);
+	}
+	r->func = func;
+	r->data = data;
+	gdk_window_add_filter(r->window, receiver_filter, r);
+	return r;
+}
+
+/***************************************************************************/
+/** Drops the text received so far.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void receiver_reset(struct selection_receiver *r)
+{
+	g_free(r->buf);
+	r->buf = NULL;
+	r->len = r->alloc = r->valid = r->preview = 0;
+	if (r->file) {
+		fclose(r->file);
+		unlink(r->path);
+		g_free(r->path);
+		r->file = NULL;
+		r->path = NULL;
+	}
+	r->cut = r->truncated = r->hashing = FALSE;
+	r->state = RECEIVER_IDLE;
+}
+
+/***************************************************************************/
+/** Asks the owner for the text. A transfer in flight is abandoned.
+\n\b Arguments:	limit - in bytes, 0 if none; truncate - keep the beginning
+of a larger text; spill - in bytes, a larger text is received into the blob
+store, 0 if none is.
+\n\b Returns:
+****************************************************************************/
+void selection_receiver_start(struct selection_receiver *r, gsize limit, gboolean truncate, gsize spill)
+{
+	Atom property;
+
+	selection_receiver_cancel(r);
+	r->serial++;
+	property = r->properties[r->serial % RECEIVER_PROPERTIES];
+	r->limit = limit;
+	r->truncate = truncate;
+	r->spill = spill;
+	r->state = RECEIVER_CONVERT;
+	r->activity = g_get_monotonic_time();
+	stats.transfers++;
+
+	XDeleteProperty(r->display, r->xwindow, property);
+	XConvertSelection(r->display, r->selection, atom_utf8, property, r->xwindow, CurrentTime);
+	XFlush(r->display);
+}
+
+/***************************************************************************/
+/** The callback isn't called.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_receiver_cancel(struct selection_receiver *r)
+{
+	if (RECEIVER_IDLE == r->state)
+		return;
+	/**the owner of an INCR transfer waits for the deletion and times out  */
+	receiver_reset(r);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	the monotonic time of the last progress of the transfer.
+****************************************************************************/
+gint64 selection_receiver_activity(const struct selection_receiver *r)
+{
+	return r->activity;
+}
+
+/***************************************************************************/
+/** Hashes the text in the file, for a spilled one whose size wasn't told.
+\n\b Arguments:
+\n\b Returns:	the hash, or 0 if the file can't be read back.
+****************************************************************************/
+static guint64 receiver_hash_file(struct selection_receiver *r)
+{
+	struct text_hash_state hash;
+	gchar * chunk = g_malloc(RECEIVER_READ_CHUNK);
+	gsize n;
+
+	history_text_hash_begin(&hash, r->valid);
+	rewind(r->file);
+	while ((n = fread(chunk, 1, RECEIVER_READ_CHUNK, r->file)) > 0)
+		history_text_hash_update(&hash, chunk, n);
+	g_free(chunk);
+	return ferror(r->file) ? 0 : history_text_hash_end(&hash);
+}
+
+/***************************************************************************/
+/** Completes a text received into the blob store.
+\n\b Arguments:	hash - of the text, 0 if it has to be computed.
+\n\b Returns:	the preview, which takes the file, or NULL if the file
+couldn't be written.
+****************************************************************************/
+static struct shared_text *receiver_spilled_text(struct selection_receiver *r, guint64 hash)
+{
+	struct shared_text * text;
+	gboolean ok = fflush(r->file) == 0;
+
+	if (ok && !hash)
+		ok = (hash = receiver_hash_file(r)) != 0;
+	if (fclose(r->file) != 0)
+		ok = FALSE;
+	r->file = NULL;
+	if (!ok) {
+		g_fprintf(stderr, "Unable to write blob '%s'\n", r->path);
+		unlink(r->path);
+		g_free(r->path);
+		r->path = NULL;
+		return NULL;
+	}
+
+	r->buf = g_realloc(r->buf, r->preview + 1);
+	r->buf[r->preview] = 0;
+	text = shared_text_take(r->buf, r->preview);
+	r->buf = NULL;
+	text->hash = hash;
+	text->blob_len = r->valid;
+	text->spill = r->path;
+	r->path = NULL;
+	return text;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void receiver_finish(struct selection_receiver *r, enum selection_receive_result result)
+{
+	struct shared_text *text = NULL;
+
+	if (SELECTION_RECEIVED == result || SELECTION_TRUNCATED == result) {
+		guint64 hash = r->hashing ? history_text_hash_end(&r->hash) : 0;
+
+		if (r->valid < r->len && !r->truncated)
+			g_fprintf(stderr, "Truncating invalid utf8 text entry at %" G_GSIZE_FORMAT " bytes\n", r->valid);
+		stats.text_max = MAX(stats.text_max, r->valid);
+		if (r->file) {
+			if (!(text = receiver_spilled_text(r, hash)))
+				result = SELECTION_FAILED;
+		} else {
+			/**an incomplete character at the end is dropped too  */
+			r->len = r->valid;
+			if (!r->buf)
+				r->buf = g_malloc(1);
+			else if (r->alloc > r->len + 1 + r->len / 8)
+				r->buf = g_realloc(r->buf, r->len + 1);
+			r->buf[r->len] = 0;
+
+			text = shared_text_take(r->buf, r->len);
+			/**0 unless the text is the announced length  */
+			text->hash = hash;
+			r->buf = NULL;
+		}
+	} else if (SELECTION_REFUSED == result)
+		stats.refused++;
+
+	receiver_reset(r);
+	r->func(text, result, r->data);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	TRUE if the bytes are the beginning of a UTF-8 sequence.
+****************************************************************************/
+static gboolean utf8_incomplete(const guchar *p, gsize n)
+{
+	gsize need, i;
+
+	if (p[0] >= 0xF0)
+		need = 4;
+	else if (p[0] >= 0xE0)
+		need = 3;
+	else if (p[0] >= 0xC0)
+		need = 2;
+	else
+		return FALSE;
+	if (n >= need)
+		return FALSE;
+	for (i = 1; i < n; i++)
+		if ((p[i] & 0xC0) != 0x80)
+			return FALSE;
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Starts writing the text to the blob store: the bytes validated so far go
+to the file, and the buffer keeps the preview and the incomplete character
+at the end, if any.
+\n\b Arguments:
+\n\b Returns:	FALSE if the file can't be written.
+****************************************************************************/
+static gboolean receiver_spill(struct selection_receiver *r)
+{
+	gsize preview = MIN(r->valid, HISTORY_BLOB_PREVIEW);
+
+	if (!(r->file = history_blob_create(&r->path)))
+		return FALSE;
+	if (r->valid && fwrite(r->buf, r->valid, 1, r->file) != 1) {
+		g_fprintf(stderr, "Unable to write blob '%s'\n", r->path);
+		return FALSE;
+	}
+	/**cut on a character boundary, as the history cuts a preview  */
+	while (preview > 0 && preview < r->valid && (r->buf[preview] & 0xC0) == 0x80)
+		preview--;
+	if (r->len > r->valid)
+		memmove(r->buf + preview, r->buf + r->valid, r->len - r->valid);
+	r->preview = preview;
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Appends a chunk, validates and hashes it. Once the text is spilled, the
+chunk is written to the file, and only the bytes that extend the preview
+are kept.
+\n\b Arguments:
+\n\b Returns:	SELECTION_RECEIVED to go on, SELECTION_TOO_LARGE if the
+transfer has to be abandoned for the size, SELECTION_FAILED if the buffer
+can't grow or the file can't be written.
+****************************************************************************/
+static enum selection_receive_result receiver_append(struct selection_receiver *r, const gchar *data, gsize n)
+{
+	const gchar *end;
+	gsize start, base, done;
+
+	stats.chunks++;
+	stats.bytes += n;
+	stats.chunk_max = MAX(stats.chunk_max, n);
+	r->activity = g_get_monotonic_time();
+	if (r->cut || !n)
+		return SELECTION_RECEIVED;
+
+	if (r->limit && r->len + n > r->limit) {
+		if (!r->truncate)
+			return SELECTION_TOO_LARGE;
+		n = r->limit - r->len;
+		r->cut = r->truncated = TRUE;
+	}
+	if (!r->file && r->spill && r->len + n > r->spill && !receiver_spill(r))
+		return SELECTION_FAILED;
+
+	/**the buffer holds the bytes not validated yet from start on, and the
+	   chunk goes after them  */
+	start = r->file ? r->preview : r->valid;
+	base = start + (r->len - r->valid);
+	if (base + n + 1 > r->alloc) {
+		gsize alloc = MAX(base + n + 1, r->file ? 0 : r->alloc * 2);
+		gchar *buf = g_try_realloc(r->buf, alloc);
+		if (!buf) {
+			g_fprintf(stderr, "Unable to allocate %" G_GSIZE_FORMAT " bytes for the selection text\n", alloc);
+			return SELECTION_FAILED;
+		}
+		r->buf = buf;
+		r->alloc = alloc;
+	}
+	memcpy(r->buf + base, data, n);
+	r->len += n;
+
+	/**from the first byte not validated yet: a character may span chunks  */
+	if (!g_utf8_validate(r->buf + start, base + n - start, &end)) {
+		gsize rest = base + n - (end - r->buf);
+		if (r->cut || !utf8_incomplete((const guchar *) end, rest))
+			r->cut = TRUE;
+	}
+	done = end - (r->buf + start);
+	if (r->hashing)
+		history_text_hash_update(&r->hash, r->buf + start, done);
+
+	if (r->file) {
+		gsize keep = 0;
+		if (done && fwrite(r->buf + start, done, 1, r->file) != 1) {
+			g_fprintf(stderr, "Unable to write blob '%s'\n", r->path);
+			return SELECTION_FAILED;
+		}
+		/**the preview grows as long as it is the whole text so far  */
+		if (r->preview == r->valid) {
+			keep = MIN(done, HISTORY_BLOB_PREVIEW - r->preview);
+			while (keep > 0 && keep < done && (r->buf[start + keep] & 0xC0) == 0x80)
+				keep--;
+		}
+		r->preview += keep;
+		memmove(r->buf + r->preview, r->buf + start + done, base + n - start - done);
+	}
+	r->valid += done;
+	return SELECTION_RECEIVED;
+}
+
+/***************************************************************************/
+/** Reads the property and deletes it, which asks an INCR owner for more.
+\n\b Arguments:
+\n\b Returns:	FALSE if it couldn't be read.
+****************************************************************************/
+static gboolean receiver_read(struct selection_receiver *r, Atom property, Atom *type, gint *format,
+	guchar **data, gsize *n)
+{
+	gulong items, after;
+	int result;
+
+	gdk_error_trap_push();
+	result = XGetWindowProperty(r->display, r->xwindow, property, 0, G_MAXLONG / 4, True,
+		AnyPropertyType, type, format, &items, &after, data);
+	if (gdk_error_trap_pop() || result != Success)
+		return FALSE;
+	*n = items * (*format / 8);
+	if (32 == *format)
+		*n = items * sizeof(long);
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Sizes the buffer for the announced size, within RECEIVER_PREALLOC_MAX,
+and starts the hash with it. If the memory can't be had, the buffer grows
+with the chunks instead. A text for the blob store is spilled right away.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void receiver_expect(struct selection_receiver *r, gsize size)
+{
+	gsize alloc;
+
+	if (!size || (r->limit && size > r->limit))
+		return;
+	r->hashing = TRUE;
+	history_text_hash_begin(&r->hash, size);
+	if (r->spill && size > r->spill && receiver_spill(r))
+		return;
+	alloc = MIN(size, RECEIVER_PREALLOC_MAX) + 1;
+	if ((r->buf = g_try_malloc(alloc)))
+		r->alloc = alloc;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_selection_notify(struct selection_receiver *r, const XSelectionEvent *e)
+{
+	Atom type;
+	gint format;
+	guchar *data = NULL;
+	gsize n;
+	enum selection_receive_result result;
+
+	if (None == e->property) {
+		receiver_finish(r, SELECTION_REFUSED);
+		return;
+	}
+	if (!receiver_read(r, e->property, &type, &format, &data, &n)) {
+		receiver_finish(r, SELECTION_FAILED);
+		return;
+	}
+
+	if (atom_incr == type) {
+		/**a lower bound of the size, usually the size  */
+		gsize size = n >= sizeof(long) ? (gsize) *(const long *) data : 0;
+		XFree(data);
+		stats.incr++;
+		if (r->limit && size > r->limit && !r->truncate) {
+			receiver_finish(r, SELECTION_TOO_LARGE);
+			return;
+		}
+		receiver_expect(r, size);
+		r->state = RECEIVER_INCR;
+		return;
+	}
+
+	if (8 != format) {
+		if (data)
+			XFree(data);
+		receiver_finish(r, SELECTION_REFUSED);
+		return;
+	}
+	receiver_expect(r, n);
+	result = receiver_append(r, (const gchar *) data, n);
+	XFree(data);
+	if (SELECTION_RECEIVED != result) {
+		receiver_finish(r, result);
+		return;
+	}
+	receiver_finish(r, r->truncated ? SELECTION_TRUNCATED : SELECTION_RECEIVED);
+}
+
+/***************************************************************************/
+/** The next chunk of an INCR transfer; an empty one ends it.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_property_notify(struct selection_receiver *r, const XPropertyEvent *e)
+{
+	Atom type;
+	gint format;
+	guchar *data = NULL;
+	gsize n;
+	enum selection_receive_result result;
+
+	if (!receiver_read(r, e->atom, &type, &format, &data, &n)) {
+		receiver_finish(r, SELECTION_FAILED);
+		return;
+	}
+	if (!n) {
+		if (data)
+			XFree(data);
+		receiver_finish(r, r->truncated ? SELECTION_TRUNCATED : SELECTION_RECEIVED);
+		return;
+	}
+	result = receiver_append(r, (const gchar *) data, n);
+	XFree(data);
+	if (SELECTION_RECEIVED != result)
+		receiver_finish(r, result);
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static GdkFilterReturn receiver_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data)
+{
+	struct selection_receiver *r = (struct selection_receiver *) data;
+	XEvent *xevent = (XEvent *) gdk_xevent;
+	Atom property = r->properties[r->serial % RECEIVER_PROPERTIES];
+
+	switch (xevent->type) {
+		case SelectionNotify:
+			if (xevent->xselection.requestor != r->xwindow)
+				return GDK_FILTER_CONTINUE;
+			/**the reply to an abandoned transfer names another property  */
+			if (RECEIVER_CONVERT == r->state && xevent->xselection.selection == r->selection &&
+				(None == xevent->xselection.property || property == xevent->xselection.property))
+				on_selection_notify(r, &xevent->xselection);
+			return GDK_FILTER_REMOVE;
+		case PropertyNotify:
+			if (xevent->xproperty.window != r->xwindow)
+				return GDK_FILTER_CONTINUE;
+			if (RECEIVER_INCR == r->state && property == xevent->xproperty.atom &&
+				PropertyNewValue == xevent->xproperty.state)
+				on_property_notify(r, &xevent->xproperty);
+			return GDK_FILTER_REMOVE;
+	}
+	return GDK_FILTER_CONTINUE;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_receiver_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Selection transfers: %u (INCR: %u), refused: %u, chunks: %u, %" G_GUINT64_FORMAT " KB, "
+		  "largest chunk: %" G_GSIZE_FORMAT " KB, largest text: %" G_GSIZE_FORMAT " KB\n"),
+		stats.transfers, stats.incr, stats.refused, stats.chunks, stats.bytes / 1024,
+		stats.chunk_max / 1024, stats.text_max / 1024);
+}
@@ -0,0 +1,51 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SELECTION_RECEIVER_H
+#define SELECTION_RECEIVER_H
+
+G_BEGIN_DECLS
+
+enum selection_receive_result {
+	SELECTION_RECEIVED,
+	SELECTION_TRUNCATED,  /**cut at the size limit  */
+	SELECTION_REFUSED,    /**no owner, or no UTF8_STRING  */
+	SELECTION_TOO_LARGE,
+	SELECTION_FAILED,
+};
+
+struct selection_receiver;
+
+/**called with the text (which the function takes) if it was received; a text
+ received into the blob store is its preview  */
+typedef void (*selection_receiver_func)(struct shared_text *text, enum selection_receive_result result, gpointer data);
+
+struct selection_receiver *selection_receiver_new(GdkAtom selection, selection_receiver_func func, gpointer data);
+
+void selection_receiver_start(struct selection_receiver *r, gsize limit, gboolean truncate, gsize spill);
+
+void selection_receiver_cancel(struct selection_receiver *r);
+
+gint64 selection_receiver_activity(const struct selection_receiver *r);
+
+void selection_receiver_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        selection_server.c
+\n\b Description: Answers pastes of a selection straight from the shared text.
+
+gtk_selection_data_set_text() copies the whole text for every paste, and GTK
+then hands the copy out in one piece or as an INCR transfer. This owns the
+selection with a window of its own and writes the reply from the shared text
+itself. A text of up to one chunk goes out in a single property; a larger one
+as an INCR transfer, the next chunk written each time the requestor deletes
+the previous one. Only a chunk of STRING, converted to Latin-1, is ever
+copied.
+
+The server holds a reference to the text until another owner takes the
+selection, and each INCR transfer one more until it's done, so a paste in
+flight outlives a change of the contents. A requestor that stops deleting
+the property is dropped after SERVER_INCR_TIMEOUT. A MULTIPLE request is
+answered pair by pair, as the single ones are.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+/**bytes of a property written at once, within what the server takes  */
+#define SERVER_CHUNK_MAX (256 * 1024)
+/**seconds an INCR transfer may go without the requestor deleting a chunk  */
+#define SERVER_INCR_TIMEOUT 5
+
+struct selection_server {
+	GdkWindow *window;
+	Display *display;
+	Window xwindow;
+	Atom selection;
+	struct shared_text *text;  /**NULL unless we own the selection  */
+	Time time;                 /**we got the selection at  */
+	gsize chunk;
+};
+
+/**an INCR transfer in flight  */
+struct server_transfer {
+	Display *display;
+	Window requestor;
+	Atom property;
+	Atom type;
+	struct shared_text *text;
+	gsize offset;
+	gboolean done;        /**the empty chunk that ends it is written  */
+	gsize chunk;
+	gint64 activity;      /**monotonic time of the last chunk  */
+	guint timeout;
+};
+
+struct server_stats {
+	guint requests;
+	guint refused;
+	guint incr;
+	guint chunks;
+	guint timeouts;
+	guint64 bytes;
+};
+
+static struct server_stats stats;
+
+static GSList *transfers;
+
+static Atom atom_utf8;
+static Atom atom_incr;
+static Atom atom_targets;
+static Atom atom_timestamp;
+static Atom atom_length;
+static Atom atom_text;
+static Atom atom_text_plain_utf8;
+static Atom atom_multiple;
+static Atom atom_atom_pair;
+
+static GdkFilterReturn server_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data);
+static GdkFilterReturn transfer_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data);
+
+/***************************************************************************/
+/** Creates the window that owns the selection.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct selection_server *selection_server_new(GdkAtom selection)
+{
+	struct selection_server *s = g_new0(struct selection_server, 1);
+	GdkWindowAttr attributes = {0};
+	glong max_request;
+
+	attributes.window_type = GDK_WINDOW_TEMP;
+	attributes.wclass = GDK_INPUT_ONLY;
+	attributes.x = attributes.y = -100;
+	attributes.width = attributes.height = 10;
+	attributes.override_redirect = TRUE;
+	/**for the server time  */
+	attributes.event_mask = GDK_PROPERTY_CHANGE_MASK;
+	s->window = gdk_window_new(NULL, &attributes, GDK_WA_X | GDK_WA_Y | GDK_WA_NOREDIR);
+	s->display = GDK_WINDOW_XDISPLAY(s->window);
+	s->xwindow = GDK_WINDOW_XID(s->window);
+	s->selection = gdk_x11_atom_to_xatom(selection);
+
+	/**in 4-byte units, less the request header  */
+	max_request = XExtendedMaxRequestSize(s->display);
+	if (!max_request)
+		max_request = XMaxRequestSize(s->display);
+	s->chunk = MIN((gsize) max_request * 4 - 100, SERVER_CHUNK_MAX);
+
+	if (!atom_utf8) {
+		atom_utf8 = XInternAtom(s->display, "UTF8_STRING", False);
+		atom_incr = XInternAtom(s->display, "INCR", False);
+		atom_targets = XInternAtom(s->display, "TARGETS", False);
+		atom_timestamp = XInternAtom(s->display, "TIMESTAMP", False);
+		atom_length = XInternAtom(s->display, "LENGTH", False);
+		atom_text = XInternAtom(s->display, "TEXT", False);
+		atom_text_plain_utf8 = XInternAtom(s->display, "text/plain;charset=utf-8", False);
+		atom_multiple = XInternAtom(s->display, "MULTIPLE", False);
+		atom_atom_pair = XInternAtom(s->display, "ATOM_PAIR", False);
+		/**the PropertyNotify of the requestors' windows  */
+		gdk_window_add_filter(NULL, transfer_filter, NULL);
+	}
+	gdk_window_add_filter(s->window, server_filter, s);
+	return s;
+}
+
+/***************************************************************************/
+/** Takes the selection to serve the text from. The server keeps a reference
+to it until another owner takes the selection; setting the text already
+served takes none.
+\n\b Arguments:
+\n\b Returns:	FALSE if the selection couldn't be had.
+****************************************************************************/
+gboolean selection_server_set(struct selection_server *s, struct shared_text *text)
+{
+	Time time = gtk_get_current_event_time();
+
+	if (GDK_CURRENT_TIME == time)
+		time = gdk_x11_get_server_time(s->window);
+	XSetSelectionOwner(s->display, s->selection, s->xwindow, time);
+	if (XGetSelectionOwner(s->display, s->selection) != s->xwindow) {
+		g_fprintf(stderr, "Unable to own the selection\n");
+		return FALSE;
+	}
+	s->time = time;
+	if (s->text != text) {
+		if (s->text)
+			shared_text_unref(s->text);
+		s->text = shared_text_ref(text);
+	}
+	return TRUE;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void transfer_free(struct server_transfer *t)
+{
+	transfers = g_slist_remove(transfers, t);
+	if (t->timeout)
+		g_source_remove(t->timeout);
+	/**a window of ours selects the events itself  */
+	if (!gdk_window_lookup(t->requestor)) {
+		GSList *l;
+		for (l = transfers; l; l = l->next)
+			if (((struct server_transfer *) l->data)->requestor == t->requestor)
+				break;
+		if (!l) {
+			gdk_error_trap_push();
+			XSelectInput(t->display, t->requestor, NoEventMask);
+			gdk_error_trap_pop();
+		}
+	}
+	shared_text_unref(t->text);
+	g_free(t);
+}
+
+/***************************************************************************/
+/** The end of a chunk of at most max bytes from offset that doesn't split a
+character.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gsize chunk_end(const struct shared_text *text, gsize offset, gsize max)
+{
+	gsize end = offset + max;
+
+	if (end >= text->len)
+		return text->len;
+	while (end > offset && (text->str[end] & 0xC0) == 0x80)
+		end--;
+	/**not a valid text: split it anyway  */
+	return end > offset ? end : offset + max;
+}
+
+/***************************************************************************/
+/** Writes the bytes of the text in the type: UTF8_STRING as they are,
+STRING converted to Latin-1.
+\n\b Arguments:
+\n\b Returns:	FALSE if the requestor is gone.
+****************************************************************************/
+static gboolean write_text(Display *display, Window requestor, Atom property, Atom type,
+	const gchar *str, gsize len)
+{
+	gchar *latin1 = NULL;
+	gsize written = len;
+
+	if (XA_STRING == type && len) {
+		latin1 = g_convert_with_fallback(str, len, "ISO-8859-1", "UTF-8", "?", NULL, &written, NULL);
+		if (!latin1)
+			written = 0;
+		str = latin1;
+	}
+	gdk_error_trap_push();
+	XChangeProperty(display, requestor, property, type, 8, PropModeReplace,
+		(const guchar *) (str ? str : ""), written);
+	g_free(latin1);
+	stats.chunks++;
+	stats.bytes += written;
+	return !gdk_error_trap_pop();
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static gboolean on_transfer_timeout(gpointer data)
+{
+	struct server_transfer *t = (struct server_transfer *) data;
+
+	if (g_get_monotonic_time() - t->activity < SERVER_INCR_TIMEOUT * G_USEC_PER_SEC)
+		return TRUE;
+	stats.timeouts++;
+	t->timeout = 0;
+	transfer_free(t);
+	return FALSE;
+}
+
+/***************************************************************************/
+/** Starts an INCR transfer: announces the size and waits for the requestor
+to delete the property.
+\n\b Arguments:
+\n\b Returns:	FALSE if the requestor is gone.
+****************************************************************************/
+static gboolean transfer_start(struct selection_server *s, Window requestor, Atom property, Atom type)
+{
+	struct server_transfer *t;
+	GSList *l;
+	/**STRING has a byte a character  */
+	long size = XA_STRING == type ? g_utf8_strlen(s->text->str, s->text->len) : s->text->len;
+
+	/**the requestor gave up the one before  */
+	for (l = transfers; l; l = l->next) {
+		t = (struct server_transfer *) l->data;
+		if (t->requestor == requestor && t->property == property) {
+			transfer_free(t);
+			break;
+		}
+	}
+
+	gdk_error_trap_push();
+	if (!gdk_window_lookup(requestor))
+		XSelectInput(s->display, requestor, PropertyChangeMask);
+	XChangeProperty(s->display, requestor, property, atom_incr, 32, PropModeReplace, (const guchar *) &size, 1);
+	if (gdk_error_trap_pop())
+		return FALSE;
+
+	t = g_new0(struct server_transfer, 1);
+	t->display = s->display;
+	t->requestor = requestor;
+	t->property = property;
+	t->type = type;
+	t->text = shared_text_ref(s->text);
+	t->chunk = s->chunk;
+	t->activity = g_get_monotonic_time();
+	t->timeout = g_timeout_add_seconds(SERVER_INCR_TIMEOUT, on_transfer_timeout, t);
+	transfers = g_slist_prepend(transfers, t);
+	stats.incr++;
+	return TRUE;
+}
+
+/***************************************************************************/
+/** Writes the next chunk of the transfer, the requestor has taken the last.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void transfer_next(struct server_transfer *t)
+{
+	gsize end;
+
+	if (t->done) {
+		transfer_free(t);
+		return;
+	}
+	end = chunk_end(t->text, t->offset, t->chunk);
+	/**an empty chunk ends the transfer  */
+	if (!write_text(t->display, t->requestor, t->property, t->type, t->text->str + t->offset, end - t->offset)) {
+		transfer_free(t);
+		return;
+	}
+	t->done = end == t->offset;
+	t->offset = end;
+	t->activity = g_get_monotonic_time();
+}
+
+/***************************************************************************/
+/** Writes the target to the property.
+\n\b Arguments:
+\n\b Returns:	FALSE if it's refused.
+****************************************************************************/
+static gboolean serve_target(struct selection_server *s, Window requestor, Atom property, Atom target)
+{
+	Atom type = atom_text_plain_utf8 == target ? target : atom_utf8;
+
+	if (atom_targets == target) {
+		Atom targets[] = { atom_targets, atom_multiple, atom_timestamp, atom_length, atom_utf8,
+			atom_text_plain_utf8, atom_text, XA_STRING };
+		gdk_error_trap_push();
+		XChangeProperty(s->display, requestor, property, XA_ATOM, 32, PropModeReplace,
+			(const guchar *) targets, G_N_ELEMENTS(targets));
+		return !gdk_error_trap_pop();
+	}
+	if (atom_timestamp == target || atom_length == target) {
+		long value = atom_timestamp == target ? (long) s->time : (long) s->text->len;
+		gdk_error_trap_push();
+		XChangeProperty(s->display, requestor, property, XA_INTEGER, 32, PropModeReplace,
+			(const guchar *) &value, 1);
+		return !gdk_error_trap_pop();
+	}
+	if (XA_STRING == target) {
+		if (s->text->len > s->chunk)
+			return transfer_start(s, requestor, property, XA_STRING);
+		return write_text(s->display, requestor, property, XA_STRING, s->text->str, s->text->len);
+	}
+	if (atom_utf8 != target && atom_text_plain_utf8 != target && atom_text != target)
+		return FALSE;
+	/**TEXT is the owner's choice of encoding  */
+	if (s->text->len > s->chunk)
+		return transfer_start(s, requestor, property, type);
+	return write_text(s->display, requestor, property, type, s->text->str, s->text->len);
+}
+
+/***************************************************************************/
+/** Answers each of the (target, property) pairs of a MULTIPLE request. The
+property of a pair that is refused is replaced by None in the list.
+\n\b Arguments:
+\n\b Returns:	FALSE if the list can't be read.
+****************************************************************************/
+static gboolean serve_multiple(struct selection_server *s, Window requestor, Atom property)
+{
+	Atom type;
+	gint format, result;
+	gulong items, after, i;
+	guchar *data = NULL;
+	Atom *pairs;
+
+	gdk_error_trap_push();
+	result = XGetWindowProperty(s->display, requestor, property, 0, G_MAXLONG / 4, False,
+		atom_atom_pair, &type, &format, &items, &after, &data);
+	if (gdk_error_trap_pop() || result != Success || !data) {
+		if (data)
+			XFree(data);
+		return FALSE;
+	}
+	if (32 != format || atom_atom_pair != type) {
+		XFree(data);
+		return FALSE;
+	}
+
+	pairs = (Atom *) data;
+	for (i = 0; i + 1 < items; i += 2)
+		if (None == pairs[i + 1] || atom_multiple == pairs[i] ||
+			!serve_target(s, requestor, pairs[i + 1], pairs[i]))
+			pairs[i + 1] = None;
+
+	gdk_error_trap_push();
+	XChangeProperty(s->display, requestor, property, atom_atom_pair, 32, PropModeReplace, data, items);
+	XFree(data);
+	return !gdk_error_trap_pop();
+}
+
+/***************************************************************************/
+/** Answers a request with SelectionNotify.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static void on_selection_request(struct selection_server *s, const XSelectionRequestEvent *e)
+{
+	XSelectionEvent reply = {0};
+	/**an obsolete client leaves the property to us  */
+	Atom property = None == e->property ? e->target : e->property;
+
+	stats.requests++;
+	reply.type = SelectionNotify;
+	reply.display = e->display;
+	reply.requestor = e->requestor;
+	reply.selection = e->selection;
+	reply.target = e->target;
+	reply.time = e->time;
+	reply.property = None;
+	/**the pairs of MULTIPLE are in the property, which can't be None  */
+	if (s->text && e->owner == s->xwindow && (CurrentTime == e->time || e->time >= s->time) &&
+		(atom_multiple == e->target ? None != e->property && serve_multiple(s, e->requestor, property) :
+		serve_target(s, e->requestor, property, e->target)))
+		reply.property = property;
+	else
+		stats.refused++;
+
+	gdk_error_trap_push();
+	XSendEvent(s->display, e->requestor, False, NoEventMask, (XEvent *) &reply);
+	XFlush(s->display);
+	gdk_error_trap_pop();
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static GdkFilterReturn server_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data)
+{
+	struct selection_server *s = (struct selection_server *) data;
+	XEvent *xevent = (XEvent *) gdk_xevent;
+
+	switch (xevent->type) {
+		case SelectionRequest:
+			if (xevent->xselectionrequest.selection != s->selection)
+				return GDK_FILTER_CONTINUE;
+			on_selection_request(s, &xevent->xselectionrequest);
+			return GDK_FILTER_REMOVE;
+		case SelectionClear:
+			if (xevent->xselectionclear.selection != s->selection)
+				return GDK_FILTER_CONTINUE;
+			/**not for the selection taken since  */
+			if (s->text && xevent->xselectionclear.time >= s->time) {
+				shared_text_unref(s->text);
+				s->text = NULL;
+			}
+			return GDK_FILTER_REMOVE;
+	}
+	return GDK_FILTER_CONTINUE;
+}
+
+/***************************************************************************/
+/** The requestor of an INCR transfer deleted the property: it wants the next
+chunk. The event goes on to the other filters.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static GdkFilterReturn transfer_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data)
+{
+	XEvent *xevent = (XEvent *) gdk_xevent;
+	GSList *l;
+
+	if (PropertyNotify != xevent->type || PropertyDelete != xevent->xproperty.state)
+		return GDK_FILTER_CONTINUE;
+	for (l = transfers; l; l = l->next) {
+		struct server_transfer *t = (struct server_transfer *) l->data;
+		if (t->requestor == xevent->xproperty.window && t->property == xevent->xproperty.atom) {
+			transfer_next(t);
+			break;
+		}
+	}
+	return GDK_FILTER_CONTINUE;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_server_print_stats(GString *s)
+{
+	g_string_append_printf(s,
+		_("Pastes served: %u, refused: %u, INCR: %u (timed out: %u), chunks: %u, %" G_GUINT64_FORMAT " KB\n"),
+		stats.requests, stats.refused, stats.incr, stats.timeouts, stats.chunks, stats.bytes / 1024);
+}
@@ -0,0 +1,35 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SELECTION_SERVER_H
+#define SELECTION_SERVER_H
+
+G_BEGIN_DECLS
+
+struct selection_server;
+
+struct selection_server *selection_server_new(GdkAtom selection);
+
+gboolean selection_server_set(struct selection_server *s, struct shared_text *text);
+
+void selection_server_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
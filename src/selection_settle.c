@@ -0,0 +1,274 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        selection_settle.c
+\n\b Description: Detects the end of a selection made with the mouse.
+
+PRIMARY changes while the user drags the pointer, or holds Shift and
+clicks. Only the final selection is worth saving, so the check waits until
+the button and Shift are released. With XInput2 the press and the release
+of the button are seen as raw events on the root window, which are delivered
+whichever client has the pointer grabbed; Shift is followed with the XKB
+modifier state. So whether a selection is still being made is known without
+asking the server (selection_settle_held()). Motion isn't selected, holding
+a drag costs no wakeups.
+
+Without XKB, the release of Shift is caught as a raw key event, selected only
+while a selection is waiting to settle, and the state isn't tracked. Without
+XInput2, selection_settle_wait() fails and the caller polls.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+#ifdef HAVE_XI2
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XInput2.h>
+#endif
+
+static selection_settle_func settle_func;
+
+static struct {
+	guint waits;
+	guint releases;  /**of the button or Shift, while waiting  */
+} stats;
+
+#ifdef HAVE_XI2
+
+static Display *display;
+static gboolean available;
+static int xi_opcode;
+static KeyCode shift_l, shift_r;
+static gboolean waiting;
+static guint settle_id;
+static gboolean tracking;     /**the button and Shift are followed  */
+static int xkb_event_base;
+static gboolean button_down;
+static gboolean shift_down;
+
+/***************************************************************************/
+/** Select the raw events on the root window: the presses and releases of the
+buttons while tracking, or else the releases of the button and the keys
+while waiting.
+\n\b Arguments:	on - waiting.
+\n\b Returns:
+****************************************************************************/
+static void select_raw_events(gboolean on)
+{
+	unsigned char mask[XIMaskLen(XI_LASTEVENT)];
+	XIEventMask event_mask;
+
+	memset(mask, 0, sizeof(mask));
+	if (tracking) {
+		XISetMask(mask, XI_RawButtonPress);
+		XISetMask(mask, XI_RawButtonRelease);
+	} else if (on) {
+		XISetMask(mask, XI_RawButtonRelease);
+		XISetMask(mask, XI_RawKeyRelease);
+	}
+	event_mask.deviceid = XIAllMasterDevices;
+	event_mask.mask_len = sizeof(mask);
+	event_mask.mask = mask;
+	XISelectEvents(display, DefaultRootWindow(display), &event_mask, 1);
+	XFlush(display);
+}
+
+/**runs the check outside of the event filter  */
+static gboolean settled(gpointer data)
+{
+	settle_id = 0;
+	if (settle_func)
+		settle_func();
+	return FALSE;
+}
+
+/***************************************************************************/
+/** Default GDK filter: catches the raw events, GDK doesn't know them, and
+looks at the XKB state ones on their way to GDK.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+static GdkFilterReturn settle_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer data)
+{
+	XGenericEventCookie *cookie = &((XEvent *) gdk_xevent)->xcookie;
+	gboolean own_data = FALSE;
+	gboolean release = FALSE;
+	GdkFilterReturn result = GDK_FILTER_REMOVE;
+
+	if (tracking && cookie->type == xkb_event_base) {
+		XkbEvent *xkb = (XkbEvent *) gdk_xevent;
+		if (XkbStateNotify == xkb->any.xkb_type) {
+			release = shift_down && !(xkb->state.mods & ShiftMask);
+			shift_down = (xkb->state.mods & ShiftMask) != 0;
+		}
+		result = GDK_FILTER_CONTINUE;
+	} else if (cookie->type != GenericEvent || cookie->extension != xi_opcode)
+		return GDK_FILTER_CONTINUE;
+	else {
+		if (!cookie->data)
+			own_data = XGetEventData(display, cookie);
+		if (cookie->data) {
+			XIRawEvent *raw = cookie->data;
+			if (XI_RawButtonPress == cookie->evtype && 1 == raw->detail)
+				button_down = TRUE;
+			else if (XI_RawButtonRelease == cookie->evtype && 1 == raw->detail) {
+				button_down = FALSE;
+				release = TRUE;
+			} else if (XI_RawKeyRelease == cookie->evtype)
+				release = (raw->detail == shift_l || raw->detail == shift_r);
+		}
+		if (own_data)
+			XFreeEventData(display, cookie);
+	}
+	/**both are released  */
+	if (tracking && (button_down || shift_down))
+		release = FALSE;
+
+	if (release && waiting) {
+		/**the owner got the release before our request for the selection  */
+		waiting = FALSE;
+		if (!tracking)
+			select_raw_events(FALSE);
+		stats.releases++;
+		if (!settle_id)
+			settle_id = g_idle_add(settled, NULL);
+	}
+	return result;
+}
+
+#endif /* HAVE_XI2 */
+
+/***************************************************************************/
+/** Set up the detection; func is called when a selection has settled.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_settle_init(selection_settle_func func)
+{
+#ifdef HAVE_XI2
+	int event, error;
+	int major = 2, minor = 0;
+	int xkb_opcode, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+	XkbStateRec state;
+	Window root, child;
+	int x, y;
+	unsigned int mask;
+#endif
+
+	settle_func = func;
+#ifdef HAVE_XI2
+	display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+	if (!XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error))
+		return;
+	if (XIQueryVersion(display, &major, &minor) != Success || major < 2)
+		return;
+
+	shift_l = XKeysymToKeycode(display, XK_Shift_L);
+	shift_r = XKeysymToKeycode(display, XK_Shift_R);
+	gdk_window_add_filter(NULL, settle_filter, NULL);
+	available = TRUE;
+
+	/**the state to start from is asked for once, then followed  */
+	if (XkbQueryExtension(display, &xkb_opcode, &xkb_event_base, &error, &xkb_major, &xkb_minor) &&
+		XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify, XkbModifierStateMask, XkbModifierStateMask) &&
+		XkbGetState(display, XkbUseCoreKbd, &state) == Success &&
+		XQueryPointer(display, DefaultRootWindow(display), &root, &child, &x, &y, &x, &y, &mask)) {
+		shift_down = (state.mods & ShiftMask) != 0;
+		button_down = (mask & Button1Mask) != 0;
+		tracking = TRUE;
+		select_raw_events(FALSE);
+	}
+#endif
+}
+
+/***************************************************************************/
+/** Wait for the button and Shift to be released.
+\n\b Arguments:
+\n\b Returns: FALSE if the release can't be detected, and has to be polled for
+****************************************************************************/
+gboolean selection_settle_wait(void)
+{
+#ifdef HAVE_XI2
+	if (!available)
+		return FALSE;
+	if (!waiting) {
+		waiting = TRUE;
+		if (!tracking)
+			select_raw_events(TRUE);
+		stats.waits++;
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/***************************************************************************/
+/** Whether a selection may still be in the making: the button or Shift is
+held. Known without a round trip to the server.
+\n\b Arguments:
+\n\b Returns:	FALSE if the state isn't tracked, and has to be asked for.
+****************************************************************************/
+gboolean selection_settle_held(gboolean *held)
+{
+#ifdef HAVE_XI2
+	if (tracking) {
+		*held = button_down || shift_down;
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+/***************************************************************************/
+/** Stop waiting, the selection was checked anyway.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_settle_cancel(void)
+{
+#ifdef HAVE_XI2
+	if (waiting) {
+		waiting = FALSE;
+		if (!tracking)
+			select_raw_events(FALSE);
+	}
+#endif
+}
+
+/***************************************************************************/
+/** Append the statistics of the detection to s.
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void selection_settle_print_stats(GString *s)
+{
+#ifdef HAVE_XI2
+	if (available) {
+		g_string_append_printf(s, _("Selection settle: XInput2, waits: %u, releases: %u\n"),
+			stats.waits, stats.releases);
+		return;
+	}
+#endif
+	g_string_append_printf(s, _("Selection settle: polled\n"));
+}
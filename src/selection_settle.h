@@ -0,0 +1,39 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SELECTION_SETTLE_H
+#define SELECTION_SETTLE_H
+
+G_BEGIN_DECLS
+
+typedef void (*selection_settle_func)(void);
+
+void selection_settle_init(selection_settle_func func);
+
+gboolean selection_settle_wait(void);
+
+gboolean selection_settle_held(gboolean *held);
+
+void selection_settle_cancel(void);
+
+void selection_settle_print_stats(GString *s);
+
+G_END_DECLS
+
+#endif
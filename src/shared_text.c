@@ -0,0 +1,140 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file ******************************************************************
+\n\b File:        shared_text.c
+\n\b Description: Reference-counted texts.
+
+A copied text goes through the saved clipboard contents, the history item,
+the blob store queue and the menu. They all hold a reference to the same
+buffer instead of copies of it, so a 20 MB clip stays one 20 MB allocation.
+
+A text also keeps its hash once computed. The same text is compared with
+the saved selection and looked up in the history, each time by the length
+and the hash first, so it is read in full only once more, to confirm a
+match.
+
+A text too large for memory is received into the blob store, and only its
+preview is held here, with the length and the hash of the whole.
+*/ /************************************************************************
+*/
+
+#include "rainbow-cm.h"
+
+/***************************************************************************/
+/** Makes a copy of the text.
+\n\b Arguments:	len - in bytes, or -1 if the text is NUL-terminated.
+\n\b Returns:
+****************************************************************************/
+struct shared_text *shared_text_new(const gchar *str, gssize len)
+{
+	if (len < 0)
+		len = strlen(str);
+	return shared_text_take(g_strndup(str, len), len);
+}
+
+/***************************************************************************/
+/** Takes the text allocated with g_malloc(), without copying it.
+\n\b Arguments:	len - in bytes, or -1 if the text is NUL-terminated.
+\n\b Returns:
+****************************************************************************/
+struct shared_text *shared_text_take(gchar *str, gssize len)
+{
+	struct shared_text * t = g_slice_new(struct shared_text);
+	t->ref = 1;
+	t->len = len < 0 ? strlen(str) : (gsize) len;
+	t->str = str;
+	t->hash = 0;
+	t->blob_len = 0;
+	t->spill = NULL;
+	return t;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+struct shared_text *shared_text_ref(struct shared_text *t)
+{
+	if (t)
+		g_atomic_int_inc(&t->ref);
+	return t;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:
+****************************************************************************/
+void shared_text_unref(struct shared_text *t)
+{
+	if (t && g_atomic_int_dec_and_test(&t->ref)) {
+		g_free(t->str);
+		/**a capture that didn't make it to the history  */
+		if (t->spill) {
+			unlink(t->spill);
+			g_free(t->spill);
+		}
+		g_slice_free(struct shared_text, t);
+	}
+}
+
+/***************************************************************************/
+/** The hash is computed on the first call. The text doesn't change, so
+another thread can only ever store the same value.
+\n\b Arguments:
+\n\b Returns:	history_text_hash() of the text.
+****************************************************************************/
+guint64 shared_text_hash(const struct shared_text *t)
+{
+	if (!t->hash)
+		((struct shared_text *) t)->hash = history_text_hash(t->str, t->len);
+	return t->hash;
+}
+
+/***************************************************************************/
+/** .
+\n\b Arguments:
+\n\b Returns:	length of the whole text, of which a blob preview holds the
+beginning.
+****************************************************************************/
+guint32 shared_text_length(const struct shared_text *t)
+{
+	return t->blob_len ? t->blob_len : t->len;
+}
+
+/***************************************************************************/
+/** A text in the blob store is known by its length and hash, as the store
+names its files.
+\n\b Arguments:
+\n\b Returns:	TRUE if both are NULL or hold the same text.
+****************************************************************************/
+gboolean shared_text_equal(const struct shared_text *a, const struct shared_text *b)
+{
+	if (a == b)
+		return TRUE;
+	if (!a || !b || shared_text_length(a) != shared_text_length(b))
+		return FALSE;
+	if (shared_text_hash(a) != shared_text_hash(b))
+		return FALSE;
+	if (a->blob_len || b->blob_len)
+		return TRUE;
+	return memcmp(a->str, b->str, a->len) == 0;
+}
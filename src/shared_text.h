@@ -0,0 +1,55 @@
+/*
+ * Rainbow CM
+ *
+ * Copyright (C) 2015-2020 Vadim Ushakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SHARED_TEXT_H
+#define SHARED_TEXT_H
+
+G_BEGIN_DECLS
+
+/**an immutable, reference-counted text: the clipboards, the history and the
+ menu share one copy of it  */
+struct shared_text {
+	gint ref;     /**changed atomically, the writer thread holds references too  */
+	guint32 len;  /**bytes, without the terminating NUL  */
+	gchar *str;   /**NUL-terminated, never modified  */
+	guint64 hash; /**history_text_hash() of the text, 0 until it's needed  */
+	guint32 blob_len; /**of the whole text if this is the preview of one received
+	                     into the blob store, else 0; the hash is of the whole text  */
+	gchar *spill; /**the file the whole text was received into, until the history
+	                 takes it; removed with the text otherwise  */
+};
+
+struct shared_text *shared_text_new(const gchar *str, gssize len);
+
+struct shared_text *shared_text_take(gchar *str, gssize len);
+
+struct shared_text *shared_text_ref(struct shared_text *t);
+
+void shared_text_unref(struct shared_text *t);
+
+guint64 shared_text_hash(const struct shared_text *t);
+
+guint32 shared_text_length(const struct shared_text *t);
+
+gboolean shared_text_equal(const struct shared_text *a, const struct shared_text *b);
+
+G_END_DECLS
+
+#endif